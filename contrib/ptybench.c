@@ -0,0 +1,396 @@
+/*
+ * ptybench - keystroke to paint latency of happygrep
+ *
+ * Runs happygrep under a pseudo-terminal on generated trees of 1k and
+ * more matching lines, replays scripted keys and measures, for every key,
+ * the time until the terminal output of its frame has been written and
+ * how many bytes that frame took. A frame ends when the output has been
+ * quiet for a few milliseconds; the quiet time itself is not counted.
+ *
+ *     make bench
+ *     make bench BENCH_SIZES=1000,10000000
+ *     contrib/ptybench [-n LINES,...] [-q QUIET_MS] ./happygrep
+ */
+
+#define _GNU_SOURCE     /* memmem() */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+#define BENCH_ROWS          30
+#define BENCH_COLS          100
+#define BENCH_KEYS          200     /* Keys per scenario. */
+#define BENCH_RESIZES       50
+#define BENCH_FILE_LINES    100000  /* Lines per generated file. */
+#define BENCH_LOAD_TIMEOUT  (30 * 60 * 1000)
+#define BENCH_KEY_TIMEOUT   2000
+
+static int opt_quiet = 20;      /* Milliseconds without output that end a frame. */
+
+struct frame {
+    double latency;             /* Milliseconds from the key to the last byte. */
+    size_t bytes;
+};
+
+struct child {
+    pid_t pid;
+    int fd;
+    char carry[16];             /* The end of the last read. */
+    size_t carry_len;
+    bool loaded;                /* The "load N lines" status was written. */
+    bool exited;
+};
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Spot the status that ends loading, even when split across reads. */
+static void watch_status(struct child *child, const char *buf, size_t n)
+{
+    char joined[sizeof(child->carry) * 2];
+    size_t head = n < sizeof(child->carry) ? n : sizeof(child->carry);
+
+    memcpy(joined, child->carry, child->carry_len);
+    memcpy(joined + child->carry_len, buf, head);
+    if (memmem(joined, child->carry_len + head, " lines", 6) || memmem(buf, n, " lines", 6))
+        child->loaded = true;
+
+    child->carry_len = head;
+    memcpy(child->carry, buf + n - head, head);
+}
+
+/* Read one frame: wait up to timeout for output to start, then read until
+ * it has been quiet. Returns false when nothing came or the child is gone. */
+static bool read_frame(struct child *child, double start, int timeout, struct frame *frame)
+{
+    struct pollfd pfd = { child->fd, POLLIN };
+    double last = start;
+    char buf[65536];
+
+    frame->bytes = 0;
+    frame->latency = 0;
+
+    for (;;) {
+        int wait = frame->bytes ? opt_quiet : timeout;
+        ssize_t n;
+
+        if (poll(&pfd, 1, wait) <= 0)
+            break;
+
+        n = read(child->fd, buf, sizeof(buf));
+        if (n <= 0) {
+            child->exited = true;
+            break;
+        }
+
+        last = now_ms();
+        frame->bytes += n;
+
+        watch_status(child, buf, n);
+    }
+
+    frame->latency = last - start;
+    return frame->bytes > 0;
+}
+
+static bool child_start(struct child *child, const char *happygrep, const char *dir)
+{
+    struct winsize ws = { BENCH_ROWS, BENCH_COLS };
+
+    memset(child, 0, sizeof(*child));
+    child->pid = forkpty(&child->fd, NULL, NULL, &ws);
+    if (child->pid < 0)
+        return false;
+
+    if (!child->pid) {
+        if (chdir(dir) < 0)
+            _exit(127);
+        setenv("TERM", "xterm", 0);
+        execl(happygrep, "happygrep", "match", "--no-daemon", "--no-cache", (char *) NULL);
+        _exit(127);
+    }
+
+    return true;
+}
+
+static void child_stop(struct child *child)
+{
+    int status;
+
+    if (!child->exited && write(child->fd, "q", 1) == 1) {
+        struct frame frame;
+
+        while (!child->exited && read_frame(child, now_ms(), 1000, &frame))
+            ;
+    }
+    kill(child->pid, SIGTERM);
+    waitpid(child->pid, &status, 0);
+    close(child->fd);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void print_frames(unsigned long lines, const char *name, struct frame *frames, int nframes, int nkeys)
+{
+    double latency[BENCH_KEYS * 2];
+    size_t bytes = 0;
+    int i;
+
+    for (i = 0; i < nframes; i++) {
+        latency[i] = frames[i].latency;
+        bytes += frames[i].bytes;
+    }
+    qsort(latency, nframes, sizeof(latency[0]), compare_double);
+
+    if (!nframes) {
+        printf("%10lu  %-12s %5d %6d  %8s %8s %8s %12s\n", lines, name, nkeys, 0, "-", "-", "-", "-");
+        return;
+    }
+
+    printf("%10lu  %-12s %5d %6d  %8.2f %8.2f %8.2f %12zu\n", lines, name, nkeys, nframes,
+           latency[nframes / 2], latency[nframes * 95 / 100], latency[nframes - 1],
+           bytes / nframes);
+}
+
+/* Send each key and wait for its frame. */
+static void run_keys(struct child *child, unsigned long lines, const char *name, const char *keys)
+{
+    struct frame frames[BENCH_KEYS * 2];
+    int nframes = 0, nkeys = strlen(keys), i;
+
+    for (i = 0; i < nkeys && !child->exited; i++) {
+        double start = now_ms();
+
+        if (write(child->fd, &keys[i], 1) != 1)
+            break;
+        if (read_frame(child, start, BENCH_KEY_TIMEOUT, &frames[nframes]))
+            nframes++;
+    }
+
+    print_frames(lines, name, frames, nframes, nkeys);
+}
+
+/* Send all keys at once and time until the output settles. */
+static void run_burst(struct child *child, unsigned long lines, const char *name, const char *keys)
+{
+    struct frame frame, more;
+    double start = now_ms();
+    size_t len = strlen(keys);
+
+    if (child->exited || write(child->fd, keys, len) != len)
+        return;
+
+    read_frame(child, start, BENCH_KEY_TIMEOUT, &frame);
+    while (!child->exited && read_frame(child, start, opt_quiet, &more)) {
+        frame.bytes += more.bytes;
+        frame.latency = more.latency;
+    }
+
+    printf("%10lu  %-12s %5zu  %6s  total %.2f ms, %.0f keys/s, %zu bytes\n", lines, name,
+           len, "-", frame.latency, frame.latency > 0 ? len * 1e3 / frame.latency : 0,
+           frame.bytes);
+}
+
+static void run_resizes(struct child *child, unsigned long lines)
+{
+    static const struct winsize sizes[] = {
+        { 24, 80 }, { 40, 120 }, { 20, 60 }, { BENCH_ROWS, BENCH_COLS },
+    };
+    struct frame frames[BENCH_RESIZES];
+    int nframes = 0, i;
+
+    for (i = 0; i < BENCH_RESIZES && !child->exited; i++) {
+        double start = now_ms();
+
+        /* The terminal sends SIGWINCH to happygrep. */
+        if (ioctl(child->fd, TIOCSWINSZ, &sizes[i % 4]) < 0)
+            break;
+        if (read_frame(child, start, BENCH_KEY_TIMEOUT, &frames[nframes]))
+            nframes++;
+    }
+
+    print_frames(lines, "resize", frames, nframes, BENCH_RESIZES);
+}
+
+static char *repeat(char *keys, const char *pattern, int n)
+{
+    size_t len = strlen(pattern);
+    int i;
+
+    for (i = 0; i < n; i++)
+        memcpy(keys + i * len, pattern, len);
+    keys[n * len] = 0;
+    return keys;
+}
+
+/* A tree with the given number of lines matching "match". */
+static bool make_tree(const char *dir, unsigned long lines)
+{
+    unsigned long line = 0, file;
+
+    if (mkdir(dir, 0700) < 0)
+        return false;
+
+    for (file = 0; line < lines; file++) {
+        char path[PATH_MAX];
+        FILE *fp;
+
+        if (snprintf(path, sizeof(path), "%s/f%05lu.txt", dir, file) >= sizeof(path))
+            return false;
+        fp = fopen(path, "w");
+        if (!fp)
+            return false;
+        for (; line < lines && (line % BENCH_FILE_LINES || !ftell(fp)); line++)
+            fprintf(fp, "%09lu\tmatch the benchmark line %lu\n", line, line % 997);
+        fclose(fp);
+    }
+
+    return true;
+}
+
+static void bench(const char *happygrep, const char *dir, unsigned long lines)
+{
+    /* The view scrolls this many lines, paging past them would stop. */
+    int height = BENCH_ROWS - 2;
+    int pages = lines / height > 1 ? lines / height - 1 : 0;
+    char keys[BENCH_KEYS * 2 + 1];
+    struct child child;
+    struct frame frame = { 0 };
+    double start = now_ms();
+
+    if (pages > BENCH_KEYS / 2)
+        pages = BENCH_KEYS / 2;
+
+    if (!child_start(&child, happygrep, dir)) {
+        fprintf(stderr, "ptybench: cannot start %s: %s\n", happygrep, strerror(errno));
+        return;
+    }
+
+    /* Loading ends with a "load N lines" status. */
+    while (!child.exited && !child.loaded &&
+           now_ms() - start < BENCH_LOAD_TIMEOUT) {
+        struct frame more;
+
+        if (read_frame(&child, start, 1000, &more)) {
+            frame.bytes += more.bytes;
+            frame.latency = more.latency;
+        }
+    }
+
+    if (child.exited) {
+        printf("%10lu  happygrep exited while loading\n", lines);
+        child_stop(&child);
+        return;
+    }
+    printf("%10lu  %-12s %5s %6s  %8.2f %8s %8s %12zu\n", lines, "load", "-", "1",
+           frame.latency, "-", "-", frame.bytes);
+
+    run_keys(&child, lines, "j", repeat(keys, "j", BENCH_KEYS));
+    run_keys(&child, lines, "k", repeat(keys, "k", BENCH_KEYS));
+    run_burst(&child, lines, "j burst", repeat(keys, "j", BENCH_KEYS));
+    run_burst(&child, lines, "k burst", repeat(keys, "k", BENCH_KEYS));
+    run_keys(&child, lines, "f", repeat(keys, "f", pages));
+    run_keys(&child, lines, "F", repeat(keys, "F", pages));
+    run_keys(&child, lines, "H/L", repeat(keys, "LH", BENCH_KEYS / 2));
+    run_resizes(&child, lines);
+
+    if (child.exited)
+        printf("%10lu  happygrep exited during the run\n", lines);
+    child_stop(&child);
+}
+
+static void remove_tree(const char *dir)
+{
+    char cmd[PATH_MAX + 16];
+
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+    if (system(cmd))
+        fprintf(stderr, "ptybench: could not remove %s\n", dir);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *sizes = "1000,100000,1000000";
+    char happygrep[PATH_MAX], root[] = "/tmp/happygrep-bench.XXXXXX";
+    const char *size;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:q:")) != -1) {
+        switch (opt) {
+        case 'n':
+            sizes = optarg;
+            break;
+        case 'q':
+            opt_quiet = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: ptybench [-n LINES,...] [-q QUIET_MS] HAPPYGREP\n");
+            return 2;
+        }
+    }
+
+    if (optind + 1 != argc || !realpath(argv[optind], happygrep)) {
+        fprintf(stderr, "usage: ptybench [-n LINES,...] [-q QUIET_MS] HAPPYGREP\n");
+        return 2;
+    }
+
+    if (!mkdtemp(root)) {
+        perror("ptybench: mkdtemp");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("happygrep pty benchmark, %dx%d terminal, frames end after %d ms of quiet\n\n",
+           BENCH_COLS, BENCH_ROWS, opt_quiet);
+    printf("%10s  %-12s %5s %6s  %8s %8s %8s %12s\n", "lines", "scenario", "keys",
+           "frames", "p50 ms", "p95 ms", "max ms", "bytes/frame");
+
+    for (size = sizes; *size; size += strcspn(size, ",") + !!size[strcspn(size, ",")]) {
+        unsigned long lines = strtoul(size, NULL, 10);
+        char dir[PATH_MAX];
+
+        if (!lines)
+            continue;
+
+        snprintf(dir, sizeof(dir), "%s/%lu", root, lines);
+        if (!make_tree(dir, lines)) {
+            fprintf(stderr, "ptybench: cannot create %s: %s\n", dir, strerror(errno));
+            break;
+        }
+        bench(happygrep, dir, lines);
+        remove_tree(dir);
+    }
+
+    rmdir(root);
+    return 0;
+}
@@ -1,3 +1,7 @@
+#ifdef __linux__
+#define _GNU_SOURCE     /* statx() */
+#endif
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -7,6 +11,46 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#ifndef __linux__
+#include <sys/param.h>
+#include <sys/mount.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#ifdef STATX_BASIC_STATS
+#define HAVE_STATX
+#endif
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_SINGLE_MMAP)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <locale.h>
 #include <langinfo.h>
@@ -14,21 +58,19 @@
 
 #include <ncursesw/ncurses.h>
 
+#if __GNUC__ >= 3
+#define __NORETURN __attribute__((__noreturn__))
+#else
+#define __NORETURN
+#endif
+
 static void die(const char *err, ...);
 static void quit(int sig);
+static void interrupt(int sig);
 static void report(const char *msg, ...);
 static void init_colors(void);
 static void init(void);
 
-/* annoying is the "\\" escape sign, why double? C string needs one for "\" and
- bash needs another for "(", "!" and ")". */
-
-#define FIND_CMD \
-"find . \\( -name '.?*' -o -name tags \\) -prune -o -exec grep -in %s {} +"
-
-#define FIND_CMDD \
-"find . \\( -name '.?*' -o -name %s -o -name tags \\) -prune -o -exec grep -in %s {} +"
-
 /* There must be no space between + and %s.*/
 #define VIM_CMD  "vim +%s %s"
 
@@ -54,6 +96,73 @@ static iconv_t opt_iconv_out = ICONV_NONE;
 
 static int opt_tab_size = 8;
 
+#define SEARCH_GLOBS    8       /* --glob options per query. */
+#define SEARCH_PATHS    16      /* Directories and files per query. */
+
+/* What to search for and where. A query is shared read-only by all the
+ * threads of a search, so the daemon can run several at once. */
+struct search_query {
+    char pattern[SIZEOF_STR];
+    char ignore[NAME_MAX + 1];
+    unsigned long max_count;    /* Matches per file, 0 is no limit. */
+    unsigned long max_results;  /* Matches in total, 0 is no limit. */
+    char root[PATH_MAX];        /* Names are reported relative to it. */
+    int rootfd;
+    regex_t regex;              /* Run over blocks of lines. */
+    regex_t line_regex;         /* Run line by line, for "^..." */
+    bool icase;                 /* Ignore case, see -s, -S and -I. */
+    bool word;                  /* Match whole words only. */
+    size_t len;                 /* Of the pattern. */
+    /* The start of the first match in [pos, end), which starts a line.
+     * Set by search_compile() to the kernel for the options. */
+    const char *(*find)(const struct search_query *query, const char *pos, const char *end);
+    bool count;                 /* One record per file with its number of matches. */
+    bool list;                  /* One record per file walked, nothing is read. */
+    bool xdev;                  /* Stay on the file system of the root. */
+    bool follow;                /* Descend into symlinked directories. */
+    bool git;                   /* Take the files from the git index. */
+    bool untracked;             /* With git, walk for untracked files too. */
+    bool dedup;                 /* Search identical files once. */
+    char file[PATH_MAX];        /* Search only this file when set. */
+
+    /* Filters the walker applies to files, see search_wanted(). */
+    unsigned int types;         /* Bits of file_types[], 0 is any type. */
+    char globs[SEARCH_GLOBS][NAME_MAX + 1];     /* "!" in front excludes. */
+    int nglobs;
+    off_t max_filesize;         /* 0 is no limit. */
+    time_t newer;               /* Modified at or after, 0 is any time. */
+
+    /* The directories and files to search, relative to root, which is
+     * searched itself when there are none. Names found below one start
+     * with it. */
+    char paths[SEARCH_PATHS][PATH_MAX];
+    int npaths;
+};
+
+static struct search_query opt_query = { "", "", 0, 0, ".", AT_FDCWD };
+static bool opt_daemon;
+static bool opt_no_daemon;
+static bool opt_no_cache;
+static bool opt_print;
+static char opt_socket[PATH_MAX];
+
+/* How matchers read files. */
+enum search_io {
+    SEARCH_IO_PREAD,            /* One blocking open and pread at a time. */
+    SEARCH_IO_URING,            /* Batches of small files through io_uring. */
+};
+
+static enum search_io opt_io = SEARCH_IO_PREAD;
+
+/* Whether the pattern ignores case. */
+enum search_case {
+    SEARCH_CASE_IGNORE,         /* Like grep -i, the default. */
+    SEARCH_CASE_SMART,          /* Unless the pattern has upper case. */
+    SEARCH_CASE_SENSITIVE,
+};
+
+static enum search_case opt_case = SEARCH_CASE_IGNORE;
+
 /* User action requests. */
 enum request {
     /* Offset all requests to avoid conflicts with ncurses getch values. */
@@ -61,10 +170,23 @@ enum request {
 
     /* XXX: Keep the view request first and in sync with views[]. */
     REQ_VIEW_MAIN,
+    REQ_VIEW_COUNTS,
+    REQ_VIEW_FILES,
 
     REQ_VIEW_CLOSE,
     REQ_SCREEN_RESIZE,
     REQ_OPEN_VIM,
+    REQ_ENTER,
+    REQ_STOP_LOADING,
+    REQ_REPLACE,
+    REQ_REPLACE_LINE,
+    REQ_SORT,
+    REQ_NEXT_FILE,
+    REQ_PREV_FILE,
+    REQ_GOTO,
+    REQ_FIND,
+    REQ_FIND_NEXT,
+    REQ_FIND_PREV,
 
     REQ_MOVE_PGDN,
     REQ_MOVE_PGUP,
@@ -76,10 +198,16 @@ enum request {
     REQ_MOVE_DOWN,
 };
 
+struct dup_group;
+
 struct fileinfo {
     char name[128];
     char content[128];
-    char number[6];
+    char number[12];
+    unsigned long lineno;
+    struct dup_group *dup;      /* Files with the same content, see --dedup. */
+    size_t expanded;            /* Copies listed below it in the main view. */
+    bool copy;                  /* Listed for the record above. */
 };
 
 /**
@@ -95,6 +223,8 @@ struct keymap {
 
 static struct keymap keymap[] = {
     { 'm',      REQ_VIEW_MAIN },
+    { 'c',      REQ_VIEW_COUNTS },
+    { 'p',      REQ_VIEW_FILES },
     { 'q',      REQ_VIEW_CLOSE },
 
     { 'f',      REQ_MOVE_PGDN },
@@ -111,6 +241,22 @@ static struct keymap keymap[] = {
     { 'e',      REQ_OPEN_VIM},
     { KEY_RIGHT,      REQ_OPEN_VIM},
 
+    { '\r',     REQ_ENTER },
+    { KEY_ENTER,      REQ_ENTER },
+
+    { 'z',      REQ_STOP_LOADING },
+
+    { 'r',      REQ_REPLACE },
+    { 'R',      REQ_REPLACE_LINE },
+    { 'o',      REQ_SORT },
+
+    { 'J',      REQ_NEXT_FILE },
+    { 'K',      REQ_PREV_FILE },
+    { ':',      REQ_GOTO },
+    { '/',      REQ_FIND },
+    { 'n',      REQ_FIND_NEXT },
+    { 'N',      REQ_FIND_PREV },
+
     /* Use the ncurses SIGWINCH handler. */
     { KEY_RESIZE,   REQ_SCREEN_RESIZE },
 };
@@ -143,779 +289,8089 @@ string_ncopy(char *dst, const char *src, int dstlen)
 #define string_copy(dst, src) \
     string_ncopy(dst, src, sizeof(dst))
 
-/*add single quotes to arguments passed by command line,
- *for example, grep '\\' test
- *to find lines containing backslashes in the file named test.
- *If use double quotes, the command above will probably evaluate not run.
- **/
+/*
+ * Profiling
+ *
+ * With --profile the search counts what it does and times each phase,
+ * and a summary goes to stderr on exit. Phase times are summed over the
+ * threads that ran them, so walk, read and match can add up to more than
+ * the wall time. Every probe first tests opt_profile, which is all they
+ * cost when it is off.
+ */
 
-char* strcat1(char *dest, const char *src)
-{
-    size_t i;
-    size_t src_len = strlen(src);
+enum profile_phase {
+    PROFILE_WALK,               /* Listing directories and queueing files. */
+    PROFILE_READ,               /* Waiting for file data. */
+    PROFILE_MATCH,              /* Running the pattern over the data. */
+    PROFILE_COLLECT,            /* Taking records into the view. */
+    PROFILE_PAINT,              /* Drawing lines and handling keys. */
+    PROFILE_PHASES,
+};
 
-    dest[0] = '\'';
+static const char *profile_phase_names[] = {
+    "walk", "read", "match", "collect", "paint",
+};
 
-    for (i = 0 ; src[i] != '\0' ; i++) {
-        if (src[0] == '-') {
-            dest[1] = '\\';
-            dest[i + 2] = src[i];
-        }
-        else if (src[i] == '/') {
-            dest[i + 1] = '\'';
-            dest[i + 2] = '\0';
-            return dest;
-        }
-        else
-            dest[i + 1] = src[i];
-    }
+enum profile_skip {
+    PROFILE_SKIP_IGNORED,
+    PROFILE_SKIP_SPECIAL,
+    PROFILE_SKIP_SEEN,
+    PROFILE_SKIP_OTHER_FS,
+    PROFILE_SKIP_LINK,
+    PROFILE_SKIP_REFINED,
+    PROFILE_SKIP_FILTER,
+    PROFILE_SKIP_BINARY,
+    PROFILE_SKIP_OPEN,
+    PROFILE_SKIP_COPY,
+    PROFILE_SKIPS,
+};
 
-    if (src[0] == '-') {
-        dest[src_len + 2] = '\'';
-        dest[src_len + 3] = '\0';
-    }
-    else {
-        dest[src_len + 1] = '\'';
-        dest[src_len + 2] = '\0';
-    }
+static const char *profile_skip_names[] = {
+    "ignored by name",
+    "special file",
+    "inode already walked",
+    "other file system",
+    "symlinked directory",
+    "ruled out by an earlier query",
+    "filtered by type, glob, size or age",
+    "binary",
+    "could not be opened",
+    "identical to a file searched",
+};
 
-    return dest;
-}
+#define PROFILE_TOP     10      /* Slowest files and directories kept. */
 
-struct view {
-    const char *name;
+struct profile_slow {
+    unsigned long long ns;
+    char path[PATH_MAX];
+};
 
-    /* Rendering */
-    bool (*read)(struct view *view, char *line);
-    bool (*render)(struct view *view, unsigned int lineno);
-    WINDOW *win;
-    WINDOW *title;
-    int height, width;
+struct profile_stamp {
+    unsigned long long wall, cpu;
+};
 
-    /* Navigation */
-    unsigned long offset;    /* Offset of the window top */
-    unsigned long lineno;    /* Current line number */
+static struct {
+    pthread_mutex_t lock;
+    unsigned long long wall[PROFILE_PHASES];
+    unsigned long long cpu[PROFILE_PHASES];
+    unsigned long long skipped[PROFILE_SKIPS];
+    unsigned long long bytes_read;
+    unsigned long long files_opened;
+    unsigned long long dirs_read, dirs_cached;
+    unsigned long long allocs, alloc_bytes;
+    struct profile_slow files[PROFILE_TOP];
+    struct profile_slow dirs[PROFILE_TOP];
+    struct profile_stamp started;   /* Of the process, in process CPU time. */
+    char io[PATH_MAX + 256];    /* Where the last search's I/O tuning ended. */
+    const char *searcher;       /* Who searched, when not this process. */
+} profile = { PTHREAD_MUTEX_INITIALIZER };
+
+static bool opt_profile;
+
+#define PROFILE_COUNT(counter, n) \
+    do { if (opt_profile) __sync_fetch_and_add(&profile.counter, (n)); } while (0)
+
+#define PROFILE_ALLOC(size) \
+    do { PROFILE_COUNT(allocs, 1); PROFILE_COUNT(alloc_bytes, (size)); } while (0)
+
+static inline unsigned long long profile_clock(clockid_t clock)
+{
+    struct timespec ts;
 
-    /* Buffering */
-    unsigned long lines;    /* Total number of lines */
-    void **line;        /* Line index */
-    const char *cmd;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    /* filename */
-    char file[BUFSIZ];
+static inline void profile_start(struct profile_stamp *stamp)
+{
+    if (!opt_profile)
+        return;
+    stamp->wall = profile_clock(CLOCK_MONOTONIC);
+    stamp->cpu = profile_clock(CLOCK_THREAD_CPUTIME_ID);
+}
 
-    /* Loading */
-    FILE *pipe;
-};
+/* Add the time since the stamp to a phase and return the wall part. */
+static unsigned long long
+profile_end(enum profile_phase phase, const struct profile_stamp *stamp)
+{
+    unsigned long long wall, cpu;
 
-static int view_driver(struct view *view, int key);
-static int update_view(struct view *view);
-static bool begin_update(struct view *view);
-static void end_update(struct view *view);
-static void redraw_view_from(struct view *view, int lineno);
-static void redraw_view(struct view *view);
-static void redraw_display(bool clear);
-static bool default_read(struct view *view, char *line);
-static bool default_render(struct view *view, unsigned int lineno);
-static void navigate_view(struct view *view, int request);
-static void navigate_view_pg(struct view *view, int request);
-static void move_view(struct view *view, int lines);
-static void update_title_win(struct view *view);
-static void open_view(struct view *prev);
-static void resize_display(void);
-static void logout(const char* fmt, ...);
-/* declaration end */
+    if (!opt_profile)
+        return 0;
 
-static bool g_startup = true;
+    wall = profile_clock(CLOCK_MONOTONIC) - stamp->wall;
+    cpu = profile_clock(CLOCK_THREAD_CPUTIME_ID) - stamp->cpu;
+    __sync_fetch_and_add(&profile.wall[phase], wall);
+    __sync_fetch_and_add(&profile.cpu[phase], cpu);
+    return wall;
+}
 
-static struct view main_view = {
-    "main",
-    default_read,
-    default_render,
-};
+/* Keep the path if it is among the slowest, slowest first. */
+static void profile_slow(struct profile_slow *top, const char *path, unsigned long long ns)
+{
+    int i;
 
-/* The display array of active views and the index of the current view. */
-static struct view *display[1];
-static unsigned int current_view;
+    /* Unlocked, a stale minimum only costs taking the lock. */
+    if (!opt_profile || ns <= top[PROFILE_TOP - 1].ns)
+        return;
 
-#define foreach_view(view, i) \
-    for (i = 0; i < ARRAY_SIZE(display) && (view = display[i]); i++)
+    pthread_mutex_lock(&profile.lock);
+    if (ns > top[PROFILE_TOP - 1].ns) {
+        for (i = PROFILE_TOP - 1; i > 0 && top[i - 1].ns < ns; i--)
+            top[i] = top[i - 1];
+        top[i].ns = ns;
+        string_copy(top[i].path, path);
+    }
+    pthread_mutex_unlock(&profile.lock);
+}
 
-static bool cursed = false;
-static WINDOW *status_win;
-static char fmt_cmd[BUFSIZ];
-static char vim_cmd[BUFSIZ];
+static void profile_init(void)
+{
+    profile.started.wall = profile_clock(CLOCK_MONOTONIC);
+    profile.started.cpu = profile_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+static void profile_report(FILE *fp)
+{
+    struct profile_stamp total;
+    int i;
+
+    if (!opt_profile)
+        return;
+
+    total.wall = profile_clock(CLOCK_MONOTONIC) - profile.started.wall;
+    total.cpu = profile_clock(CLOCK_PROCESS_CPUTIME_ID) - profile.started.cpu;
+
+    fprintf(fp, "happygrep profile: %.3fs wall, %.3fs cpu\n",
+            total.wall / 1e9, total.cpu / 1e9);
+    if (profile.searcher)
+        fprintf(fp, "  (searched by %s, read and match here only cover its output)\n",
+                profile.searcher);
+
+    fprintf(fp, "\n  %-10s %12s %12s\n", "phase", "wall", "cpu");
+    for (i = 0; i < PROFILE_PHASES; i++)
+        fprintf(fp, "  %-10s %11.3fs %11.3fs\n", profile_phase_names[i],
+                profile.wall[i] / 1e9, profile.cpu[i] / 1e9);
+
+    fprintf(fp, "\n  directories read  %llu, from cache %llu\n",
+            profile.dirs_read, profile.dirs_cached);
+    fprintf(fp, "  files opened      %llu\n", profile.files_opened);
+    fprintf(fp, "  bytes read        %llu (%.1f MB)\n",
+            profile.bytes_read, profile.bytes_read / 1048576.0);
+    fprintf(fp, "  allocations       %llu (%.1f MB)\n",
+            profile.allocs, profile.alloc_bytes / 1048576.0);
+
+    if (*profile.io)
+        fprintf(fp, "  io policy         %s\n", profile.io);
+
+    for (i = 0; i < PROFILE_SKIPS; i++)
+        if (profile.skipped[i])
+            fprintf(fp, "  skipped, %-29s %llu\n", profile_skip_names[i], profile.skipped[i]);
+
+    if (profile.files[0].ns)
+        fprintf(fp, "\n  slowest files:\n");
+    for (i = 0; i < PROFILE_TOP && profile.files[i].ns; i++)
+        fprintf(fp, "  %10.3fms  %s\n", profile.files[i].ns / 1e6, profile.files[i].path);
+
+    if (profile.dirs[0].ns)
+        fprintf(fp, "\n  slowest directories:\n");
+    for (i = 0; i < PROFILE_TOP && profile.dirs[i].ns; i++)
+        fprintf(fp, "  %10.3fms  %s\n", profile.dirs[i].ns / 1e6, profile.dirs[i].path);
+}
 
 /*
- * Line-oriented content detection.
+ * Directory listings
+ *
+ * The walker reads each directory into a listing of its entries with
+ * their mode, size and mtime. The daemon keeps the listings in a cache
+ * and reuses one for as long as the directory's own mtime is unchanged,
+ * so an unchanged tree is walked without a single readdir().
  */
 
-#define LINE_INFO \
-/*   Line type     String    Foreground     Background    Attributes
- *   ---------     -------   ----------     ----------    ---------- */ \
-/* UI colors */ \
-LINE(DEFAULT,       "",     COLOR_DEFAULT,  COLOR_DEFAULT,  A_NORMAL), \
-LINE(CURSOR,        "",     COLOR_WHITE,    COLOR_GREEN,    A_BOLD), \
-LINE(STATUS,        "",     COLOR_GREEN,    COLOR_DEFAULT,  0), \
-LINE(DELIMITER,     "",     COLOR_MAGENTA,  COLOR_DEFAULT,  0), \
-LINE(TITLE_FOCUS,   "",     COLOR_WHITE,    COLOR_BLUE,     A_BOLD), \
-LINE(FILE_NAME,     "",     COLOR_BLUE,     COLOR_DEFAULT,  0), \
-LINE(FILE_LINUM,    "",     COLOR_GREEN,    COLOR_DEFAULT,  0), \
-LINE(FILE_LINCON,   "",     COLOR_DEFAULT,  COLOR_DEFAULT,  0), \
-LINE(ERR,           "",     COLOR_RED,      COLOR_DEFAULT,  0), \
+#ifdef __APPLE__
+#define ST_MTIM(st)     ((st)->st_mtimespec)
+#else
+#define ST_MTIM(st)     ((st)->st_mtim)
+#endif
 
-enum line_type {
-#define LINE(type, line, fg, bg, attr) \
-    LINE_##type
-    LINE_INFO
-#undef  LINE
+/* Only directories and regular files are listed. A symlink is listed
+ * with what it points to, and marked. */
+struct dir_entry {
+    const char *name;
+    mode_t mode;
+    off_t size;
+    time_t mtime;
+    dev_t dev;
+    ino_t ino;
+    bool link;
+    unsigned int id;            /* Never reused, see search_refine(). */
 };
 
-struct line_info {
-    const char *line;   /* The start of line to match. */
-    int linelen;        /* Size of string to match. */
-    int fg, bg, attr;   /* Color and text attributes for the lines. */
+struct dir_listing {
+    struct dir_listing *next;   /* Hash chain. */
+    int refs;
+    char *key;                  /* Absolute path of the directory. */
+    struct timespec mtime;
+    size_t nentries;
+    struct dir_entry *entries;
+    char *names;
 };
 
-static struct line_info line_info[] = {
-#define LINE(type, line, fg, bg, attr) \
-    { (line), sizeof(line), (fg), (bg), (attr) }
-    LINE_INFO
-#undef  LINE
+struct dir_cache {
+    pthread_mutex_t lock;
+    struct dir_listing **table;
+    size_t size, count;
 };
 
-static const char usage[] =
-"Usage: happygrep [option1] PATTERN\n"
-"   or: happygrep PATTERN [option2] DIR|FILE\n"
-"\n"
-"Search for PATTERN in the current directory, by default exclude all the hidden\n\
-files and the file named tags. PATTERN can support the basic regex.\n\
-When use option2 switch, you can specify a DIR|FILE to be ignored.\n"
-"\n"
-"Option1:\n"
-"  --help          This help\n"
-"  --version       Display version & copyright\n"
-"\n"
-"Option2:\n"
-"  -i, --ignore    Ignore a dir or file\n"
-"\n"
-"Examples: happygrep 'hello world'\n"
-"      or: happygrep 'hello$' -i 'main.c'\n";
+static struct dir_cache *dir_cache;     /* Only set when listings are kept. */
+static unsigned int dir_ids;            /* The last id handed out. */
 
-int parse_options(int argc, const char *argv[])
+static void dir_listing_put(struct dir_listing *listing)
 {
-    size_t argv1_len;
-    size_t argv2_len;
-    size_t size;
-    char buf[BUFSIZ];
+    if (!listing || __sync_sub_and_fetch(&listing->refs, 1))
+        return;
 
-    if (argc <= 1 || argc == 3 || argc >4) {
-        printf("happygrep: invalid number of arguments.\n\n");
-        printf("%s\n", usage);
-        exit(1); 
-    } 
+    free(listing->entries);
+    free(listing->names);
+    free(listing->key);
+    free(listing);
+}
 
-    if (argc == 2) {
-        if (!strcmp(argv[1], "--help")) {
-            printf("%s\n", usage);
-            exit(1);
-        } else if (!strcmp(argv[1], "--version")) {
-            printf("%s\n", VERSION);
-            exit(1);
-        } else {
-            argv1_len = strlen(argv[1]);
-            size = argv1_len + 4;
+/* Like fstatat(), but only asking for what a listing keeps, and without
+ * making network file systems fetch fresh attributes. */
+static int dir_stat(int dirfd, const char *name, struct stat *st, int flags)
+{
+#ifdef HAVE_STATX
+    struct statx stx;
+
+    if (!statx(dirfd, name, flags | AT_STATX_DONT_SYNC,
+               STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_INO, &stx)) {
+        memset(st, 0, sizeof(*st));
+        st->st_mode = stx.stx_mode;
+        st->st_size = stx.stx_size;
+        ST_MTIM(st).tv_sec = stx.stx_mtime.tv_sec;
+        ST_MTIM(st).tv_nsec = stx.stx_mtime.tv_nsec;
+        st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        st->st_ino = stx.stx_ino;
+        return 0;
+    }
+    if (errno != ENOSYS)
+        return -1;
+#endif
+    return fstatat(dirfd, name, st, flags);
+}
 
-            char dest1[size];
-            strcat1(dest1, argv[1]);
+/* Whether a readdir() type says the entry is neither a directory, a
+ * file nor a symlink, like a FIFO that would block the open. */
+static inline bool dir_special(const struct dirent *entry)
+{
+#ifdef DT_UNKNOWN
+    return entry->d_type != DT_UNKNOWN && entry->d_type != DT_DIR &&
+           entry->d_type != DT_REG && entry->d_type != DT_LNK;
+#else
+    return false;
+#endif
+}
 
-            snprintf(buf, sizeof(buf), FIND_CMD, dest1);
-            string_copy(fmt_cmd, buf);
-        }
+static struct dir_listing *
+dir_listing_read(int rootfd, const char *path, const struct stat *st)
+{
+    struct dir_listing *listing = calloc(1, sizeof(*listing));
+    size_t names_len = 0, names_alloc = 0, alloc = 0, i;
+    struct dirent *entry;
+    DIR *dp = NULL;
+    unsigned int id;
+    int fd;
+
+    if (!listing)
+        return NULL;
+
+    fd = openat(rootfd, path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || !(dp = fdopendir(fd))) {
+        if (fd >= 0)
+            close(fd);
+        free(listing);
+        return NULL;
     }
 
-    if (argc == 4 && (!strcmp(argv[2], "-i") || !strcmp(argv[2], "--ignore"))) {
-        argv1_len = strlen(argv[1]);
-        size = argv1_len + 4;
+    listing->refs = 1;
+    listing->mtime = ST_MTIM(st);
 
-        char dest1[size];
-        strcat1(dest1, argv[1]);
+    while ((entry = readdir(dp))) {
+        size_t len = strlen(entry->d_name) + 1;
+        struct dir_entry *dirent;
+        struct stat est;
 
-        argv2_len = strlen(argv[3]);
-        size = argv2_len + 3;
+        bool link;
 
-        char dest2[size];
-        strcat1(dest2, argv[3]);
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        if (dir_special(entry)) {
+            PROFILE_COUNT(skipped[PROFILE_SKIP_SPECIAL], 1);
+            continue;
+        }
+        if (dir_stat(dirfd(dp), entry->d_name, &est, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
 
-        snprintf(buf, sizeof(buf), FIND_CMDD, dest2, dest1);
-        string_copy(fmt_cmd, buf);
-    }
+        /* Dangling links and links to special files are left out too. */
+        link = S_ISLNK(est.st_mode);
+        if (link && dir_stat(dirfd(dp), entry->d_name, &est, 0) < 0)
+            continue;
+        if (!S_ISDIR(est.st_mode) && !S_ISREG(est.st_mode)) {
+            PROFILE_COUNT(skipped[PROFILE_SKIP_SPECIAL], 1);
+            continue;
+        }
 
-    return 0;
-}
+        if (listing->nentries == alloc) {
+            struct dir_entry *tmp;
 
-int main(int argc, const char *argv[])
-{
-    const char *codeset = "UTF-8";
-    /* c must be int not char, because the maximum value of KEY_RESIZE is 632. */
-    int c;
-    enum request request;
-    request = REQ_VIEW_MAIN;
-    struct view *view;
+            alloc = alloc * 2 + 16;
+            tmp = realloc(listing->entries, alloc * sizeof(*tmp));
+            if (!tmp)
+                break;
+            listing->entries = tmp;
+            PROFILE_ALLOC(alloc * sizeof(*tmp));
+        }
 
-    parse_options(argc, argv);
+        if (names_len + len > names_alloc) {
+            char *tmp;
 
-    signal(SIGINT, quit);
+            names_alloc = (names_alloc + len) * 2;
+            tmp = realloc(listing->names, names_alloc);
+            if (!tmp)
+                break;
+            listing->names = tmp;
+            PROFILE_ALLOC(names_alloc);
+        }
 
-    if (setlocale(LC_ALL, "")) {
-        codeset = nl_langinfo(CODESET);
+        /* Names are offsets until the buffer has stopped moving. */
+        dirent = &listing->entries[listing->nentries++];
+        dirent->name = (const char *) names_len;
+        dirent->mode = est.st_mode;
+        dirent->size = est.st_size;
+        dirent->mtime = ST_MTIM(&est).tv_sec;
+        dirent->dev = est.st_dev;
+        dirent->ino = est.st_ino;
+        dirent->link = link;
+        memcpy(listing->names + names_len, entry->d_name, len);
+        names_len += len;
     }
 
-    if (*opt_encoding && strcmp(codeset, "UTF-8")) {
-        opt_iconv_in = iconv_open("UTF-8", opt_encoding);
-        if (opt_iconv_in == ICONV_NONE)
-            die("Failed to initialize character set conversion");
-    }
+    closedir(dp);
 
-    if (codeset && strcmp(codeset, "UTF-8")) {
-        opt_iconv_out = iconv_open(codeset, "UTF-8");
-        if (opt_iconv_out == ICONV_NONE)
-            die("Failed to initialize character set conversion");
+    id = __sync_fetch_and_add(&dir_ids, listing->nentries);
+    for (i = 0; i < listing->nentries; i++) {
+        listing->entries[i].name = listing->names + (size_t) listing->entries[i].name;
+        listing->entries[i].id = ++id;
     }
 
-    init();
-
-    while (view_driver(display[current_view], request))
-    {
-        int i;
-
-        foreach_view (view, i){
-            update_view(view);
+    return listing;
+}
 
-						logout("<update view> lineno=%lu lines=%lu offset=%lu height=%d\n", view->lineno, view->lines, view->offset, view->height);
-				}
+static size_t dir_cache_hash(const char *key)
+{
+    size_t hash = 2166136261u;
 
-        c = wgetch(status_win);
-        request = get_request(c);
+    while (*key)
+        hash = (hash ^ (unsigned char) *key++) * 16777619u;
+    return hash;
+}
 
-        if ( request == REQ_SCREEN_RESIZE) {
+/* Insert a listing, dropping any older one for the same directory.
+ * Called with the lock held. */
+static void dir_cache_insert(struct dir_cache *cache, struct dir_listing *listing)
+{
+    struct dir_listing **pos;
+    size_t i;
 
-            int height, width;
+    if (cache->count >= cache->size) {
+        size_t size = cache->size ? cache->size * 2 : 1024;
+        struct dir_listing **table = calloc(size, sizeof(*table));
 
-            getmaxyx(stdscr, height, width);
+        if (table) {
+            for (i = 0; i < cache->size; i++) {
+                struct dir_listing *item, *next;
 
-            wresize(status_win, 1, width);
-            mvwin(status_win, height - 1, 0);
-            wrefresh(status_win);
+                for (item = cache->table[i]; item; item = next) {
+                    next = item->next;
+                    item->next = table[dir_cache_hash(item->key) % size];
+                    table[dir_cache_hash(item->key) % size] = item;
+                }
+            }
+            free(cache->table);
+            cache->table = table;
+            cache->size = size;
         }
     }
 
-    quit(0);
+    if (!cache->size)
+        return;
 
-    return 0;
-}
+    for (pos = &cache->table[dir_cache_hash(listing->key) % cache->size]; *pos; pos = &(*pos)->next) {
+        if (!strcmp((*pos)->key, listing->key)) {
+            struct dir_listing *old = *pos;
 
-#if __GNUC__ >= 3
-#define __NORETURN __attribute__((__noreturn__))
-#else
-#define __NORETURN
-#endif
+            *pos = old->next;
+            cache->count--;
+            dir_listing_put(old);
+            break;
+        }
+    }
 
-static void __NORETURN quit(int sig)
-{
-    /* XXX: Restore tty modes and let the OS cleanup the rest! */
-    if (cursed)
-        endwin();
-    exit(0);
+    __sync_add_and_fetch(&listing->refs, 1);
+    listing->next = cache->table[dir_cache_hash(listing->key) % cache->size];
+    cache->table[dir_cache_hash(listing->key) % cache->size] = listing;
+    cache->count++;
 }
 
-static void __NORETURN die(const char *err, ...)
+/* Get the listing of a directory relative to the query root, from the
+ * cache when the directory has not been modified since it was read.
+ * Fresh is set when the directory had to be read. */
+static struct dir_listing *
+dir_listing_get(const struct search_query *query, const char *path, bool *fresh)
 {
-    va_list args;
+    struct dir_listing *listing = NULL;
+    char key[PATH_MAX];
+    struct stat st;
+
+    if (fstatat(query->rootfd, path, &st, 0) < 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    *fresh = TRUE;
+    if (!dir_cache)
+        return dir_listing_read(query->rootfd, path, &st);
+
+    if (!strcmp(path, "."))
+        string_copy(key, query->root);
+    else if (snprintf(key, sizeof(key), "%s/%s", query->root, path) >= sizeof(key))
+        return dir_listing_read(query->rootfd, path, &st);
+
+    pthread_mutex_lock(&dir_cache->lock);
+    if (dir_cache->size) {
+        for (listing = dir_cache->table[dir_cache_hash(key) % dir_cache->size]; listing; listing = listing->next)
+            if (!strcmp(listing->key, key))
+                break;
+    }
+    if (listing && listing->mtime.tv_sec == ST_MTIM(&st).tv_sec &&
+        listing->mtime.tv_nsec == ST_MTIM(&st).tv_nsec)
+        __sync_add_and_fetch(&listing->refs, 1);
+    else
+        listing = NULL;
+    pthread_mutex_unlock(&dir_cache->lock);
 
-    endwin();
+    if (listing) {
+        *fresh = false;
+        return listing;
+    }
 
-    va_start(args, err);
-    fputs("xxx: ", stderr);
-    vfprintf(stderr, err, args);
-    fputs("\n", stderr);
-    va_end(args);
+    listing = dir_listing_read(query->rootfd, path, &st);
+    if (listing && (listing->key = strdup(key))) {
+        pthread_mutex_lock(&dir_cache->lock);
+        dir_cache_insert(dir_cache, listing);
+        pthread_mutex_unlock(&dir_cache->lock);
+    }
 
-    exit(1);
+    return listing;
 }
 
-static bool begin_update(struct view *view)
+/*
+ * Listings on disk
+ *
+ * After a complete walk that had to read some directory, the listings
+ * it used are written to a file per root under ~/.cache/happygrep. The
+ * next process searching that root loads them into its cache, so only
+ * directories whose mtime changed are read again. The file also keeps
+ * the device of the root, and is ignored if that has changed.
+ */
+
+#define DIR_DISK_MAGIC      "happygrep dirs 1"
+
+struct dir_disk_header {
+    char magic[16];
+    unsigned long long rootdev;
+};
+
+struct dir_disk_listing {
+    long long sec, nsec;
+    unsigned int keylen;
+    unsigned int nentries;
+    unsigned int nameslen;
+};
+
+struct dir_disk_entry {
+    unsigned long long size, dev, ino;
+    long long mtime;
+    unsigned int name;          /* Offset in the names. */
+    unsigned int mode;
+    unsigned int link;
+};
+
+static bool dir_persist;        /* Listings are loaded from and saved to disk. */
+
+/* Make ~/.cache/happygrep if needed and return a path to name in it. */
+static bool cache_path(const char *name, char *path, size_t len)
 {
-    if (view->pipe)
-        end_update(view);
-    else {
-        view->cmd = fmt_cmd;
-        view->pipe = popen(view->cmd, "r");
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+
+    if (cache && *cache)
+        snprintf(dir, sizeof(dir), "%s/happygrep", cache);
+    else if (home && *home)
+        snprintf(dir, sizeof(dir), "%s/.cache/happygrep", home);
+    else
+        return false;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        /* ~/.cache itself may be missing. */
+        char *slash = strrchr(dir, '/');
+
+        *slash = 0;
+        mkdir(dir, 0700);
+        *slash = '/';
+        if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+            return false;
     }
 
-    if (!view->pipe)
-        return false;
+    return snprintf(path, len, "%s/%s", dir, name) < len;
+}
 
-    view->offset = 0;
-    view->line = 0;
-    view->lines = 0;
+static bool dir_disk_path(const char *root, char *path, size_t len)
+{
+    char name[32];
 
-    return TRUE;
+    snprintf(name, sizeof(name), "%016zx.dirs", dir_cache_hash(root));
+    return cache_path(name, path, len);
 }
 
-static void end_update(struct view *view)
+static struct dir_listing *dir_disk_read_listing(FILE *fp)
 {
-    pclose(view->pipe);
-    view->pipe = NULL;
+    struct dir_disk_listing head;
+    struct dir_listing *listing;
+    struct dir_disk_entry entry;
+    unsigned int id;
+    size_t i;
+
+    if (fread(&head, sizeof(head), 1, fp) != 1 || !head.keylen ||
+        head.keylen >= PATH_MAX || !head.nameslen || head.nentries > head.nameslen)
+        return NULL;
+
+    listing = calloc(1, sizeof(*listing));
+    if (!listing)
+        return NULL;
+    listing->refs = 1;
+    listing->mtime.tv_sec = head.sec;
+    listing->mtime.tv_nsec = head.nsec;
+    listing->key = calloc(1, head.keylen + 1);
+    listing->names = malloc(head.nameslen);
+    listing->entries = calloc(head.nentries ? head.nentries : 1, sizeof(*listing->entries));
+
+    if (!listing->key || !listing->names || !listing->entries ||
+        fread(listing->key, head.keylen, 1, fp) != 1 ||
+        fread(listing->names, head.nameslen, 1, fp) != 1 ||
+        listing->names[head.nameslen - 1])
+        goto error;
+
+    id = __sync_fetch_and_add(&dir_ids, head.nentries);
+    for (i = 0; i < head.nentries; i++) {
+        struct dir_entry *dirent = &listing->entries[i];
+
+        if (fread(&entry, sizeof(entry), 1, fp) != 1 || entry.name >= head.nameslen)
+            goto error;
+        dirent->name = listing->names + entry.name;
+        dirent->mode = entry.mode;
+        dirent->size = entry.size;
+        dirent->mtime = entry.mtime;
+        dirent->dev = entry.dev;
+        dirent->ino = entry.ino;
+        dirent->link = !!entry.link;
+        dirent->id = ++id;
+    }
+    listing->nentries = head.nentries;
+    return listing;
+
+error:
+    listing->refs = 1;
+    dir_listing_put(listing);
+    return NULL;
 }
 
-static inline int get_line_attr(enum line_type type)
+/* Fill the cache with the listings saved for a root, unless it already
+ * has one for the root itself. */
+static void dir_disk_load(const struct search_query *query)
 {
-    assert(type < ARRAY_SIZE(line_info));
-    return COLOR_PAIR(type) | line_info[type].attr;
+    struct dir_disk_header header;
+    struct dir_listing *listing;
+    char path[PATH_MAX];
+    struct stat st;
+    bool cached = false;
+    FILE *fp;
+
+    if (!dir_cache || fstatat(query->rootfd, ".", &st, 0) < 0)
+        return;
+
+    pthread_mutex_lock(&dir_cache->lock);
+    if (dir_cache->size)
+        for (listing = dir_cache->table[dir_cache_hash(query->root) % dir_cache->size]; listing; listing = listing->next)
+            if (!strcmp(listing->key, query->root))
+                cached = TRUE;
+    pthread_mutex_unlock(&dir_cache->lock);
+
+    if (cached || !dir_disk_path(query->root, path, sizeof(path)) || !(fp = fopen(path, "rb")))
+        return;
+
+    if (fread(&header, sizeof(header), 1, fp) == 1 &&
+        !memcmp(header.magic, DIR_DISK_MAGIC, sizeof(header.magic)) &&
+        header.rootdev == (unsigned long long) st.st_dev) {
+        while ((listing = dir_disk_read_listing(fp))) {
+            pthread_mutex_lock(&dir_cache->lock);
+            dir_cache_insert(dir_cache, listing);
+            pthread_mutex_unlock(&dir_cache->lock);
+            dir_listing_put(listing);
+        }
+    }
+
+    fclose(fp);
 }
 
-static void init_colors(void)
+/* Write the listings of a complete walk, replacing the file at once. */
+static void dir_disk_save(const struct search_query *query, struct dir_listing **listings, size_t nlistings)
 {
-    int default_bg = COLOR_BLACK;
-    int default_fg = COLOR_WHITE;
-    enum line_type type;
+    struct dir_disk_header header = { DIR_DISK_MAGIC };
+    char path[PATH_MAX], tmp[PATH_MAX + 32];
+    struct stat st;
+    bool ok = TRUE;
+    size_t i, j;
+    FILE *fp;
+    int fd;
+
+    if (fstatat(query->rootfd, ".", &st, 0) < 0 || !dir_disk_path(query->root, path, sizeof(path)))
+        return;
 
-    start_color();
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        return;
+    fp = fdopen(fd, "wb");
+    if (!fp) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
 
-    if (use_default_colors() != ERR) {
-        default_bg = -1;
-        default_fg = -1;
+    header.rootdev = st.st_dev;
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+    for (i = 0; ok && i < nlistings; i++) {
+        struct dir_listing *listing = listings[i];
+        struct dir_disk_listing head = { 0 };
+        size_t nameslen = 0;
+
+        if (!listing->key)
+            continue;
+        if (listing->nentries) {
+            struct dir_entry *last = &listing->entries[listing->nentries - 1];
+
+            nameslen = last->name + strlen(last->name) + 1 - listing->names;
+        }
+
+        head.sec = listing->mtime.tv_sec;
+        head.nsec = listing->mtime.tv_nsec;
+        head.keylen = strlen(listing->key);
+        head.nentries = listing->nentries;
+        head.nameslen = nameslen ? nameslen : 1;
+
+        ok = fwrite(&head, sizeof(head), 1, fp) == 1 &&
+             fwrite(listing->key, head.keylen, 1, fp) == 1 &&
+             (nameslen ? fwrite(listing->names, nameslen, 1, fp) : fwrite("", 1, 1, fp)) == 1;
+
+        for (j = 0; ok && j < listing->nentries; j++) {
+            struct dir_entry *dirent = &listing->entries[j];
+            struct dir_disk_entry entry = { 0 };
+
+            entry.name = dirent->name - listing->names;
+            entry.mode = dirent->mode;
+            entry.size = dirent->size;
+            entry.mtime = dirent->mtime;
+            entry.dev = dirent->dev;
+            entry.ino = dirent->ino;
+            entry.link = dirent->link;
+            ok = fwrite(&entry, sizeof(entry), 1, fp) == 1;
+        }
     }
 
-    for (type = 0; type < ARRAY_SIZE(line_info); type++) {
-        struct line_info *info = &line_info[type];
-        int bg = info->bg == COLOR_DEFAULT ? default_bg : info->bg;
-        int fg = info->fg == COLOR_DEFAULT ? default_fg : info->fg;
+    if (fclose(fp) || !ok || rename(tmp, path) < 0)
+        unlink(tmp);
+}
 
-        init_pair(type, fg, bg);
+/*
+ * I/O tuning
+ *
+ * How many reads should be in flight depends on what holds the files: a
+ * NVMe drive wants a lot of them, a spinning disk seeks itself to death
+ * with more than a few, and an NFS server sits in between. Each search
+ * measures the latency and throughput of its reads in short windows and
+ * climbs towards the concurrency that reads fastest: the number of
+ * matchers taking files, or with --io uring the number of files each
+ * ring keeps in flight. Where it ends up is saved per mount in
+ * ~/.cache/happygrep/io, and the next search on that mount starts there.
+ */
+
+#define IO_WINDOW_NS        (100 * 1000000ULL)  /* Shortest window measured. */
+#define IO_WINDOW_READS     32      /* Fewest reads a window decides on. */
+#define IO_DEPTH_MAX        32      /* Files in flight per ring. */
+#define IO_POLICIES_MAX     64      /* Mounts kept in the cache file. */
+
+enum io_kind {
+    IO_SSD,
+    IO_HDD,
+    IO_NETWORK,
+};
+
+static const char *io_kind_names[] = { "ssd", "hdd", "network" };
+
+struct io_policy {
+    char mount[PATH_MAX];       /* Mount point holding the root. */
+    char fstype[32];
+    enum io_kind kind;
+    int workers;                /* Matchers taking files. */
+    int depth;                  /* Files in flight per ring. */
+    bool cached;                /* Read from the cache file. */
+};
+
+struct io_tuner {
+    pthread_mutex_t lock;
+    struct io_policy policy;    /* What the search started with. */
+    bool uring;                 /* Tune the depth, not the workers. */
+    int max_workers;
+    volatile int workers, depth;
+    int step;                   /* The direction being tried, +1 or -1. */
+    unsigned long long window;  /* When the window started, in ns. */
+    unsigned long long reads, bytes, latency;   /* In the window so far. */
+    unsigned long long total_reads, total_bytes, total_latency, total_ns;
+    double rate;                /* Bytes per second in the last window. */
+    double best_latency;        /* Lowest mean of any window, in ns. */
+    unsigned int windows;
+};
+
+/* File systems whose reads go over the network. */
+static bool io_network(const char *fstype)
+{
+    static const char *names[] = {
+        "nfs", "cifs", "smb", "9p", "ceph", "afs", "lustre", "gpfs",
+        "glusterfs", "beegfs", "fuse.sshfs", "fuse.rclone", "fuse.s3fs",
+    };
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(names); i++)
+        if (!strncmp(fstype, names[i], strlen(names[i])))
+            return TRUE;
+    return false;
+}
+
+#ifdef __linux__
+/* Mount points in mountinfo have spaces and such as octal escapes. */
+static void io_unescape(char *s)
+{
+    char *to = s;
+
+    for (; *s; s++) {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] && s[3]) {
+            *to++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 | (s[3] - '0');
+            s += 3;
+        } else {
+            *to++ = *s;
+        }
     }
+    *to = 0;
 }
 
-static void init(void)
+/* A disk is rotational if its queue, or that of the disk a partition
+ * is on, says so. */
+static bool io_rotational(dev_t dev)
 {
-    int x, y;
+    static const char *paths[] = {
+        "/sys/dev/block/%u:%u/queue/rotational",
+        "/sys/dev/block/%u:%u/../queue/rotational",
+    };
+    char path[PATH_MAX];
+    size_t i;
 
-    /* Initialize the curses library */
-    if (isatty(STDIN_FILENO)) {
-        cursed = !!initscr();
-    } else {
-    /* Leave stdin and stdout alone when acting as a pager. */
-        FILE *io = fopen("/dev/tty", "r+");
+    for (i = 0; i < ARRAY_SIZE(paths); i++) {
+        FILE *fp;
+        int c;
 
-        cursed = !!newterm(NULL, io, io);
+        snprintf(path, sizeof(path), paths[i], major(dev), minor(dev));
+        if (!(fp = fopen(path, "r")))
+            continue;
+        c = fgetc(fp);
+        fclose(fp);
+        return c == '1';
     }
 
-    if (!cursed)
-        die("Failed to initialize curses");
+    return false;
+}
 
-    nonl();         /* tell curses not to do NL->CR/NL on output */
-    cbreak();       /* take input chars one at a time, no wait for \n */
-    noecho();       /* don't echo input */
-    leaveok(stdscr, TRUE);
+/* Find the mount holding root: the longest mount point in front of it. */
+static bool io_mount(const char *path, struct io_policy *policy)
+{
+    FILE *fp = fopen("/proc/self/mountinfo", "r");
+    char line[PATH_MAX * 2 + 256], root[PATH_MAX];
+    size_t best = 0;
+    dev_t dev = 0;
 
-    if (has_colors())
-    {
-        init_colors();
+    if (!fp)
+        return false;
+    if (!realpath(path, root))
+        string_copy(root, path);
+
+    while (fgets(line, sizeof(line), fp)) {
+        char mount[PATH_MAX], fstype[32], source[PATH_MAX];
+        unsigned int maj, min;
+        const char *dash = strstr(line, " - ");
+        size_t len;
+
+        if (!dash || sscanf(line, "%*s %*s %u:%u %*s %4095s", &maj, &min, mount) != 3 ||
+            sscanf(dash + 3, "%31s %4095s", fstype, source) != 2)
+            continue;
+
+        io_unescape(mount);
+        len = strlen(mount);
+        if (len == 1)
+            len = 0;            /* "/" is in front of everything. */
+        if (strncmp(root, mount, len) || (root[len] && root[len] != '/') ||
+            (best && len + 1 < best))
+            continue;
+
+        best = len + 1;
+        string_copy(policy->mount, mount);
+        string_copy(policy->fstype, fstype);
+        dev = makedev(maj, min);
+
+        /* Btrfs and such have no block device of their own. */
+        if (!maj && !strncmp(source, "/dev/", 5)) {
+            struct stat st;
+
+            if (!stat(source, &st) && S_ISBLK(st.st_mode))
+                dev = st.st_rdev;
+        }
     }
+    fclose(fp);
 
-    getmaxyx(stdscr, y, x);
+    if (!best)
+        return false;
 
-    status_win = newwin(1, 0, y - 1, 0);
-    if (!status_win)
-        die("failed to create status window");
+    policy->kind = io_network(policy->fstype) ? IO_NETWORK :
+                   major(dev) && io_rotational(dev) ? IO_HDD : IO_SSD;
+    return TRUE;
+}
+#else
+static bool io_mount(const char *root, struct io_policy *policy)
+{
+    struct statfs fs;
 
-    keypad(status_win, TRUE);
-    wbkgdset(status_win, get_line_attr(LINE_STATUS));
+    if (statfs(root, &fs) < 0)
+        return false;
 
+    string_copy(policy->mount, fs.f_mntonname);
+    string_copy(policy->fstype, fs.f_fstypename);
+    policy->kind = !(fs.f_flags & MNT_LOCAL) || io_network(fs.f_fstypename)
+                   ? IO_NETWORK : IO_SSD;
+    return TRUE;
 }
+#endif
 
-static void update_title_win(struct view *view)
+/* Read the cache file, returning the number of policies in it. */
+static int io_policies_read(struct io_policy *policies, int max)
 {
-    size_t len;
-    if (view == display[current_view])
-        wbkgdset(view->title, get_line_attr(LINE_TITLE_FOCUS));
+    char path[PATH_MAX], line[PATH_MAX + 128];
+    int n = 0;
+    FILE *fp;
+
+    if (!cache_path("io", path, sizeof(path)) || !(fp = fopen(path, "r")))
+        return 0;
+
+    /* "kind workers depth fstype mount" per line. */
+    while (n < max && fgets(line, sizeof(line), fp)) {
+        struct io_policy *policy = &policies[n];
+        char kind[16];
+        int pos;
+
+        line[strcspn(line, "\n")] = 0;
+        if (sscanf(line, "%15s %d %d %31s %n", kind, &policy->workers, &policy->depth,
+                   policy->fstype, &pos) != 4 || !line[pos] ||
+            policy->workers < 1 || policy->depth < 1)
+            continue;
 
-    werase(view->title);
-    wmove(view->title, 0, 0);
-    wprintw(view->title, "[RPathN]");
-    wmove(view->title, 0, 9);
-    waddstr(view->title, view->file);
-    len = strlen(view->file);
-    wmove(view->title, 0, len + 13);
+        for (policy->kind = 0; policy->kind < ARRAY_SIZE(io_kind_names); policy->kind++)
+            if (!strcmp(kind, io_kind_names[policy->kind]))
+                break;
+        if (policy->kind == ARRAY_SIZE(io_kind_names))
+            continue;
 
-    if (view->lines) {
-        wprintw(view->title, "line %d of %d (%d%%)",
-            view->lineno + 1,
-            view->lines,
-            (view->lineno + 1) * 100 / view->lines);
+        string_copy(policy->mount, line + pos);
+        policy->cached = TRUE;
+        n++;
     }
+    fclose(fp);
 
-    wclrtoeol(view->title);
-    wrefresh(view->title);
+    return n;
 }
 
-static void resize_display(void)
+/* Where to start on the mount holding root: what the last search there
+ * settled on, or a guess from the kind of storage. */
+static void io_policy_load(const char *root, int max_workers, struct io_policy *policy)
 {
-    struct view *base = display[0];
+    struct io_policy policies[IO_POLICIES_MAX];
+    int i, n;
 
-    /* Setup window dimensions */
+    memset(policy, 0, sizeof(*policy));
+    if (!io_mount(root, policy))
+        string_copy(policy->fstype, "unknown");
 
-    getmaxyx(stdscr, base->height, base->width);
+    switch (policy->kind) {
+    case IO_HDD:
+        policy->workers = 2;
+        policy->depth = 4;
+        break;
+    case IO_NETWORK:
+        policy->workers = 8;
+        policy->depth = 16;
+        break;
+    case IO_SSD:
+        policy->workers = max_workers;
+        policy->depth = IO_DEPTH_MAX;
+        break;
+    }
 
-    base->height -= 1; // space for status window
+    n = *policy->mount && !opt_no_cache ? io_policies_read(policies, IO_POLICIES_MAX) : 0;
+    for (i = 0; i < n; i++) {
+        if (!strcmp(policies[i].mount, policy->mount) &&
+            !strcmp(policies[i].fstype, policy->fstype)) {
+            policy->workers = policies[i].workers;
+            policy->depth = policies[i].depth;
+            policy->cached = TRUE;
+            break;
+        }
+    }
 
-    base->height -= 1; // space for title bar
+    if (policy->workers > max_workers)
+        policy->workers = max_workers;
+    if (policy->depth > IO_DEPTH_MAX)
+        policy->depth = IO_DEPTH_MAX;
+}
 
-    if (!base->win) {
-        base->win = newwin(base->height + 1, 0, 0, 0);
-        if (!base->win)
-            die("Failed to create %s view", base->name);
+/* Put the policy first in the cache file, replacing the mount's old one. */
+static void io_policy_save(const struct io_policy *policy)
+{
+    struct io_policy policies[IO_POLICIES_MAX];
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+    int i, n;
+    FILE *fp;
 
-        scrollok(base->win, TRUE);
+    if (!*policy->mount || opt_no_cache || !cache_path("io", path, sizeof(path)))
+        return;
 
-        base->title = newwin(1, 0, base->height, 0);
-        if (!base->title)
-            die("Failed to create title window");
+    n = io_policies_read(policies, IO_POLICIES_MAX);
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+    if (!(fp = fopen(tmp, "w")))
+        return;
 
-    } else {
-        wresize(base->win, base->height + 1, base->width);
-        mvwin(base->win, 0, 0);
-        wrefresh(base->win);
-        wresize(base->title, 1, base->width);
-        mvwin(base->title, base->height, 0);
-        wrefresh(base->title);
-    }
+    fprintf(fp, "%s %d %d %s %s\n", io_kind_names[policy->kind],
+            policy->workers, policy->depth, policy->fstype, policy->mount);
+    for (i = 0; i < n && i < IO_POLICIES_MAX - 1; i++)
+        if (strcmp(policies[i].mount, policy->mount) ||
+            strcmp(policies[i].fstype, policy->fstype))
+            fprintf(fp, "%s %d %d %s %s\n", io_kind_names[policies[i].kind],
+                    policies[i].workers, policies[i].depth,
+                    policies[i].fstype, policies[i].mount);
+
+    if (fclose(fp) || rename(tmp, path) < 0)
+        unlink(tmp);
 }
 
-static void redraw_display(bool clear)
+static void io_tuner_init(struct io_tuner *tuner, const char *root, int max_workers, bool uring)
 {
-    struct view *view;
-    view = display[0];
+    memset(tuner, 0, sizeof(*tuner));
+    pthread_mutex_init(&tuner->lock, NULL);
+    io_policy_load(root, max_workers, &tuner->policy);
+    tuner->uring = uring;
+    tuner->max_workers = max_workers;
+    tuner->workers = tuner->policy.workers;
+    tuner->depth = tuner->policy.depth;
+    tuner->step = tuner->policy.kind == IO_SSD ? -1 : 1;
+    tuner->window = profile_clock(CLOCK_MONOTONIC);
+}
 
-    if (clear)
-        wclear(view->win);
-    redraw_view(view);
-    update_title_win(view);
+/* Decide on a finished window: keep going while reads get faster, turn
+ * around when they get slower, and back off whenever latency has grown
+ * a lot without buying any throughput. */
+static bool io_tune_window(struct io_tuner *tuner, unsigned long long ns,
+                           unsigned long long reads, unsigned long long bytes,
+                           unsigned long long latency)
+{
+    volatile int *knob = tuner->uring ? &tuner->depth : &tuner->workers;
+    int max = tuner->uring ? IO_DEPTH_MAX : tuner->max_workers;
+    double rate = bytes * 1e9 / ns;
+    double mean = (double) latency / reads;
+    int old = *knob, next;
+
+    if (!tuner->best_latency || mean < tuner->best_latency)
+        tuner->best_latency = mean;
+
+    if (mean > 4 * tuner->best_latency && rate < tuner->rate * 1.1)
+        tuner->step = -1;
+    else if (tuner->windows && rate < tuner->rate * 0.95)
+        tuner->step = -tuner->step;
+
+    if (tuner->uring)
+        next = tuner->step > 0 ? old * 2 : old / 2;
+    else
+        next = old + tuner->step;
+    if (next < 1)
+        next = 1;
+    if (next > max)
+        next = max;
+
+    tuner->rate = rate;
+    tuner->windows++;
+    *knob = next;
+    return next != old;
 }
 
-static int update_view(struct view *view)
+/* Count one read, returns TRUE when the concurrency was changed. */
+static bool io_tune(struct io_tuner *tuner, size_t bytes, unsigned long long latency)
 {
-    char buffer[BUFSIZ];
-    char *line;
-    void **tmp;
-    int redraw_from = -1;
-    unsigned long lines = view->height;
-    char *top = "Binary file";
-    char delimiter = ':';
+    unsigned long long now, reads;
+    bool changed = false;
 
-    if (!view->pipe)
-        return TRUE;
+    __sync_fetch_and_add(&tuner->reads, 1);
+    __sync_fetch_and_add(&tuner->bytes, bytes);
+    __sync_fetch_and_add(&tuner->latency, latency);
 
-    /* Only redraw if lines are visible. */
-    if (view->offset + view->height >= view->lines)
-        redraw_from = view->lines - view->offset;
+    now = profile_clock(CLOCK_MONOTONIC);
+    if (now - tuner->window < IO_WINDOW_NS || tuner->reads < IO_WINDOW_READS ||
+        pthread_mutex_trylock(&tuner->lock))
+        return false;
 
-    tmp = realloc(view->line, sizeof(*view->line) * (view->lines + lines));
-    if (!tmp)
-        goto alloc_error;
+    /* Another thread may have closed the window meanwhile. */
+    if (now - tuner->window >= IO_WINDOW_NS && tuner->reads >= IO_WINDOW_READS) {
+        unsigned long long ns = now - tuner->window;
 
-    view->line = tmp;
+        reads = __sync_lock_test_and_set(&tuner->reads, 0);
+        bytes = __sync_lock_test_and_set(&tuner->bytes, 0);
+        latency = __sync_lock_test_and_set(&tuner->latency, 0);
+        tuner->window = now;
 
-    while ((line = fgets(buffer, sizeof(buffer), view->pipe)))
-    {
-        int linelen;
-        linelen = strlen(line);
+        tuner->total_reads += reads;
+        tuner->total_bytes += bytes;
+        tuner->total_latency += latency;
+        tuner->total_ns += ns;
+        changed = io_tune_window(tuner, ns, reads, bytes, latency);
+    }
+    pthread_mutex_unlock(&tuner->lock);
 
-        if (linelen)
-            line[linelen - 1] = 0;
+    return changed;
+}
 
-        if(!strncmp(line, top, strlen(top)))
-            continue;
+/* Save what a search settled on, once it has seen enough to go by. */
+static void io_tuner_finish(struct io_tuner *tuner)
+{
+    const struct io_policy *start = &tuner->policy;
+    struct io_policy policy = *start;
+
+    if (opt_profile) {
+        int len;
+
+        pthread_mutex_lock(&profile.lock);
+        len = snprintf(profile.io, sizeof(profile.io),
+                       "%s on %s (%s)%s, %d workers, depth %d -> %d workers, depth %d",
+                       io_kind_names[start->kind], *start->mount ? start->mount : "?",
+                       start->fstype, start->cached ? ", from cache" : "",
+                       start->workers, start->depth, tuner->workers, tuner->depth);
+        if (tuner->total_reads && len > 0 && len < sizeof(profile.io))
+            snprintf(profile.io + len, sizeof(profile.io) - len,
+                     "\n  tuned reads       %llu, mean %.3fms, %.1f MB/s, %u windows",
+                     tuner->total_reads, tuner->total_latency / 1e6 / tuner->total_reads,
+                     tuner->total_bytes / 1048576.0 / (tuner->total_ns / 1e9),
+                     tuner->windows);
+        pthread_mutex_unlock(&profile.lock);
+    }
 
-        /* solve the segfault in ubuntu with chinese locale. */
-        if(!strchr(line, delimiter))
-            continue;
+    if (tuner->windows >= 3) {
+        policy.workers = tuner->workers;
+        policy.depth = tuner->depth;
+        io_policy_save(&policy);
+    }
+    pthread_mutex_destroy(&tuner->lock);
+}
 
-        if (!view->read(view, line))
-            goto alloc_error;
+/*
+ * Search engine
+ *
+ * A walker thread feeds file names to a pool of matcher threads. Each
+ * matcher hands its result records back through a locked queue which
+ * update_view() drains, so the UI never blocks on the search.
+ *
+ * The scheduler aims for time to first screen: the walker goes breadth
+ * first and files are handed out cheapest first, while big files are
+ * left to a background matcher.
+ */
 
-        if (lines-- == 1)
-            break;
-    }
+/*
+ * Matcher kernels
+ *
+ * Each combination of options gets its own function, so the loops over
+ * the bytes of a block test none of them. A pattern without regex syntax
+ * is searched for as a string: 16 positions at a time are checked for
+ * its first and last byte, and only where both are found is the rest
+ * compared. Case is folded for ASCII only, other patterns ignoring case
+ * go through the regex.
+ */
 
-    if (redraw_from >= 0) {
-        /* If this is an incremental update, redraw the previous line
-         * since for commits some members could have changed when
-         * loading the main view. */
-        if (redraw_from > 0)
-            redraw_from--;
+static inline bool search_word_char(unsigned char c)
+{
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
 
-        /* Incrementally draw avoids flickering. */
-        redraw_view_from(view, redraw_from);
+/* Whether [match, match_end) stands alone as a word. The scan starts
+ * at a line start, so nothing before pos belongs to the line. */
+static inline bool
+search_word_at(const char *pos, const char *end, const char *match, const char *match_end)
+{
+    return (match == pos || !search_word_char(match[-1])) &&
+           (match_end == end || !search_word_char(*match_end));
+}
+
+static inline unsigned char search_fold(unsigned char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+static inline __attribute__((always_inline)) bool
+search_literal_at(const struct search_query *query, const char *pos, const char *end,
+                  const char *at, const bool icase, const bool word)
+{
+    const char *pattern = query->pattern;
+    size_t i;
+
+    if (icase) {
+        for (i = 1; i < query->len - 1; i++)
+            if (search_fold(at[i]) != search_fold(pattern[i]))
+                return false;
+    } else if (query->len > 2 && memcmp(at + 1, pattern + 1, query->len - 2)) {
+        return false;
     }
 
-    update_title_win(view);
+    return !word || search_word_at(pos, end, at, at + query->len);
+}
 
-    if (ferror(view->pipe)) {
-        printw("Failed to read %s", view->cmd);
-        goto end;
+static inline __attribute__((always_inline)) const char *
+search_find_literal(const struct search_query *query, const char *pos, const char *end,
+                    const bool icase, const bool word)
+{
+    const unsigned char first = query->pattern[0], last = query->pattern[query->len - 1];
+    const char *at = pos;
 
-    } else if (feof(view->pipe)) {
-        report("load %d lines", view->lines);
-        goto end;
+    if ((size_t) (end - pos) < query->len)
+        return NULL;
+
+#ifdef __SSE2__
+    {
+        const __m128i first_lo = _mm_set1_epi8(icase ? search_fold(first) : first);
+        const __m128i first_up = _mm_set1_epi8(icase ? toupper(first) : first);
+        const __m128i last_lo = _mm_set1_epi8(icase ? search_fold(last) : last);
+        const __m128i last_up = _mm_set1_epi8(icase ? toupper(last) : last);
+
+        for (; at + 16 + query->len - 1 <= end; at += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *) at);
+            __m128i b = _mm_loadu_si128((const __m128i *) (at + query->len - 1));
+            __m128i hit_a = _mm_cmpeq_epi8(a, first_lo);
+            __m128i hit_b = _mm_cmpeq_epi8(b, last_lo);
+            unsigned int mask;
+
+            if (icase) {
+                hit_a = _mm_or_si128(hit_a, _mm_cmpeq_epi8(a, first_up));
+                hit_b = _mm_or_si128(hit_b, _mm_cmpeq_epi8(b, last_up));
+            }
+
+            for (mask = _mm_movemask_epi8(_mm_and_si128(hit_a, hit_b)); mask; mask &= mask - 1) {
+                const char *match = at + __builtin_ctz(mask);
+
+                if (search_literal_at(query, pos, end, match, icase, word))
+                    return match;
+            }
+        }
+    }
+#endif
+
+    for (; at + query->len <= end; at++) {
+        if (icase ? search_fold(*at) != search_fold(first) ||
+                    search_fold(at[query->len - 1]) != search_fold(last)
+                  : (unsigned char) *at != first ||
+                    (unsigned char) at[query->len - 1] != last)
+            continue;
+        if (search_literal_at(query, pos, end, at, icase, word))
+            return at;
+    }
+
+    return NULL;
+}
+
+#define SEARCH_FIND_LITERAL(name, icase, word) \
+    static const char * \
+    name(const struct search_query *query, const char *pos, const char *end) \
+    { \
+        return search_find_literal(query, pos, end, icase, word); \
+    }
+
+SEARCH_FIND_LITERAL(search_find_exact, false, false)
+SEARCH_FIND_LITERAL(search_find_exact_word, false, TRUE)
+SEARCH_FIND_LITERAL(search_find_nocase, TRUE, false)
+SEARCH_FIND_LITERAL(search_find_nocase_word, TRUE, TRUE)
+
+/* Case is up to how the regex was compiled. */
+static const char *
+search_find_regex(const struct search_query *query, const char *pos, const char *end)
+{
+    regmatch_t match = { 0, end - pos };
+
+    if (regexec(&query->regex, pos, 1, &match, REG_STARTEND))
+        return NULL;
+    return pos + match.rm_so;
+}
+
+/* Like grep -w, a match not standing alone is tried again one byte on. */
+static const char *
+search_find_regex_word(const struct search_query *query, const char *pos, const char *end)
+{
+    regmatch_t match = { 0, end - pos };
+
+    int flags = REG_STARTEND;
+
+    while (!regexec(&query->regex, pos, 1, &match, flags)) {
+        if (search_word_at(pos, end, pos + match.rm_so, pos + match.rm_eo))
+            return pos + match.rm_so;
+        if (pos + match.rm_so == end)
+            break;
+        match.rm_so++;
+        match.rm_eo = end - pos;
+        flags = REG_STARTEND | (pos[match.rm_so - 1] == '\n' ? 0 : REG_NOTBOL);
+    }
+
+    return NULL;
+}
+
+/* Compile the pattern like grep would: basic regex, by default ignoring
+ * case, and pick the kernel for the options. */
+static bool search_compile(struct search_query *query, char *msg, size_t msglen)
+{
+    int flags = query->icase ? REG_ICASE : 0;
+    bool literal, ascii = TRUE;
+    int err;
+    size_t i;
+
+    if ((err = regcomp(&query->regex, query->pattern, flags | REG_NEWLINE))) {
+        regerror(err, &query->regex, msg, msglen);
+        return false;
+    }
+
+    if ((err = regcomp(&query->line_regex, query->pattern, flags | REG_NOSUB))) {
+        regerror(err, &query->line_regex, msg, msglen);
+        regfree(&query->regex);
+        return false;
+    }
+
+    query->len = strlen(query->pattern);
+    for (i = 0; i < query->len; i++)
+        ascii &= (unsigned char) query->pattern[i] < 0x80;
+    literal = query->len && !strpbrk(query->pattern, "\\.[]*^$\n") &&
+              (ascii || !query->icase);
+
+    if (!literal)
+        query->find = query->word ? search_find_regex_word : search_find_regex;
+    else if (query->icase)
+        query->find = query->word ? search_find_nocase_word : search_find_nocase;
+    else
+        query->find = query->word ? search_find_exact_word : search_find_exact;
+
+    return TRUE;
+}
+
+static void search_query_free(struct search_query *query)
+{
+    regfree(&query->regex);
+    regfree(&query->line_regex);
+}
+
+#define SEARCH_WORKERS_MAX  16
+#define SEARCH_BUFSIZ       (256 * 1024)
+#define SEARCH_BATCH        1024    /* Records a matcher keeps before publishing. */
+#define SEARCH_BULK_SIZE    (1024 * 1024)   /* Files searched in the background. */
+#define SEARCH_RECENT       (24 * 60 * 60)  /* Modified within a day. */
+#define SEARCH_ROUND        256     /* Files a path queues per turn. */
+
+struct search_job {
+    struct search_job *next;
+    unsigned int round;         /* With several paths, see search_push(). */
+    unsigned int priority;      /* Lower is searched sooner. */
+    unsigned long seq;          /* Walk order, breaks ties. */
+    off_t size;
+    struct search_split *split; /* Set for one chunk of a split file. */
+    unsigned int chunk;
+    unsigned int id;            /* Of the directory entry, 0 if none. */
+    char path[1];
+};
+
+struct search_dir {
+    struct search_dir *next;
+    unsigned int depth;
+    char path[1];
+};
+
+/* Directories and files already walked, by (dev, inode), so hard links,
+ * bind mounts and symlink loops are only searched once. */
+struct search_inode {
+    dev_t dev;
+    ino_t ino;
+};
+
+struct search_visited {
+    pthread_mutex_t lock;
+    struct search_inode *slots;
+    size_t size, count;
+};
+
+struct search {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const struct search_query *query;
+    int sock;                   /* Connection when the daemon searches. */
+
+    /* Files waiting for a matcher: a heap ordered by priority and a
+     * FIFO of big files for the background matcher. */
+    struct search_job **heap;
+    size_t nheap, heap_alloc;
+    struct search_job *bulk, *bulk_tail;
+    unsigned long seq;
+    unsigned int round;         /* Of the last job taken from the heap. */
+    unsigned long pushed[SEARCH_PATHS];     /* Files queued per path. */
+    int paths_taken;            /* Paths handed to walker threads. */
+    bool walking;
+    int running;                /* Threads that have not finished yet. */
+    struct search_visited visited;
+
+    /* Listings used by the walk, kept to be saved when dir_persist. */
+    struct dir_listing **walked;
+    size_t nwalked, walked_alloc;
+    bool walk_read;             /* Some directory had to be read. */
+
+    /* Records waiting for update_view(). */
+    struct fileinfo **results;
+    size_t nresults, results_alloc;
+    volatile unsigned long published;
+    unsigned long first_screen; /* Publish every record until this many. */
+
+    /* Files with a match, kept for narrowing later queries. */
+    struct search_past *refine; /* Only files this allows are read. */
+    time_t started;
+    unsigned int *hits;
+    size_t nhits, hits_alloc;
+    bool hits_incomplete;       /* A hit could not be kept. */
+
+    volatile sig_atomic_t cancelled;
+    bool limited;               /* Stopped by --max-results. */
+    char error[SIZEOF_STR];     /* Reported by the daemon. */
+    unsigned long matches;
+
+    pthread_t walker;
+    pthread_t workers[SEARCH_WORKERS_MAX];
+    int nworkers;
+    int nmatchers;              /* Indexes handed to matchers so far. */
+    pid_t pid;                  /* Of the --backend program, see search_external(). */
+
+    /* Contents searched so far with --dedup, by size and hash. */
+    struct search_dup *dups;
+    size_t dups_size, ndups;
+    struct io_tuner tuner;      /* How many of them may take files. */
+};
+
+static void search_publish(struct search *search, struct fileinfo **found, size_t nfound);
+static struct fileinfo *
+search_record(const char *path, unsigned long lineno, const char *line, size_t linelen);
+
+static void search_cancel(struct search *search)
+{
+    pthread_mutex_lock(&search->lock);
+    search->cancelled = 1;
+    if (search->pid > 0)
+        kill(search->pid, SIGTERM);
+    pthread_cond_broadcast(&search->cond);
+    pthread_mutex_unlock(&search->lock);
+
+    /* Wake the reader and let the daemon see the client is gone. */
+    if (search->sock >= 0)
+        shutdown(search->sock, SHUT_RDWR);
+}
+
+static void search_exit(struct search *search)
+{
+    pthread_mutex_lock(&search->lock);
+    search->running--;
+    pthread_mutex_unlock(&search->lock);
+}
+
+/*
+ * File filters
+ *
+ * --type, --glob, --max-filesize and --newer are checked by the walker
+ * against the name and the size and mtime already in the listing, so a
+ * file they exclude is never opened. Extensions are looked up in a
+ * perfect hash: the seed is picked at startup so that no two known
+ * extensions share a slot, and a lookup is one hash and one compare.
+ */
+
+#define FILE_TYPE_SLOTS     256
+#define FILE_TYPE_EXT_MAX   8
+
+static const struct file_type {
+    const char *name;
+    const char *exts;           /* Separated by spaces. */
+} file_types[] = {
+    { "c",      "c h" },
+    { "cpp",    "cc cpp cxx c++ hh hpp hxx h++ h inl" },
+    { "css",    "css scss less" },
+    { "go",     "go" },
+    { "html",   "html htm xhtml" },
+    { "java",   "java" },
+    { "js",     "js mjs cjs jsx" },
+    { "json",   "json" },
+    { "lua",    "lua" },
+    { "md",     "md markdown" },
+    { "perl",   "pl pm t" },
+    { "php",    "php" },
+    { "py",     "py pyi" },
+    { "rb",     "rb" },
+    { "rust",   "rs" },
+    { "sh",     "sh bash zsh" },
+    { "sql",    "sql" },
+    { "ts",     "ts tsx" },
+    { "txt",    "txt" },
+    { "vim",    "vim" },
+    { "xml",    "xml xsd xsl" },
+    { "yaml",   "yaml yml" },
+};
+
+static struct {
+    unsigned int seed;
+    struct {
+        char ext[FILE_TYPE_EXT_MAX];
+        unsigned int types;
+    } slots[FILE_TYPE_SLOTS];
+} file_type_table;
+
+static inline unsigned int file_type_hash(const char *ext, size_t len, unsigned int seed)
+{
+    unsigned int hash = seed;
+
+    while (len--)
+        hash = (hash ^ (unsigned char) *ext++) * 16777619u;
+    return (hash ^ hash >> 15) % FILE_TYPE_SLOTS;
+}
+
+/* Try seeds until every extension gets a slot of its own. */
+static void file_types_init(void)
+{
+    unsigned int seed;
+    size_t i;
+
+    for (seed = 2166136261u; ; seed++) {
+        bool collision = false;
+
+        memset(file_type_table.slots, 0, sizeof(file_type_table.slots));
+
+        for (i = 0; i < ARRAY_SIZE(file_types) && !collision; i++) {
+            const char *ext = file_types[i].exts;
+
+            while (*ext) {
+                size_t len = strcspn(ext, " ");
+                unsigned int slot = file_type_hash(ext, len, seed);
+
+                if (*file_type_table.slots[slot].ext &&
+                    (strlen(file_type_table.slots[slot].ext) != len ||
+                     memcmp(file_type_table.slots[slot].ext, ext, len))) {
+                    collision = true;
+                    break;
+                }
+                memcpy(file_type_table.slots[slot].ext, ext, len);
+                file_type_table.slots[slot].types |= 1u << i;
+
+                ext += len;
+                ext += *ext == ' ';
+            }
+        }
+
+        if (!collision)
+            break;
+    }
+
+    file_type_table.seed = seed;
+}
+
+/* The types a file name belongs to by its extension. */
+static unsigned int file_type_lookup(const char *name)
+{
+    const char *dot = strrchr(name, '.');
+    size_t len;
+    unsigned int slot;
+
+    if (!dot || dot == name || (len = strlen(dot + 1)) >= FILE_TYPE_EXT_MAX || !len)
+        return 0;
+
+    slot = file_type_hash(dot + 1, len, file_type_table.seed);
+    if (memcmp(file_type_table.slots[slot].ext, dot + 1, len + 1))
+        return 0;
+    return file_type_table.slots[slot].types;
+}
+
+static int file_type_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(file_types); i++)
+        if (!strcmp(file_types[i].name, name))
+            return i;
+    return -1;
+}
+
+/* A glob with a slash is matched against the whole path. */
+static bool search_glob(const char *glob, const char *name, const char *path)
+{
+    if (strchr(glob, '/'))
+        return !fnmatch(glob, path, FNM_PATHNAME);
+    return !fnmatch(glob, name, 0);
+}
+
+/* Whether the filters of the query let a file through. */
+static bool
+search_wanted(const struct search_query *query, const struct dir_entry *entry, const char *path)
+{
+    bool include = false, any_include = false;
+    int i;
+
+    if (query->max_filesize && entry->size > query->max_filesize)
+        return false;
+    if (query->newer && entry->mtime < query->newer)
+        return false;
+    if (query->types && !(file_type_lookup(entry->name) & query->types))
+        return false;
+
+    for (i = 0; i < query->nglobs; i++) {
+        const char *glob = query->globs[i];
+
+        if (*glob == '!') {
+            if (search_glob(glob + 1, entry->name, path))
+                return false;
+        } else {
+            any_include = true;
+            include = include || search_glob(glob, entry->name, path);
+        }
+    }
+
+    return include || !any_include;
+}
+
+static inline bool search_filtered(const struct search_query *query)
+{
+    return query->types || query->nglobs || query->max_filesize || query->newer;
+}
+
+/*
+ * Refinement
+ *
+ * The daemon remembers which files matched its recent literal queries,
+ * as bitmaps of directory entry ids. A query whose literal contains an
+ * earlier one can only match in files the earlier one matched, so only
+ * those are read again. A file is read anyway when its id is newer than
+ * the earlier search, or when it or its directory changed since that
+ * search started. Cached listings do not see a file being rewritten in
+ * place, so every file left out is checked with a fresh stat.
+ */
+
+#define SEARCH_HISTORY  8
+
+struct search_past {
+    char root[PATH_MAX];
+    char ignore[NAME_MAX + 1];
+    char literal[SIZEOF_STR];
+    bool xdev, follow;          /* What the walk left out. */
+    time_t started;
+    unsigned int end_id;        /* Ids from here on were not known. */
+    size_t nhits;
+    unsigned long long bits[1];
+};
+
+struct search_history {
+    pthread_mutex_t lock;
+    struct search_past *past[SEARCH_HISTORY];   /* Most recent first. */
+};
+
+static struct search_history *search_history;   /* Only set by the daemon. */
+
+/* The pattern in lower case when it has no regex syntax at all. */
+static bool search_literal(const struct search_query *query, char *literal, size_t len)
+{
+    size_t i;
+
+    if (query->list || *query->file || strpbrk(query->pattern, "\\.[]*^$") ||
+        strlen(query->pattern) >= len)
+        return false;
+
+    for (i = 0; query->pattern[i]; i++)
+        literal[i] = tolower((unsigned char) query->pattern[i]);
+    literal[i] = 0;
+    return TRUE;
+}
+
+/* Called with the lock held. */
+static void search_hit(struct search *search, unsigned int id)
+{
+    if (search->nhits == search->hits_alloc) {
+        size_t alloc = search->hits_alloc * 2 + 256;
+        unsigned int *tmp = realloc(search->hits, alloc * sizeof(*tmp));
+
+        if (!tmp) {
+            search->hits_incomplete = TRUE;
+            return;
+        }
+        search->hits = tmp;
+        search->hits_alloc = alloc;
+    }
+    search->hits[search->nhits++] = id;
+}
+
+/* Find the narrowest earlier query that the new one refines. */
+static struct search_past *search_refine(const struct search_query *query)
+{
+    struct search_past *best = NULL, *copy = NULL;
+    char literal[SIZEOF_STR];
+    size_t size;
+    int i;
+
+    if (!search_history || !search_literal(query, literal, sizeof(literal)))
+        return NULL;
+
+    pthread_mutex_lock(&search_history->lock);
+    for (i = 0; i < SEARCH_HISTORY; i++) {
+        struct search_past *past = search_history->past[i];
+
+        if (past && !strcmp(past->root, query->root) &&
+            !strcmp(past->ignore, query->ignore) &&
+            past->xdev == query->xdev && past->follow == query->follow &&
+            strstr(literal, past->literal) &&
+            (!best || past->nhits < best->nhits))
+            best = past;
+    }
+
+    if (best) {
+        size = sizeof(*best) + (best->end_id / 64) * sizeof(best->bits[0]);
+        copy = malloc(size);
+        if (copy)
+            memcpy(copy, best, size);
+    }
+    pthread_mutex_unlock(&search_history->lock);
+
+    return copy;
+}
+
+/* Remember the files a finished search matched in. */
+static void search_history_add(struct search *search)
+{
+    const struct search_query *query = search->query;
+    unsigned int end_id = __sync_add_and_fetch(&dir_ids, 0) + 1;
+    struct search_past *past;
+    char literal[SIZEOF_STR];
+    size_t i;
+
+    /* A filtered search says nothing about the files it left out, and
+     * files from the git index have no ids. Refining needs every file
+     * with the literal in any case, not only as a word, and all of the
+     * hits. */
+    if (search->hits_incomplete || search_filtered(query) || query->git ||
+        query->npaths || !query->icase || query->word ||
+        !search_literal(query, literal, sizeof(literal)))
+        return;
+
+    past = calloc(1, sizeof(*past) + (end_id / 64) * sizeof(past->bits[0]));
+    if (!past)
+        return;
+
+    string_copy(past->root, query->root);
+    string_copy(past->ignore, query->ignore);
+    string_copy(past->literal, literal);
+    past->xdev = query->xdev;
+    past->follow = query->follow;
+    past->started = search->started;
+    past->end_id = end_id;
+    past->nhits = search->nhits;
+    for (i = 0; i < search->nhits; i++)
+        if (search->hits[i] && search->hits[i] < end_id)
+            past->bits[search->hits[i] / 64] |= 1ULL << (search->hits[i] % 64);
+
+    pthread_mutex_lock(&search_history->lock);
+    free(search_history->past[SEARCH_HISTORY - 1]);
+    memmove(search_history->past + 1, search_history->past,
+            (SEARCH_HISTORY - 1) * sizeof(search_history->past[0]));
+    search_history->past[0] = past;
+    pthread_mutex_unlock(&search_history->lock);
+}
+
+/* Whether the walker must queue a file under refinement. */
+static bool
+search_candidate(struct search *search, struct dir_listing *listing,
+                 struct dir_entry *entry, const char *path)
+{
+    struct search_past *past = search->refine;
+    struct stat st;
+
+    if (!past || !entry->id || entry->id >= past->end_id ||
+        listing->mtime.tv_sec >= past->started ||
+        (past->bits[entry->id / 64] >> (entry->id % 64) & 1))
+        return TRUE;
+
+    return fstatat(search->query->rootfd, path, &st, 0) < 0 || st.st_ctime >= past->started;
+}
+
+static bool search_visited_grow(struct search_visited *visited)
+{
+    size_t size = visited->size ? visited->size * 2 : 1024;
+    struct search_inode *slots = calloc(size, sizeof(*slots));
+    size_t i, j;
+
+    if (!slots)
+        return false;
+
+    for (i = 0; i < visited->size; i++) {
+        struct search_inode *slot = &visited->slots[i];
+
+        if (!slot->ino)
+            continue;
+        for (j = (slot->ino * 0x9e3779b97f4a7c15ULL ^ slot->dev) & (size - 1); slots[j].ino;
+             j = (j + 1) & (size - 1))
+            ;
+        slots[j] = *slot;
+    }
+
+    free(visited->slots);
+    visited->slots = slots;
+    visited->size = size;
+    return TRUE;
+}
+
+/* Returns false when the inode has been seen before. */
+static bool search_visit(struct search *search, dev_t dev, ino_t ino)
+{
+    struct search_visited *visited = &search->visited;
+    bool added = TRUE;
+    size_t i, mask;
+
+    if (!ino)
+        return TRUE;
+
+    pthread_mutex_lock(&visited->lock);
+    if (visited->count * 2 < visited->size || search_visited_grow(visited)) {
+        mask = visited->size - 1;
+        for (i = (ino * 0x9e3779b97f4a7c15ULL ^ dev) & mask; ; i = (i + 1) & mask) {
+            struct search_inode *slot = &visited->slots[i];
+
+            if (!slot->ino) {
+                slot->dev = dev;
+                slot->ino = ino;
+                visited->count++;
+                break;
+            }
+            if (slot->ino == ino && slot->dev == dev) {
+                added = false;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&visited->lock);
+
+    return added;
+}
+
+/* Mirror the old "find . \( -name '.?*' -o -name tags \) -prune" rule. */
+static bool search_ignored(struct search *search, const char *name)
+{
+    const char *ignore = search->query->ignore;
+
+    if (name[0] == '.')
+        return TRUE;
+    if (!strcmp(name, "tags"))
+        return TRUE;
+    return *ignore && !fnmatch(ignore, name, 0);
+}
+
+/* Files near the current directory come first, then small before large,
+ * with a head start for anything modified recently. */
+static unsigned int
+search_priority(off_t size, time_t mtime, unsigned int depth, time_t now)
+{
+    unsigned int priority = depth * 4;
+
+    for (size >>= 12; size; size >>= 1)
+        priority++;
+
+    if (now - mtime < SEARCH_RECENT)
+        priority = priority > 8 ? priority - 8 : 0;
+
+    return priority;
+}
+
+static inline bool
+search_job_before(const struct search_job *a, const struct search_job *b)
+{
+    if (a->round != b->round)
+        return a->round < b->round;
+    if (a->priority != b->priority)
+        return a->priority < b->priority;
+    return a->seq < b->seq;
+}
+
+static bool search_heap_push(struct search *search, struct search_job *job)
+{
+    size_t pos;
+
+    if (search->nheap == search->heap_alloc) {
+        size_t alloc = search->heap_alloc * 2 + 64;
+        struct search_job **tmp = realloc(search->heap, alloc * sizeof(*tmp));
+
+        if (!tmp)
+            return false;
+        search->heap = tmp;
+        search->heap_alloc = alloc;
+    }
+
+    for (pos = search->nheap++; pos; pos = (pos - 1) / 2) {
+        struct search_job *parent = search->heap[(pos - 1) / 2];
+
+        if (!search_job_before(job, parent))
+            break;
+        search->heap[pos] = parent;
+    }
+    search->heap[pos] = job;
+
+    return TRUE;
+}
+
+static struct search_job *search_heap_pop(struct search *search)
+{
+    struct search_job *job, *last;
+    size_t pos, child;
+
+    if (!search->nheap)
+        return NULL;
+
+    job = search->heap[0];
+    last = search->heap[--search->nheap];
+    search->round = job->round;
+
+    for (pos = 0; (child = pos * 2 + 1) < search->nheap; pos = child) {
+        if (child + 1 < search->nheap &&
+            search_job_before(search->heap[child + 1], search->heap[child]))
+            child++;
+        if (!search_job_before(search->heap[child], last))
+            break;
+        search->heap[pos] = search->heap[child];
+    }
+    search->heap[pos] = last;
+
+    return job;
+}
+
+static struct search_job *search_bulk_pop(struct search *search)
+{
+    struct search_job *job = search->bulk;
+
+    if (job) {
+        search->bulk = job->next;
+        if (!search->bulk)
+            search->bulk_tail = NULL;
+    }
+
+    return job;
+}
+
+/* With several paths to search, each takes its turn at the heap with
+ * SEARCH_ROUND files at a time, so one big tree cannot hold back the
+ * others. A path that falls behind starts at the current round rather
+ * than catching up all at once. */
+static void
+search_push(struct search *search, const char *path, unsigned int id, off_t size,
+            time_t mtime, unsigned int depth, time_t now, int from)
+{
+    size_t len = strlen(path);
+    struct search_job *job = malloc(sizeof(*job) + len);
+
+    if (!job)
+        return;
+    PROFILE_ALLOC(sizeof(*job) + len);
+
+    memcpy(job->path, path, len + 1);
+    job->next = NULL;
+    job->split = NULL;
+    job->id = id;
+    job->size = size;
+    job->priority = search_priority(size, mtime, depth, now);
+
+    pthread_mutex_lock(&search->lock);
+    job->seq = search->seq++;
+    job->round = 0;
+    if (search->query->npaths > 1) {
+        unsigned long *pushed = &search->pushed[from];
+
+        if (*pushed < (unsigned long) search->round * SEARCH_ROUND)
+            *pushed = (unsigned long) search->round * SEARCH_ROUND;
+        job->round = (*pushed)++ / SEARCH_ROUND;
+    }
+
+    if (size >= SEARCH_BULK_SIZE) {
+        if (search->bulk_tail)
+            search->bulk_tail->next = job;
+        else
+            search->bulk = job;
+        search->bulk_tail = job;
+
+    } else if (!search_heap_push(search, job)) {
+        free(job);
+        job = NULL;
+    }
+
+    if (job)
+        pthread_cond_broadcast(&search->cond);
+    pthread_mutex_unlock(&search->lock);
+}
+
+/* The background matcher takes big files first, all others take the
+ * cheapest small file and only help with big files when idle. Matchers
+ * with an index past what the tuner allows wait, until it allows more
+ * or there is nothing left to take. */
+static struct search_job *search_pop(struct search *search, bool background, int index)
+{
+    struct search_job *job = NULL;
+
+    pthread_mutex_lock(&search->lock);
+    while (!search->cancelled) {
+        bool parked = index >= search->tuner.workers;
+
+        if (!parked && background)
+            job = search_bulk_pop(search);
+        if (!parked && !job)
+            job = search_heap_pop(search);
+        if (!parked && !job && !background)
+            job = search_bulk_pop(search);
+        if (job)
+            break;
+        if (!search->walking && (!parked || (!search->nheap && !search->bulk))) {
+            /* Parked matchers must see that the queue ran dry. */
+            pthread_cond_broadcast(&search->cond);
+            break;
+        }
+        pthread_cond_wait(&search->cond, &search->lock);
+    }
+    pthread_mutex_unlock(&search->lock);
+
+    return job;
+}
+
+/* Feed a read to the tuner, and wake matchers it may have allowed. */
+static void search_io(struct search *search, size_t bytes, unsigned long long latency)
+{
+    if (!io_tune(&search->tuner, bytes, latency))
+        return;
+
+    pthread_mutex_lock(&search->lock);
+    pthread_cond_broadcast(&search->cond);
+    pthread_mutex_unlock(&search->lock);
+}
+
+/*
+ * Git index
+ *
+ * With --git a search inside a git checkout takes its files from the
+ * index instead of walking the tree: one sequential read of .git/index
+ * gives every tracked path with its size and mtime, so no directory is
+ * listed and no file is stat'ed. With --untracked the tree is walked as
+ * well, for the files the index does not have and that no .gitignore or
+ * .git/info/exclude pattern excludes.
+ */
+
+struct git_ignore {
+    struct git_ignore *next;
+    size_t baselen;
+    bool negate;                /* "!pattern" */
+    bool dir_only;              /* "pattern/" */
+    bool anchored;              /* Has a slash, matched against the path. */
+    char *base;                 /* Directory of the .gitignore, "" or "dir/". */
+    char pattern[1];
+};
+
+struct git_index {
+    char top[PATH_MAX];         /* The work tree. */
+    char prefix[PATH_MAX];      /* The search root below it, "" or "dir/". */
+    size_t prefixlen;
+    size_t nfiles;
+    struct git_file {
+        const char *path;       /* Relative to the search root. */
+        off_t size;
+        time_t mtime;
+    } *files;
+    char *paths;
+    size_t *table;              /* Tracked paths by hash, 1 + index into files. */
+    size_t table_size;
+    struct git_ignore *ignores, **ignores_tail;
+};
+
+static inline unsigned int git_u32(const unsigned char *p)
+{
+    return (unsigned int) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Find the .git of the checkout holding root, returns the git dir and
+ * fills in the work tree and the root's place in it. */
+static bool git_find(struct git_index *git, const char *root, char *gitdir, size_t len)
+{
+    char dir[PATH_MAX];
+
+    string_copy(dir, root);
+
+    for (;;) {
+        char *slash = strrchr(dir, '/');
+        struct stat st;
+
+        if (snprintf(gitdir, len, "%s/.git", !strcmp(dir, "/") ? "" : dir) < len &&
+            !stat(gitdir, &st)) {
+            /* Worktrees and submodules have a "gitdir: path" file. */
+            if (S_ISREG(st.st_mode)) {
+                FILE *fp = fopen(gitdir, "r");
+                char line[PATH_MAX];
+                bool ok = fp && fgets(line, sizeof(line), fp) && !strncmp(line, "gitdir: ", 8);
+
+                if (fp)
+                    fclose(fp);
+                if (!ok)
+                    return false;
+                line[strcspn(line, "\n")] = 0;
+                if (line[8] == '/')
+                    ok = snprintf(gitdir, len, "%s", line + 8) < len;
+                else
+                    ok = snprintf(gitdir, len, "%s/%s", dir, line + 8) < len;
+                if (!ok)
+                    return false;
+            }
+
+            string_copy(git->top, dir);
+            if (strlen(root) > strlen(dir))
+                snprintf(git->prefix, sizeof(git->prefix), "%s/",
+                         root + strlen(dir) + (strcmp(dir, "/") != 0));
+            git->prefixlen = strlen(git->prefix);
+            return TRUE;
+        }
+
+        if (!slash || !strcmp(dir, "/"))
+            return false;
+        slash[slash == dir] = 0;
+    }
+}
+
+static char *git_read_file(const char *path, size_t *size)
+{
+    struct stat st;
+    char *buf = NULL;
+    size_t len = 0;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+
+    if (!fstat(fd, &st) && (buf = malloc(st.st_size + 1))) {
+        ssize_t n;
+
+        while (len < st.st_size && (n = read(fd, buf + len, st.st_size - len)) > 0)
+            len += n;
+        buf[len] = 0;
+        PROFILE_COUNT(bytes_read, len);
+    }
+    close(fd);
+
+    *size = len;
+    return buf;
+}
+
+static void git_ignore_load(struct git_index *git, const char *path, const char *base)
+{
+    size_t size;
+    char *buf = git_read_file(path, &size), *line, *next;
+
+    for (line = buf; line && *line; line = next) {
+        struct git_ignore *ignore;
+        size_t len;
+        char *pattern;
+
+        next = line + strcspn(line, "\n");
+        if (*next)
+            *next++ = 0;
+
+        len = strlen(line);
+        while (len && (line[len - 1] == ' ' || line[len - 1] == '\r') &&
+               (len < 2 || line[len - 2] != '\\'))
+            line[--len] = 0;
+        if (!len || *line == '#')
+            continue;
+
+        ignore = calloc(1, sizeof(*ignore) + len);
+        if (!ignore || !(ignore->base = strdup(base))) {
+            free(ignore);
+            break;
+        }
+
+        pattern = line;
+        if ((ignore->negate = *pattern == '!'))
+            pattern++;
+        if (*pattern == '\\')
+            pattern++;
+        len = strlen(pattern);
+        if ((ignore->dir_only = len && pattern[len - 1] == '/'))
+            pattern[--len] = 0;
+        if (!strncmp(pattern, "**/", 3) && !strchr(pattern + 3, '/'))
+            pattern += 3;
+        ignore->anchored = strchr(pattern, '/') != NULL;
+        if (*pattern == '/')
+            pattern++;
+        strcpy(ignore->pattern, pattern);
+        ignore->baselen = strlen(base);
+
+        *git->ignores_tail = ignore;
+        git->ignores_tail = &ignore->next;
+    }
+
+    free(buf);
+}
+
+/* Whether the patterns exclude a path relative to the work tree. The
+ * last pattern that matches decides, as in git. */
+static bool git_excluded(struct git_index *git, const char *path, bool dir)
+{
+    const char *name = strrchr(path, '/');
+    struct git_ignore *ignore;
+    bool excluded = false;
+
+    name = name ? name + 1 : path;
+
+    for (ignore = git->ignores; ignore; ignore = ignore->next) {
+        int flags = strstr(ignore->pattern, "**") ? 0 : FNM_PATHNAME;
+
+        if ((ignore->dir_only && !dir) || strncmp(path, ignore->base, ignore->baselen))
+            continue;
+        if (ignore->anchored ? !fnmatch(ignore->pattern, path + ignore->baselen, flags)
+                             : !fnmatch(ignore->pattern, name, 0))
+            excluded = !ignore->negate;
+    }
+
+    return excluded;
+}
+
+static bool git_tracked(struct git_index *git, const char *path)
+{
+    size_t i;
+
+    if (!git->table_size)
+        return false;
+
+    for (i = dir_cache_hash(path) & (git->table_size - 1); git->table[i];
+         i = (i + 1) & (git->table_size - 1))
+        if (!strcmp(git->files[git->table[i] - 1].path, path))
+            return TRUE;
+    return false;
+}
+
+static void git_free(struct git_index *git)
+{
+    struct git_ignore *ignore, *next;
+
+    for (ignore = git->ignores; ignore; ignore = next) {
+        next = ignore->next;
+        free(ignore->base);
+        free(ignore);
+    }
+    free(git->table);
+    free(git->files);
+    free(git->paths);
+    free(git);
+}
+
+/* Read the index entries below the search root. Only regular files at
+ * their first stage are kept, and not those marked skip-worktree. */
+static bool git_parse(struct git_index *git, const unsigned char *buf, size_t size)
+{
+    unsigned int version, count, i;
+    size_t off = 12, used = 0, alloc = 0;
+    char name[PATH_MAX] = "", last[PATH_MAX] = "";
+
+    if (size < 12 || memcmp(buf, "DIRC", 4))
+        return false;
+    version = git_u32(buf + 4);
+    count = git_u32(buf + 8);
+    if (version < 2 || version > 4)
+        return false;
+
+    git->files = calloc(count ? count : 1, sizeof(*git->files));
+    if (!git->files)
+        return false;
+
+    for (i = 0; i < count; i++) {
+        const unsigned char *entry = buf + off;
+        size_t pathoff = 62, len;
+        unsigned int flags, mode;
+        bool skip = false;
+
+        if (off + 64 > size)
+            return false;
+
+        flags = entry[60] << 8 | entry[61];
+        mode = git_u32(entry + 24);
+        if (version >= 3 && (flags & 0x4000)) {
+            skip = entry[62] & 0x40;        /* skip-worktree */
+            pathoff = 64;
+        }
+
+        if (version < 4) {
+            const unsigned char *end = memchr(entry + pathoff, 0, size - off - pathoff);
+
+            if (!end)
+                return false;
+            len = end - entry - pathoff;
+            if (len >= sizeof(name))
+                return false;
+            memcpy(name, entry + pathoff, len + 1);
+            off += (pathoff + len + 8) & ~7;
+        } else {
+            /* The name drops bytes from the end of the previous one. */
+            const unsigned char *p = entry + pathoff, *end;
+            size_t strip, keep;
+            unsigned char c = *p++;
+
+            for (strip = c & 127; c & 128 && p < buf + size; ) {
+                c = *p++;
+                strip = ((strip + 1) << 7) + (c & 127);
+            }
+            keep = strlen(name);
+            end = memchr(p, 0, buf + size - p);
+            if (!end || strip > keep || keep - strip + (end - p) >= sizeof(name))
+                return false;
+            memcpy(name + keep - strip, p, end - p + 1);
+            len = keep - strip + (end - p);
+            off = end + 1 - buf;
+        }
+
+        if (skip || (mode & S_IFMT) != S_IFREG || !strcmp(name, last) ||
+            strncmp(name, git->prefix, git->prefixlen))
+            continue;
+        string_copy(last, name);
+
+        len -= git->prefixlen;
+        if (used + len + 1 > alloc) {
+            char *tmp;
+
+            alloc = (alloc + len + 1) * 2;
+            tmp = realloc(git->paths, alloc);
+            if (!tmp)
+                return false;
+            git->paths = tmp;
+        }
+        memcpy(git->paths + used, name + git->prefixlen, len + 1);
+
+        /* Offsets until the buffer stops moving. */
+        git->files[git->nfiles].path = (const char *) used;
+        git->files[git->nfiles].size = git_u32(entry + 36);
+        git->files[git->nfiles].mtime = git_u32(entry + 8);
+        git->nfiles++;
+        used += len + 1;
+    }
+
+    for (i = 0; i < git->nfiles; i++)
+        git->files[i].path = git->paths + (size_t) git->files[i].path;
+    return TRUE;
+}
+
+/* Open the index of the checkout holding the search root, or NULL when
+ * there is none. */
+static struct git_index *git_open(const struct search_query *query, bool untracked)
+{
+    struct git_index *git = calloc(1, sizeof(*git));
+    char gitdir[PATH_MAX], path[PATH_MAX];
+    unsigned char *buf;
+    size_t size, i;
+
+    if (!git)
+        return NULL;
+    git->ignores_tail = &git->ignores;
+
+    if (!git_find(git, query->root, gitdir, sizeof(gitdir)) ||
+        snprintf(path, sizeof(path), "%s/index", gitdir) >= sizeof(path) ||
+        !(buf = (unsigned char *) git_read_file(path, &size))) {
+        git_free(git);
+        return NULL;
+    }
+
+    if (!git_parse(git, buf, size)) {
+        free(buf);
+        git_free(git);
+        return NULL;
+    }
+    free(buf);
+
+    if (!untracked)
+        return git;
+
+    for (git->table_size = 1024; git->table_size < git->nfiles * 2; git->table_size *= 2)
+        ;
+    git->table = calloc(git->table_size, sizeof(*git->table));
+    for (i = 0; git->table && i < git->nfiles; i++) {
+        size_t slot = dir_cache_hash(git->files[i].path) & (git->table_size - 1);
+
+        while (git->table[slot])
+            slot = (slot + 1) & (git->table_size - 1);
+        git->table[slot] = i + 1;
+    }
+
+    /* The walk loads the .gitignore of the root and below, this loads
+     * the ones above it. */
+    if (snprintf(path, sizeof(path), "%s/info/exclude", gitdir) < sizeof(path))
+        git_ignore_load(git, path, "");
+    for (i = 0; i < git->prefixlen; i++) {
+        char base[PATH_MAX];
+
+        if (i && git->prefix[i - 1] != '/')
+            continue;
+        snprintf(base, sizeof(base), "%.*s", (int) i, git->prefix);
+        if (snprintf(path, sizeof(path), "%s/%s.gitignore", git->top, base) < sizeof(path))
+            git_ignore_load(git, path, base);
+    }
+
+    return git;
+}
+
+/* Keep a listing the walk used, returns false if it could not. */
+static bool search_walked(struct search *search, struct dir_listing *listing)
+{
+    bool ok = TRUE;
+
+    /* Several paths are walked at once. */
+    pthread_mutex_lock(&search->lock);
+    if (search->nwalked == search->walked_alloc) {
+        size_t alloc = search->walked_alloc * 2 + 64;
+        struct dir_listing **tmp = realloc(search->walked, alloc * sizeof(*tmp));
+
+        if (tmp) {
+            search->walked = tmp;
+            search->walked_alloc = alloc;
+        }
+    }
+    if (search->nwalked < search->walked_alloc)
+        search->walked[search->nwalked++] = listing;
+    else
+        ok = false;
+    pthread_mutex_unlock(&search->lock);
+
+    return ok;
+}
+
+static struct search_dir *search_dir_new(const char *path, unsigned int depth)
+{
+    size_t len = strlen(path);
+    struct search_dir *dir = malloc(sizeof(*dir) + len);
+
+    if (dir) {
+        memcpy(dir->path, path, len + 1);
+        dir->depth = depth;
+        dir->next = NULL;
+    }
+
+    return dir;
+}
+
+/* Walk breadth first so files near the current directory are queued
+ * before anything deep in the tree. Returns whether the walk finished.
+ * With a git index only untracked files that are not ignored are taken.
+ * From is the index of the path the root is. */
+static bool
+search_walk(struct search *search, const char *root, struct git_index *git, int from)
+{
+    const struct search_query *query = search->query;
+    struct search_dir *dirs, *tail;
+    time_t now = time(NULL);
+    dev_t rootdev = 0;
+    struct stat st;
+
+    if (!fstatat(query->rootfd, root, &st, 0)) {
+        rootdev = st.st_dev;
+        search_visit(search, st.st_dev, st.st_ino);
+    }
+
+    dirs = tail = search_dir_new(root, 0);
+
+    while (dirs && !search->cancelled) {
+        struct search_dir *dir = dirs;
+        struct dir_listing *listing;
+        struct profile_stamp stamp = { 0 };
+        char path[PATH_MAX];
+        bool fresh;
+        size_t i;
+
+        dirs = dir->next;
+        if (!dirs)
+            tail = NULL;
+
+        profile_start(&stamp);
+        listing = dir_listing_get(search->query, dir->path, &fresh);
+        if (listing && fresh)
+            search->walk_read = TRUE;
+        if (opt_profile && listing) {
+            if (fresh)
+                PROFILE_COUNT(dirs_read, 1);
+            else
+                PROFILE_COUNT(dirs_cached, 1);
+            profile_slow(profile.dirs, dir->path,
+                         profile_clock(CLOCK_MONOTONIC) - stamp.wall);
+        }
+
+        if (git && listing) {
+            char base[PATH_MAX];
+            bool fits = TRUE;
+
+            if (!strcmp(dir->path, "."))
+                string_copy(base, git->prefix);
+            else
+                fits = snprintf(base, sizeof(base), "%s%s/", git->prefix, dir->path) < sizeof(base);
+            for (i = 0; fits && i < listing->nentries; i++)
+                if (!strcmp(listing->entries[i].name, ".gitignore") &&
+                    snprintf(path, sizeof(path), "%s/%s.gitignore", git->top, base) < sizeof(path))
+                    git_ignore_load(git, path, base);
+        }
+
+        for (i = 0; listing && i < listing->nentries && !search->cancelled; i++) {
+            struct dir_entry *entry = &listing->entries[i], current;
+
+            if (search_ignored(search, entry->name)) {
+                PROFILE_COUNT(skipped[PROFILE_SKIP_IGNORED], 1);
+                continue;
+            }
+
+            /* Report names relative to the current directory, without "./". */
+            if (!strcmp(dir->path, "."))
+                string_copy(path, entry->name);
+            else if (snprintf(path, sizeof(path), "%s/%s", dir->path, entry->name) >= sizeof(path))
+                continue;
+
+            if (git) {
+                char full[PATH_MAX];
+                bool skip;
+
+                if (snprintf(full, sizeof(full), "%s%s", git->prefix, path) >= sizeof(full))
+                    continue;
+                skip = git_excluded(git, full, S_ISDIR(entry->mode));
+                if (skip)
+                    PROFILE_COUNT(skipped[PROFILE_SKIP_IGNORED], 1);
+                if (skip || (!S_ISDIR(entry->mode) && git_tracked(git, path)))
+                    continue;
+            }
+
+            /* A cached listing does not see a file being rewritten in place. */
+            if (!fresh && !S_ISDIR(entry->mode) && (query->newer || query->max_filesize) &&
+                !fstatat(query->rootfd, path, &st, 0)) {
+                current = *entry;
+                current.size = st.st_size;
+                current.mtime = ST_MTIM(&st).tv_sec;
+                entry = &current;
+            }
+
+            if (S_ISDIR(entry->mode)) {
+                enum profile_skip skip = PROFILE_SKIPS;
+                struct search_dir *sub;
+
+                if (entry->link && !query->follow)
+                    skip = PROFILE_SKIP_LINK;
+                else if (query->xdev && entry->dev != rootdev)
+                    skip = PROFILE_SKIP_OTHER_FS;
+                else if (!search_visit(search, entry->dev, entry->ino))
+                    skip = PROFILE_SKIP_SEEN;
+                if (skip != PROFILE_SKIPS) {
+                    PROFILE_COUNT(skipped[skip], 1);
+                    continue;
+                }
+
+                sub = search_dir_new(path, dir->depth + 1);
+                if (!sub)
+                    continue;
+                if (tail)
+                    tail->next = sub;
+                else
+                    dirs = sub;
+                tail = sub;
+            } else if (search_filtered(query) && !search_wanted(query, entry, path)) {
+                PROFILE_COUNT(skipped[PROFILE_SKIP_FILTER], 1);
+            } else if (!search_visit(search, entry->dev, entry->ino)) {
+                /* Another link to a file already queued. */
+                PROFILE_COUNT(skipped[PROFILE_SKIP_SEEN], 1);
+            } else if (search->query->list) {
+                struct fileinfo *fileinfo = search_record(path, 0, "", 0);
+
+                if (fileinfo)
+                    search_publish(search, &fileinfo, 1);
+            } else if (search_candidate(search, listing, entry, path)) {
+                search_push(search, path, entry->id, entry->size, entry->mtime,
+                            dir->depth, now, from);
+            } else {
+                PROFILE_COUNT(skipped[PROFILE_SKIP_REFINED], 1);
+            }
+        }
+
+        if (listing && dir_persist && search_walked(search, listing))
+            listing = NULL;
+        dir_listing_put(listing);
+        free(dir);
+    }
+
+    if (!dirs)
+        return !search->cancelled;
+
+    while (dirs) {
+        struct search_dir *dir = dirs;
+
+        dirs = dir->next;
+        free(dir);
+    }
+    return false;
+}
+
+/* Apply search_ignored() to every part of a path, and count its depth. */
+static bool search_ignored_path(struct search *search, const char *path, unsigned int *depth)
+{
+    char name[NAME_MAX + 1];
+    const char *slash;
+
+    for (*depth = 0; (slash = strchr(path, '/')); path = slash + 1, ++*depth) {
+        string_ncopy(name, path, slash - path + 1 < sizeof(name) ? slash - path + 1 : sizeof(name));
+        if (search_ignored(search, name))
+            return TRUE;
+    }
+    return search_ignored(search, path);
+}
+
+/* Queue the tracked files below the search root, then walk for the
+ * untracked ones if asked. Returns whether that walk finished. */
+static bool search_git(struct search *search, struct git_index *git)
+{
+    const struct search_query *query = search->query;
+    time_t now = time(NULL);
+    size_t i;
+
+    for (i = 0; i < git->nfiles && !search->cancelled; i++) {
+        struct git_file *file = &git->files[i];
+        struct dir_entry entry = { NULL, S_IFREG, file->size, file->mtime };
+        const char *name = strrchr(file->path, '/');
+        unsigned int depth;
+        struct stat st;
+
+        entry.name = name ? name + 1 : file->path;
+        if (search_ignored_path(search, file->path, &depth)) {
+            PROFILE_COUNT(skipped[PROFILE_SKIP_IGNORED], 1);
+            continue;
+        }
+
+        /* The index can be older than the last edit. */
+        if ((query->newer || query->max_filesize) && !fstatat(query->rootfd, file->path, &st, 0)) {
+            entry.size = st.st_size;
+            entry.mtime = ST_MTIM(&st).tv_sec;
+        }
+        if (search_filtered(query) && !search_wanted(query, &entry, file->path)) {
+            PROFILE_COUNT(skipped[PROFILE_SKIP_FILTER], 1);
+            continue;
+        }
+
+        if (query->list) {
+            struct fileinfo *fileinfo = search_record(file->path, 0, "", 0);
+
+            if (fileinfo)
+                search_publish(search, &fileinfo, 1);
+        } else {
+            search_push(search, file->path, 0, entry.size, entry.mtime, depth, now, 0);
+        }
+    }
+
+    if (!query->untracked || search->cancelled)
+        return false;
+    return search_walk(search, ".", git, 0);
+}
+
+/* Walk the paths not taken yet, a directory or a file at a time. Returns
+ * whether all of them were walked to the end. */
+static bool search_walk_paths(struct search *search)
+{
+    const struct search_query *query = search->query;
+    bool complete = TRUE;
+    int from;
+
+    if (!query->npaths)
+        return !__sync_fetch_and_add(&search->paths_taken, 1) ?
+               search_walk(search, ".", NULL, 0) : TRUE;
+
+    while ((from = __sync_fetch_and_add(&search->paths_taken, 1)) < query->npaths) {
+        const char *path = query->paths[from];
+        struct stat st;
+
+        if (fstatat(query->rootfd, path, &st, 0) < 0)
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            complete &= search_walk(search, path, NULL, from);
+        } else if (!S_ISREG(st.st_mode) || !search_visit(search, st.st_dev, st.st_ino)) {
+            continue;
+        } else if (query->list) {
+            struct fileinfo *fileinfo = search_record(path, 0, "", 0);
+
+            if (fileinfo)
+                search_publish(search, &fileinfo, 1);
+        } else {
+            search_push(search, path, 0, st.st_size, ST_MTIM(&st).tv_sec, 0, time(NULL), from);
+        }
+    }
+
+    return complete;
+}
+
+static void *search_path_walker(void *data)
+{
+    return search_walk_paths(data) ? data : NULL;
+}
+
+static void *search_walker(void *data)
+{
+    struct search *search = data;
+    const char *file = search->query->file;
+    struct profile_stamp stamp = { 0 };
+    bool complete = false;
+    struct stat st;
+    size_t i;
+
+    profile_start(&stamp);
+    if (!*file) {
+        const struct search_query *query = search->query;
+        struct git_index *git = query->git ? git_open(query, query->untracked) : NULL;
+
+        if (dir_persist && (!git || query->untracked))
+            dir_disk_load(query);
+        if (git) {
+            complete = search_git(search, git);
+            git_free(git);
+        } else {
+            /* A thread per path walks them at the same time. */
+            pthread_t walkers[SEARCH_PATHS];
+            int nwalkers = 0;
+
+            while (nwalkers + 1 < query->npaths &&
+                   !pthread_create(&walkers[nwalkers], NULL, search_path_walker, search))
+                nwalkers++;
+            complete = search_walk_paths(search);
+            while (nwalkers--) {
+                void *walked;
+
+                pthread_join(walkers[nwalkers], &walked);
+                complete &= walked != NULL;
+            }
+        }
+    } else if (!fstatat(search->query->rootfd, file, &st, 0) && S_ISREG(st.st_mode))
+        search_push(search, file, 0, st.st_size, ST_MTIM(&st).tv_sec, 0, time(NULL), 0);
+
+    pthread_mutex_lock(&search->lock);
+    search->walking = false;
+    pthread_cond_broadcast(&search->cond);
+    pthread_mutex_unlock(&search->lock);
+
+    if (complete && search->walk_read && search->nwalked)
+        dir_disk_save(search->query, search->walked, search->nwalked);
+    for (i = 0; i < search->nwalked; i++)
+        dir_listing_put(search->walked[i]);
+    free(search->walked);
+    profile_end(PROFILE_WALK, &stamp);
+
+    search_exit(search);
+    return NULL;
+}
+
+/* Append records to the queue for update_view(), called with the lock held. */
+static void search_append(struct search *search, struct fileinfo **found, size_t nfound)
+{
+    size_t i;
+
+    if (!nfound)
+        return;
+
+    if (search->nresults + nfound > search->results_alloc) {
+        size_t alloc = search->results_alloc * 2 + nfound;
+        struct fileinfo **tmp = realloc(search->results, alloc * sizeof(*tmp));
+
+        if (!tmp) {
+            for (i = 0; i < nfound; i++)
+                free(found[i]);
+            return;
+        }
+        search->results = tmp;
+        search->results_alloc = alloc;
+    }
+    memcpy(search->results + search->nresults, found, nfound * sizeof(*found));
+    search->nresults += nfound;
+    search->published += nfound;
+}
+
+static void search_publish(struct search *search, struct fileinfo **found, size_t nfound)
+{
+    pthread_mutex_lock(&search->lock);
+    search_append(search, found, nfound);
+    pthread_mutex_unlock(&search->lock);
+}
+
+static struct fileinfo *
+search_record(const char *path, unsigned long lineno, const char *line, size_t linelen)
+{
+    struct fileinfo *fileinfo = calloc(1, sizeof(*fileinfo));
+
+    if (!fileinfo)
+        return NULL;
+    PROFILE_ALLOC(sizeof(*fileinfo));
+
+    string_copy(fileinfo->name, path);
+    fileinfo->lineno = lineno;
+    snprintf(fileinfo->number, sizeof(fileinfo->number), "%lu", lineno);
+
+    while (linelen && isspace((unsigned char) *line)) {
+        line++;
+        linelen--;
+    }
+    if (linelen >= sizeof(fileinfo->content))
+        linelen = sizeof(fileinfo->content) - 1;
+    memcpy(fileinfo->content, line, linelen);
+
+    return fileinfo;
+}
+
+/* In count mode a file gets one record, with its matches as the number
+ * and no content. */
+static void search_publish_count(struct search *search, const char *path, unsigned long count)
+{
+    struct fileinfo *fileinfo;
+
+    if (count && (fileinfo = search_record(path, count, "", 0)))
+        search_publish(search, &fileinfo, 1);
+}
+
+/* Count newlines 64 bytes at a time by turning byte compares into bit
+ * masks and adding up their population counts. */
+static size_t count_newlines(const char *buf, size_t len)
+{
+    size_t count = 0, i = 0;
+
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+
+    for (; i + 64 <= len; i += 64) {
+        const __m128i *p = (const __m128i *) (buf + i);
+        unsigned long long mask;
+
+        mask  = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p), nl));
+        mask |= (unsigned long long) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 1), nl)) << 16;
+        mask |= (unsigned long long) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 2), nl)) << 32;
+        mask |= (unsigned long long) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(p + 3), nl)) << 48;
+        count += __builtin_popcountll(mask);
+    }
+#endif
+
+    for (; i < len; i++)
+        count += buf[i] == '\n';
+
+    return count;
+}
+
+static const char *last_newline(const char *buf, size_t len)
+{
+    while (len--)
+        if (buf[len] == '\n')
+            return buf + len;
+    return NULL;
+}
+
+/*
+ * Identical files
+ *
+ * With --dedup every file read whole is also hashed, with the 128-bit
+ * variant of MurmurHash3 run over the blocks as they are read. A file
+ * whose size and hash were seen before is a copy: once its hash is
+ * complete it is not matched any further, and its path is added to the
+ * group of the file first searched with that content. The records of
+ * that file point to the group, and the main view shows them once with
+ * the number of copies, listing the copies when Enter is pressed.
+ */
+
+struct dup_group {
+    int refs;                   /* Records pointing here, and the search. */
+    size_t ncopies;
+    char **copies;              /* Paths with the same content. */
+};
+
+/* Guards the copies of every group, the UI reads them while matchers add. */
+static pthread_mutex_t dup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct dup_hash {
+    unsigned long long h1, h2;
+    unsigned long long len;
+    unsigned char tail[16];
+    unsigned int ntail;
+};
+
+struct search_dup {
+    off_t size;                 /* -1 for a free slot. */
+    unsigned long long h1, h2;
+    struct dup_group *group;    /* NULL when the file had no records. */
+};
+
+#define DUP_C1  0x87c37b91114253d5ULL
+#define DUP_C2  0x4cf5ad432745937fULL
+
+static inline unsigned long long dup_rotl(unsigned long long x, int r)
+{
+    return x << r | x >> (64 - r);
+}
+
+static inline unsigned long long dup_fmix(unsigned long long k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline void dup_mix(struct dup_hash *hash, unsigned long long k1, unsigned long long k2)
+{
+    hash->h1 ^= dup_rotl(k1 * DUP_C1, 31) * DUP_C2;
+    hash->h1 = (dup_rotl(hash->h1, 27) + hash->h2) * 5 + 0x52dce729;
+    hash->h2 ^= dup_rotl(k2 * DUP_C2, 33) * DUP_C1;
+    hash->h2 = (dup_rotl(hash->h2, 31) + hash->h1) * 5 + 0x38495ab5;
+}
+
+static void dup_hash_update(struct dup_hash *hash, const char *buf, size_t len)
+{
+    const unsigned char *pos = (const unsigned char *) buf;
+    unsigned long long k[2];
+
+    hash->len += len;
+
+    if (hash->ntail) {
+        size_t n = 16 - hash->ntail < len ? 16 - hash->ntail : len;
+
+        memcpy(hash->tail + hash->ntail, pos, n);
+        hash->ntail += n;
+        pos += n;
+        len -= n;
+        if (hash->ntail < 16)
+            return;
+        memcpy(k, hash->tail, 16);
+        dup_mix(hash, k[0], k[1]);
+        hash->ntail = 0;
+    }
+
+    for (; len >= 16; pos += 16, len -= 16) {
+        memcpy(k, pos, 16);
+        dup_mix(hash, k[0], k[1]);
+    }
+
+    memcpy(hash->tail, pos, len);
+    hash->ntail = len;
+}
+
+/* The hash of what was added so far, leaving the state as it was. */
+static void dup_hash_final(const struct dup_hash *hash, unsigned long long *h1p,
+                           unsigned long long *h2p)
+{
+    unsigned long long h1 = hash->h1, h2 = hash->h2, k[2] = { 0, 0 };
+
+    memcpy(k, hash->tail, hash->ntail);
+    h1 ^= dup_rotl(k[0] * DUP_C1, 31) * DUP_C2;
+    h2 ^= dup_rotl(k[1] * DUP_C2, 33) * DUP_C1;
+
+    h1 ^= hash->len;
+    h2 ^= hash->len;
+    h1 += h2;
+    h2 += h1;
+    h1 = dup_fmix(h1);
+    h2 = dup_fmix(h2);
+    h1 += h2;
+    h2 += h1;
+
+    *h1p = h1;
+    *h2p = h2;
+}
+
+static void dup_group_put(struct dup_group *group)
+{
+    size_t i;
+
+    if (!group || __sync_sub_and_fetch(&group->refs, 1))
+        return;
+
+    for (i = 0; i < group->ncopies; i++)
+        free(group->copies[i]);
+    free(group->copies);
+    free(group);
+}
+
+static size_t dup_group_copies(struct dup_group *group)
+{
+    size_t ncopies;
+
+    if (!group)
+        return 0;
+    pthread_mutex_lock(&dup_lock);
+    ncopies = group->ncopies;
+    pthread_mutex_unlock(&dup_lock);
+    return ncopies;
+}
+
+static void dup_group_add(struct dup_group *group, const char *path)
+{
+    char *copy = strdup(path);
+    char **tmp;
+
+    if (!copy)
+        return;
+
+    pthread_mutex_lock(&dup_lock);
+    tmp = realloc(group->copies, (group->ncopies + 1) * sizeof(*tmp));
+    if (tmp) {
+        group->copies = tmp;
+        group->copies[group->ncopies++] = copy;
+        copy = NULL;
+    }
+    pthread_mutex_unlock(&dup_lock);
+    free(copy);
+}
+
+/* Records are freed here once they may point to a group. */
+static void fileinfo_free(struct fileinfo *fileinfo)
+{
+    if (fileinfo)
+        dup_group_put(fileinfo->dup);
+    free(fileinfo);
+}
+
+/* Find the slot of a content, or the free one it would take. Called
+ * with the search locked. */
+static struct search_dup *
+search_dup_slot(struct search *search, off_t size, unsigned long long h1, unsigned long long h2)
+{
+    size_t mask = search->dups_size - 1, i;
+
+    for (i = h1 & mask; search->dups[i].size >= 0; i = (i + 1) & mask)
+        if (search->dups[i].size == size && search->dups[i].h1 == h1 && search->dups[i].h2 == h2)
+            break;
+    return &search->dups[i];
+}
+
+static bool search_dup_grow(struct search *search)
+{
+    struct search_dup *old = search->dups;
+    size_t oldsize = search->dups_size, i;
+    size_t size = oldsize ? oldsize * 2 : 1024;
+    struct search_dup *dups = malloc(size * sizeof(*dups));
+
+    if (!dups)
+        return false;
+    for (i = 0; i < size; i++)
+        dups[i].size = -1;
+
+    search->dups = dups;
+    search->dups_size = size;
+    for (i = 0; i < oldsize; i++)
+        if (old[i].size >= 0)
+            *search_dup_slot(search, old[i].size, old[i].h1, old[i].h2) = old[i];
+    free(old);
+    return TRUE;
+}
+
+/* Whether the content hashed so far was searched already. If so the path
+ * becomes one of its copies. */
+static bool search_dup_seen(struct search *search, const char *path, const struct dup_hash *hash)
+{
+    struct search_dup *dup;
+    unsigned long long h1, h2;
+    bool seen = false;
+
+    dup_hash_final(hash, &h1, &h2);
+
+    pthread_mutex_lock(&search->lock);
+    if (search->dups_size) {
+        dup = search_dup_slot(search, hash->len, h1, h2);
+        seen = dup->size >= 0;
+        if (seen && dup->group)
+            dup_group_add(dup->group, path);
+    }
+    pthread_mutex_unlock(&search->lock);
+
+    return seen;
+}
+
+/* Enter the content of a file searched whole and point its records to
+ * its group. Returns false when another file with the same content got
+ * there first, making this one a copy. */
+static bool
+search_dup_add(struct search *search, const char *path, const struct dup_hash *hash,
+               struct fileinfo **found, size_t nfound)
+{
+    struct search_dup *dup;
+    unsigned long long h1, h2;
+    size_t i;
+
+    dup_hash_final(hash, &h1, &h2);
+
+    pthread_mutex_lock(&search->lock);
+    if ((search->ndups + 1) * 2 > search->dups_size && !search_dup_grow(search)) {
+        pthread_mutex_unlock(&search->lock);
+        return TRUE;
+    }
+
+    dup = search_dup_slot(search, hash->len, h1, h2);
+    if (dup->size >= 0) {
+        if (dup->group)
+            dup_group_add(dup->group, path);
+        pthread_mutex_unlock(&search->lock);
+        return false;
+    }
+
+    dup->size = hash->len;
+    dup->h1 = h1;
+    dup->h2 = h2;
+    dup->group = nfound ? calloc(1, sizeof(*dup->group)) : NULL;
+    search->ndups++;
+
+    if (dup->group) {
+        dup->group->refs = 1 + nfound;
+        for (i = 0; i < nfound; i++)
+            found[i]->dup = dup->group;
+    }
+    pthread_mutex_unlock(&search->lock);
+
+    return TRUE;
+}
+
+/* State of one file, or one chunk of a split file, being matched. */
+struct search_scan {
+    const char *path;
+    unsigned int id;
+    unsigned long lineno;       /* Newlines before the current position. */
+    unsigned long count;        /* Matches so far. */
+    bool publish;               /* Records may be published as they are found. */
+    bool binary;
+    struct fileinfo **found;
+    size_t nfound, alloc;
+    struct dup_hash *hash;      /* With --dedup, of what was read so far. */
+    off_t size;                 /* From the walk, tells when the hash is whole. */
+    bool copy;                  /* The content was searched already. */
+    const volatile sig_atomic_t *split_binary;  /* Of the file a chunk is part of. */
+};
+
+/* With --dedup have the scan hash what it reads. Its records are then
+ * held until the file is known not to be a copy. */
+static void
+search_scan_hash(struct search *search, struct search_scan *scan, struct dup_hash *hash, off_t size)
+{
+    if (!search->query->dedup)
+        return;
+    memset(hash, 0, sizeof(*hash));
+    scan->hash = hash;
+    scan->size = size;
+    scan->publish = false;
+}
+
+/* Returns false when the scan should stop. */
+static bool
+search_scan_add(struct search *search, struct search_scan *scan, const char *line, size_t linelen)
+{
+    struct fileinfo *fileinfo;
+
+    /* A chunk's matches count once they are published. */
+    if (search->query->max_results && !scan->split_binary &&
+        __sync_fetch_and_add(&search->matches, 1) >= search->query->max_results) {
+        search->limited = TRUE;
+        search_cancel(search);
+        return false;
+    }
+
+    if (search->query->count)
+        return ++scan->count < search->query->max_count || !search->query->max_count;
+
+    if (scan->nfound == scan->alloc) {
+        size_t alloc = scan->alloc * 2 + 64;
+        struct fileinfo **tmp = realloc(scan->found, alloc * sizeof(*tmp));
+
+        if (!tmp)
+            return false;
+        scan->found = tmp;
+        scan->alloc = alloc;
+    }
+
+    fileinfo = search_record(scan->path, scan->lineno + 1, line, linelen);
+    if (fileinfo)
+        scan->found[scan->nfound++] = fileinfo;
+
+    /* Hand out every record until the first screen is full. */
+    if (scan->publish &&
+        (scan->nfound >= SEARCH_BATCH || search->published < search->first_screen)) {
+        search_publish(search, scan->found, scan->nfound);
+        scan->nfound = 0;
+    }
+
+    return ++scan->count < search->query->max_count || !search->query->max_count;
+}
+
+/* Count the matching lines in [pos, end). Unlike search_block() nothing
+ * needs the start of a line or its number, so after a match the scan
+ * just skips to the next newline. */
+static bool
+search_count_block(struct search *search, struct search_scan *scan, const char *pos, const char *end)
+{
+    const struct search_query *query = search->query;
+
+    while (pos < end && !search->cancelled) {
+        const char *match, *eol;
+
+        if (!(match = query->find(query, pos, end)))
+            break;
+
+        if (match == end && end[-1] == '\n')
+            break;
+
+        if (!search_scan_add(search, scan, NULL, 0))
+            return false;
+
+        eol = memchr(match, '\n', end - match);
+        if (!eol)
+            return TRUE;
+        pos = eol + 1;
+    }
+
+    return !search->cancelled;
+}
+
+/* Match the whole lines in [pos, end). The pattern is run over the block
+ * rather than line by line, and line numbers are caught up by counting
+ * the newlines skipped between matches. */
+static bool
+search_block(struct search *search, struct search_scan *scan, const char *pos, const char *end)
+{
+    const struct search_query *query = search->query;
+    regmatch_t match;
+
+    /* An anchored pattern cannot skip ahead to a line start by itself,
+     * and glibc only optimizes "^" without REG_NEWLINE, so hand it one
+     * line at a time. With -w the kernel has to see where it matched. */
+    while (*query->pattern == '^' && pos < end && !search->cancelled) {
+        const char *eol = memchr(pos, '\n', end - pos);
+        bool matched;
+
+        if (!eol)
+            eol = end;
+
+        match.rm_so = 0;
+        match.rm_eo = eol - pos;
+        if (query->word)
+            matched = query->find(query, pos, eol) != NULL;
+        else
+            matched = !regexec(&query->line_regex, pos, 0, &match, REG_STARTEND);
+        if (matched && !search_scan_add(search, scan, pos, eol - pos))
+            return false;
+
+        if (eol == end)
+            return TRUE;
+        scan->lineno++;
+        pos = eol + 1;
+    }
+
+    if (query->count)
+        return search_count_block(search, scan, pos, end);
+
+    while (pos < end && !search->cancelled) {
+        const char *match, *line, *eol;
+
+        if (!(match = query->find(query, pos, end)))
+            break;
+
+        /* An empty match after the last newline is not a line. */
+        if (match == end && end[-1] == '\n')
+            break;
+
+        line = last_newline(pos, match - pos);
+        line = line ? line + 1 : pos;
+        eol = memchr(match, '\n', end - match);
+        if (!eol)
+            eol = end;
+
+        scan->lineno += count_newlines(pos, line - pos);
+        if (!search_scan_add(search, scan, line, eol - line))
+            return false;
+
+        if (eol == end)
+            return TRUE;
+        scan->lineno++;
+        pos = eol + 1;
+    }
+
+    scan->lineno += count_newlines(pos, end - pos);
+    return !search->cancelled;
+}
+
+/* Match the lines starting in [start, end) of an open file, reading a
+ * block at a time. A line that does not fit grows the buffer. A range
+ * not starting at 0 begins after the first newline at or past start - 1,
+ * and end of -1 reads to the end of the file. Like grep, a NUL byte in
+ * the first block marks the file as binary. */
+static void
+search_range(struct search *search, struct search_scan *scan, int fd,
+             off_t start, off_t end, char **bufp, size_t *sizep)
+{
+    off_t off = start > 0 ? start - 1 : 0;
+    off_t bufoff = off;         /* File offset of the buffer start. */
+    size_t len = 0;
+    bool skip = start > 0, eof = false, done = false;
+
+    while (!eof && !done && !search->cancelled &&
+           !(scan->split_binary && *scan->split_binary)) {
+        struct profile_stamp stamp = { 0 };
+        unsigned long long issued;
+        char *buf, *pos, *stop;
+        bool more;
+        ssize_t n;
+
+        if (len == *sizep) {
+            char *tmp = realloc(*bufp, *sizep * 2);
+
+            if (!tmp)
+                break;
+            *bufp = tmp;
+            *sizep *= 2;
+            PROFILE_ALLOC(*sizep);
+        }
+
+        buf = *bufp;
+        profile_start(&stamp);
+        issued = profile_clock(CLOCK_MONOTONIC);
+        n = pread(fd, buf + len, *sizep - len, off);
+        profile_end(PROFILE_READ, &stamp);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        PROFILE_COUNT(bytes_read, n);
+        search_io(search, n, profile_clock(CLOCK_MONOTONIC) - issued);
+
+        if (!off && memchr(buf, 0, n)) {
+            scan->binary = TRUE;
+            break;
+        }
+
+        /* A copy is not matched any further once its hash is whole. */
+        if (scan->hash && n) {
+            dup_hash_update(scan->hash, buf + len, n);
+            if (scan->hash->len == scan->size &&
+                search_dup_seen(search, scan->path, scan->hash)) {
+                scan->copy = TRUE;
+                break;
+            }
+        }
+
+        eof = !n;
+        off += n;
+        len += n;
+        pos = buf;
+
+        if (skip) {
+            char *nl = memchr(buf, '\n', len);
+
+            if (!nl) {
+                bufoff += len;
+                len = 0;
+                continue;
+            }
+            pos = nl + 1;
+            skip = false;
+        }
+
+        /* Only whole lines, unless this is the end of the file. */
+        if (eof) {
+            stop = buf + len;
+        } else {
+            const char *last = last_newline(pos, buf + len - pos);
+
+            stop = last ? (char *) last + 1 : pos;
+        }
+
+        if (end >= 0 && end - bufoff <= stop - buf) {
+            char *limit = buf + (end - bufoff);
+
+            if (limit <= pos) {
+                stop = pos;
+            } else {
+                char *nl = memchr(limit - 1, '\n', stop - limit + 1);
+
+                if (nl)
+                    stop = nl + 1;
+            }
+            done = TRUE;
+        }
+
+        profile_start(&stamp);
+        more = search_block(search, scan, pos, stop);
+        profile_end(PROFILE_MATCH, &stamp);
+        if (!more)
+            break;
+
+        len = buf + len - stop;
+        memmove(buf, stop, len);
+        bufoff += stop - buf;
+    }
+}
+
+/* Publish what a whole file scan found, or drop it for a binary file or
+ * a copy. */
+static void search_scan_finish(struct search *search, struct search_scan *scan)
+{
+    size_t i;
+
+    /* Only a file read whole as it was walked is entered. */
+    if (scan->hash && !scan->binary && !scan->copy && scan->hash->len == scan->size &&
+        !search_dup_add(search, scan->path, scan->hash, scan->found, scan->nfound))
+        scan->copy = TRUE;
+
+    if (!scan->binary && !scan->copy && scan->count && search_history) {
+        pthread_mutex_lock(&search->lock);
+        search_hit(search, scan->id);
+        pthread_mutex_unlock(&search->lock);
+    }
+
+    if (scan->binary || scan->copy) {
+        PROFILE_COUNT(skipped[scan->binary ? PROFILE_SKIP_BINARY : PROFILE_SKIP_COPY], 1);
+        for (i = 0; i < scan->nfound; i++)
+            free(scan->found[i]);
+    } else if (search->query->count) {
+        search_publish_count(search, scan->path, scan->count);
+    } else {
+        search_publish(search, scan->found, scan->nfound);
+    }
+    free(scan->found);
+}
+
+static void
+search_file(struct search *search, const char *path, unsigned int id, off_t size,
+            char **bufp, size_t *sizep)
+{
+    struct search_scan scan = { path, id };
+    struct profile_stamp stamp = { 0 };
+    struct dup_hash hash;
+    int fd;
+
+    profile_start(&stamp);
+    fd = openat(search->query->rootfd, path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        PROFILE_COUNT(skipped[PROFILE_SKIP_OPEN], 1);
+        return;
+    }
+    PROFILE_COUNT(files_opened, 1);
+
+    scan.publish = TRUE;
+    search_scan_hash(search, &scan, &hash, size);
+    search_range(search, &scan, fd, 0, -1, bufp, sizep);
+    close(fd);
+
+    search_scan_finish(search, &scan);
+    if (opt_profile)
+        profile_slow(profile.files, path, profile_clock(CLOCK_MONOTONIC) - stamp.wall);
+}
+
+/*
+ * io_uring
+ *
+ * With "--io uring" each matcher takes a batch of small files and drives
+ * them through its own ring: all opens are submitted at once, each read
+ * goes out as soon as its open completes, and a file is matched while
+ * the reads of the others are still in flight. Files larger than a
+ * buffer slot, and every file when the ring cannot be set up, take the
+ * plain pread() path.
+ */
+
+#ifdef HAVE_IO_URING
+
+#define URING_SLOTS         IO_DEPTH_MAX
+#define URING_SLOT_SIZE     (64 * 1024)
+
+enum uring_op {
+    URING_OPEN,
+    URING_READ,
+    URING_CLOSE,
+};
+
+struct uring {
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned int pending;       /* SQEs not yet submitted. */
+    bool fixed;                 /* The slots are registered buffers. */
+    bool broken;                /* Fall back to pread() from now on. */
+    bool lost;                  /* Reads may still land in the slots. */
+    char *slots;
+};
+
+static void uring_free(struct uring *ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    if (!ring->lost)
+        free(ring->slots);
+    free(ring);
+}
+
+static struct uring *uring_new(void)
+{
+    struct uring *ring = calloc(1, sizeof(*ring));
+    struct io_uring_params params;
+    struct iovec iov[URING_SLOTS];
+    char *sq, *cq;
+    int i;
+
+    if (!ring)
+        return NULL;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, URING_SLOTS * 2, &params);
+    if (ring->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP))
+        goto error;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto error;
+    }
+    ring->cq_ring = ring->sq_ring;
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto error;
+    }
+
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    ring->slots = malloc((size_t) URING_SLOTS * URING_SLOT_SIZE);
+    if (!ring->slots)
+        goto error;
+
+    /* Registered buffers save a page walk per read, but count against
+     * RLIMIT_MEMLOCK, so plain reads are fine too. */
+    for (i = 0; i < URING_SLOTS; i++) {
+        iov[i].iov_base = ring->slots + (size_t) i * URING_SLOT_SIZE;
+        iov[i].iov_len = URING_SLOT_SIZE;
+    }
+    ring->fixed = !syscall(__NR_io_uring_register, ring->fd,
+                           IORING_REGISTER_BUFFERS, iov, URING_SLOTS);
+
+    return ring;
+
+error:
+    uring_free(ring);
+    return NULL;
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct uring *ring, int op, int fd, unsigned int slot, enum uring_op kind)
+{
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = (unsigned long long) kind << 32 | slot;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+
+    return sqe;
+}
+
+/* Submit what is queued and wait for at least one completion. */
+static bool uring_wait(struct uring *ring)
+{
+    int ret;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 1,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        return false;
+
+    ring->pending -= ret < ring->pending ? ret : ring->pending;
+    return TRUE;
+}
+
+static bool uring_reap(struct uring *ring, struct io_uring_cqe *cqe)
+{
+    unsigned int head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+static void uring_read(struct uring *ring, int fd, unsigned int slot)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(ring, ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ,
+                    fd, slot, URING_READ);
+    sqe->addr = (unsigned long) (ring->slots + (size_t) slot * URING_SLOT_SIZE);
+    sqe->len = URING_SLOT_SIZE;
+    sqe->off = 0;
+    sqe->buf_index = ring->fixed ? slot : 0;
+}
+
+/* Take more small files from the heap, without waiting for any, up to
+ * the depth the tuner allows. */
+static unsigned int
+search_pop_small(struct search *search, struct search_job **jobs, unsigned int njobs)
+{
+    pthread_mutex_lock(&search->lock);
+    while (njobs < search->tuner.depth && search->nheap && !search->cancelled &&
+           search->heap[0]->size < URING_SLOT_SIZE)
+        jobs[njobs++] = search_heap_pop(search);
+    pthread_mutex_unlock(&search->lock);
+
+    return njobs;
+}
+
+/* Search a batch of at most URING_SLOTS small files. A file whose open
+ * or read cannot go through the ring is searched with search_file(), and
+ * the ring is marked broken so later batches are not tried. */
+static void
+search_uring(struct search *search, struct uring *ring, struct search_job **jobs,
+             unsigned int njobs, char **bufp, size_t *sizep)
+{
+    unsigned long long issued[URING_SLOTS];
+    bool done[URING_SLOTS];
+    int fds[URING_SLOTS];
+    unsigned int i, inflight = 0;
+    struct io_uring_cqe cqe;
+    struct profile_stamp batch = { 0 }, stamp = { 0 };
+
+    profile_start(&batch);
+
+    for (i = 0; i < njobs; i++) {
+        struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_OPENAT,
+                                             search->query->rootfd, i, URING_OPEN);
+
+        sqe->addr = (unsigned long) jobs[i]->path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK;
+        issued[i] = profile_clock(CLOCK_MONOTONIC);
+        fds[i] = -1;
+        done[i] = false;
+        inflight++;
+    }
+
+    while (inflight) {
+        bool ok;
+
+        profile_start(&stamp);
+        ok = uring_wait(ring);
+        profile_end(PROFILE_READ, &stamp);
+        if (!ok && ring->pending) {
+            /* What was not submitted never completes, wait for the rest. */
+            inflight -= ring->pending;
+            ring->pending = 0;
+            ring->broken = TRUE;
+            continue;
+        } else if (!ok) {
+            /* Nothing more can be reaped, so the slots are never freed. */
+            ring->broken = TRUE;
+            ring->lost = TRUE;
+            break;
+        }
+
+        while (uring_reap(ring, &cqe)) {
+            unsigned int slot = cqe.user_data & 0xffffffff;
+            enum uring_op kind = cqe.user_data >> 32;
+            struct search_job *job = jobs[slot];
+            struct search_scan scan = { job->path, job->id };
+            struct dup_hash hash;
+            char *buf = ring->slots + (size_t) slot * URING_SLOT_SIZE;
+
+            inflight--;
+
+            /* Once broken, only collect what was in flight so that the
+             * files it opened are closed below. */
+            if (ring->broken) {
+                if (kind == URING_OPEN && cqe.res >= 0)
+                    fds[slot] = cqe.res;
+                else if (kind == URING_CLOSE)
+                    fds[slot] = -1;
+                continue;
+            }
+
+            switch (kind) {
+            case URING_OPEN:
+                if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+                    /* Kernels before 5.6 cannot open through the ring. */
+                    ring->broken = TRUE;
+                } else if (cqe.res < 0 || search->cancelled) {
+                    if (cqe.res >= 0)
+                        close(cqe.res);
+                    else
+                        PROFILE_COUNT(skipped[PROFILE_SKIP_OPEN], 1);
+                    done[slot] = TRUE;
+                } else {
+                    PROFILE_COUNT(files_opened, 1);
+                    fds[slot] = cqe.res;
+                    uring_read(ring, fds[slot], slot);
+                    inflight++;
+                }
+                break;
+
+            case URING_READ:
+                scan.publish = TRUE;
+                search_scan_hash(search, &scan, &hash, job->size);
+                if (cqe.res == -EINVAL && !ring->fixed) {
+                    ring->broken = TRUE;
+                    break;
+                } else if (search->cancelled || cqe.res < 0) {
+                    /* Nothing to match. */
+                } else if (cqe.res == URING_SLOT_SIZE) {
+                    /* The file grew since the walk. */
+                    search_range(search, &scan, fds[slot], 0, -1, bufp, sizep);
+                } else if (memchr(buf, 0, cqe.res)) {
+                    scan.binary = TRUE;
+                } else {
+                    if (scan.hash) {
+                        dup_hash_update(scan.hash, buf, cqe.res);
+                        scan.copy = search_dup_seen(search, job->path, scan.hash);
+                    }
+                    if (!scan.copy) {
+                        profile_start(&stamp);
+                        search_block(search, &scan, buf, buf + cqe.res);
+                        profile_end(PROFILE_MATCH, &stamp);
+                    }
+                }
+                if (cqe.res > 0)
+                    PROFILE_COUNT(bytes_read, cqe.res);
+                if (cqe.res >= 0)
+                    search_io(search, cqe.res, profile_clock(CLOCK_MONOTONIC) - issued[slot]);
+                search_scan_finish(search, &scan);
+                if (opt_profile)
+                    profile_slow(profile.files, job->path,
+                                 profile_clock(CLOCK_MONOTONIC) - batch.wall);
+
+                /* The fd is only forgotten once the close completes. */
+                uring_sqe(ring, IORING_OP_CLOSE, fds[slot], slot, URING_CLOSE);
+                done[slot] = TRUE;
+                inflight++;
+                break;
+
+            case URING_CLOSE:
+                fds[slot] = -1;
+                break;
+            }
+        }
+    }
+
+    /* Whatever the ring could not finish is searched the plain way. */
+    for (i = 0; i < njobs; i++) {
+        /* A lost ring may have closed it already. */
+        if (fds[i] >= 0 && !(ring->lost && done[i]))
+            close(fds[i]);
+        if (done[i])
+            continue;
+        if (!search->cancelled)
+            search_file(search, jobs[i]->path, jobs[i]->id, jobs[i]->size, bufp, sizep);
+    }
+}
+
+#endif
+
+/*
+ * Split files
+ *
+ * A file of SEARCH_SPLIT_SIZE or more is cut into chunks that several
+ * matchers search at once. Each chunk owns the lines starting inside it
+ * and numbers them from zero. When a chunk finishes, every finished
+ * chunk in front of it is published in order, with its line numbers
+ * offset by the newlines of all chunks before it.
+ */
+
+#define SEARCH_SPLIT_SIZE   (64 * 1024 * 1024)
+#define SEARCH_CHUNK_SIZE   (8 * 1024 * 1024)
+
+struct search_chunk {
+    bool done;
+    unsigned long lines;
+    unsigned long count;        /* Matches, in count mode. */
+    struct fileinfo **found;
+    size_t nfound;
+};
+
+struct search_split {
+    int fd;
+    unsigned int nchunks;
+    unsigned int next;          /* First chunk not yet published. */
+    unsigned int pending;       /* Chunks not finished, frees the split at 0. */
+    unsigned long lines;        /* Newlines in the published chunks. */
+    unsigned long count;        /* Records published. */
+    volatile sig_atomic_t binary;   /* Chunk 0 has a NUL, the others stop. */
+    unsigned int id;
+    char *path;
+    struct search_chunk chunk[1];
+};
+
+/* Called with the lock held, or after all threads have been joined. */
+static void search_split_release(struct search_split *split)
+{
+    unsigned int i;
+    size_t j;
+
+    if (--split->pending)
+        return;
+
+    for (i = split->next; i < split->nchunks; i++) {
+        for (j = 0; j < split->chunk[i].nfound; j++)
+            free(split->chunk[i].found[j]);
+        free(split->chunk[i].found);
+    }
+
+    close(split->fd);
+    free(split->path);
+    free(split);
+}
+
+static void search_chunk_done(struct search *search, struct search_split *split,
+                              unsigned int index, struct search_scan *scan)
+{
+    struct search_chunk *chunk = &split->chunk[index];
+    unsigned long max_count = search->query->max_count;
+    unsigned long max_results = search->query->max_results;
+    bool limited = false;
+    unsigned int next;
+    size_t i, kept;
+
+    pthread_mutex_lock(&search->lock);
+    next = split->next;
+    chunk->done = TRUE;
+    chunk->lines = scan->lineno;
+    chunk->count = scan->count;
+    chunk->found = scan->found;
+    chunk->nfound = scan->nfound;
+    if (!index && scan->binary) {
+        PROFILE_COUNT(skipped[PROFILE_SKIP_BINARY], 1);
+        split->binary = TRUE;
+    }
+
+    while (split->next < split->nchunks && split->chunk[split->next].done) {
+        chunk = &split->chunk[split->next++];
+
+        if (search->query->count && !split->binary) {
+            unsigned long add = chunk->count, before;
+
+            if (max_count && split->count + add > max_count)
+                add = max_count - split->count;
+            if (max_results && add &&
+                (before = __sync_fetch_and_add(&search->matches, add)) + add > max_results) {
+                add = before < max_results ? max_results - before : 0;
+                limited = TRUE;
+            }
+            split->count += add;
+        }
+
+        for (i = kept = 0; i < chunk->nfound; i++) {
+            struct fileinfo *fileinfo = chunk->found[i];
+
+            /* Matches count toward --max-results as they are published. */
+            if (!split->binary && !limited && !(max_count && split->count >= max_count) &&
+                max_results && __sync_fetch_and_add(&search->matches, 1) >= max_results)
+                limited = TRUE;
+            if (split->binary || limited || (max_count && split->count >= max_count)) {
+                free(fileinfo);
+                continue;
+            }
+
+            fileinfo->lineno += split->lines;
+            snprintf(fileinfo->number, sizeof(fileinfo->number), "%lu", fileinfo->lineno);
+            chunk->found[kept++] = fileinfo;
+            split->count++;
+        }
+        search_append(search, chunk->found, kept);
+
+        split->lines += chunk->lines;
+        free(chunk->found);
+        chunk->found = NULL;
+        chunk->nfound = 0;
+    }
+
+    /* Reaching --max-results completes the count early, nothing later
+     * is added to it. */
+    if (limited && search->query->count)
+        split->next = split->nchunks;
+
+    /* The last chunk to be published makes the count complete. */
+    if (next < split->nchunks && split->next == split->nchunks &&
+        !split->binary && split->count) {
+        if (search_history)
+            search_hit(search, split->id);
+        if (search->query->count) {
+            struct fileinfo *fileinfo = search_record(split->path, split->count, "", 0);
+
+            if (fileinfo)
+                search_append(search, &fileinfo, 1);
+        }
+    }
+
+    search_split_release(split);
+    pthread_mutex_unlock(&search->lock);
+
+    if (limited) {
+        search->limited = TRUE;
+        search_cancel(search);
+    }
+}
+
+/* Queue chunks 1..n of a big file in front of the other big files and
+ * return the job for chunk 0, which the caller searches right away. */
+static struct search_job *
+search_split(struct search *search, struct search_job *job)
+{
+    struct search_split *split;
+    struct search_job *first = NULL, *last = NULL;
+    unsigned int i, nchunks;
+    struct stat st;
+    int fd;
+
+    fd = openat(search->query->rootfd, job->path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+        return NULL;
+    PROFILE_COUNT(files_opened, 1);
+
+    if (fstat(fd, &st) < 0 || st.st_size < SEARCH_SPLIT_SIZE) {
+        close(fd);
+        return NULL;
+    }
+
+    nchunks = (st.st_size + SEARCH_CHUNK_SIZE - 1) / SEARCH_CHUNK_SIZE;
+    split = calloc(1, sizeof(*split) + (nchunks - 1) * sizeof(split->chunk[0]));
+    if (!split || !(split->path = strdup(job->path))) {
+        free(split);
+        close(fd);
+        return NULL;
+    }
+
+    split->fd = fd;
+    split->id = job->id;
+    split->nchunks = nchunks;
+
+    for (i = nchunks; i-- > 0; ) {
+        struct search_job *chunk = calloc(1, sizeof(*chunk));
+
+        if (!chunk)
+            break;
+        chunk->split = split;
+        chunk->chunk = i;
+        chunk->next = first;
+        if (!first)
+            last = chunk;
+        first = chunk;
+        split->pending++;
+    }
+
+    /* Without every chunk the line numbers could not be fixed up. */
+    if (i != (unsigned int) -1) {
+        while ((job = first)) {
+            first = job->next;
+            free(job);
+        }
+        split->pending = 1;
+        split->next = nchunks;
+        search_split_release(split);
+        return NULL;
+    }
+
+    job = first;
+    first = first->next;
+
+    if (first) {
+        pthread_mutex_lock(&search->lock);
+        last->next = search->bulk;
+        search->bulk = first;
+        if (!search->bulk_tail)
+            search->bulk_tail = last;
+        pthread_cond_broadcast(&search->cond);
+        pthread_mutex_unlock(&search->lock);
+    }
+
+    job->next = NULL;
+    return job;
+}
+
+static void
+search_chunk(struct search *search, struct search_job *job, char **bufp, size_t *sizep)
+{
+    struct search_split *split = job->split;
+    struct search_scan scan = { split->path };
+    off_t start = (off_t) job->chunk * SEARCH_CHUNK_SIZE;
+    off_t end = job->chunk + 1 < split->nchunks ? start + SEARCH_CHUNK_SIZE : -1;
+    struct profile_stamp stamp = { 0 };
+
+    profile_start(&stamp);
+    scan.split_binary = &split->binary;
+    if (!split->binary &&
+        (!search->query->max_count || split->count < search->query->max_count))
+        search_range(search, &scan, split->fd, start, end, bufp, sizep);
+
+    if (opt_profile) {
+        char name[PATH_MAX];
+
+        snprintf(name, sizeof(name), "%s (chunk %u)", split->path, job->chunk);
+        profile_slow(profile.files, name, profile_clock(CLOCK_MONOTONIC) - stamp.wall);
+    }
+
+    search_chunk_done(search, split, job->chunk, &scan);
+}
+
+static void search_work(struct search *search, bool background)
+{
+    size_t bufsize = SEARCH_BUFSIZ;
+    char *buf = malloc(bufsize);
+    struct search_job *job;
+    int index = background ? 0 : __sync_add_and_fetch(&search->nmatchers, 1);
+#ifdef HAVE_IO_URING
+    struct uring *ring = opt_io == SEARCH_IO_URING ? uring_new() : NULL;
+#endif
+
+    while (buf && (job = search_pop(search, background, index))) {
+        struct search_job *chunk;
+
+#ifdef HAVE_IO_URING
+        if (ring && !ring->broken && !job->split && job->size < URING_SLOT_SIZE) {
+            struct search_job *jobs[URING_SLOTS];
+            unsigned int i, njobs;
+
+            jobs[0] = job;
+            njobs = search_pop_small(search, jobs, 1);
+            search_uring(search, ring, jobs, njobs, &buf, &bufsize);
+            for (i = 0; i < njobs; i++)
+                free(jobs[i]);
+            continue;
+        }
+#endif
+
+        if (job->split) {
+            search_chunk(search, job, &buf, &bufsize);
+        } else if (job->size >= SEARCH_SPLIT_SIZE && (chunk = search_split(search, job))) {
+            search_chunk(search, chunk, &buf, &bufsize);
+            free(chunk);
+        } else {
+            search_file(search, job->path, job->id, job->size, &buf, &bufsize);
+        }
+        free(job);
+    }
+
+#ifdef HAVE_IO_URING
+    if (ring)
+        uring_free(ring);
+#endif
+    free(buf);
+    search_exit(search);
+}
+
+static void *search_worker(void *data)
+{
+    search_work(data, false);
+    return NULL;
+}
+
+static void *search_background_worker(void *data)
+{
+    search_work(data, TRUE);
+    return NULL;
+}
+
+/* The first screen is the number of records to publish one by one, so
+ * they can be painted as soon as they are found. */
+static struct search *
+search_start(const struct search_query *query, unsigned long first_screen)
+{
+    struct search *search = calloc(1, sizeof(*search));
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (!search)
+        return NULL;
+
+    pthread_mutex_init(&search->lock, NULL);
+    pthread_cond_init(&search->cond, NULL);
+    pthread_mutex_init(&search->visited.lock, NULL);
+    search->query = query;
+    search->sock = -1;
+    search->walking = TRUE;
+    search->started = time(NULL);
+    search->refine = search_refine(query);
+    search->first_screen = first_screen;
+
+    /* One matcher per CPU, plus the background one for big files. */
+    if (ncpu < 1)
+        ncpu = 1;
+    if (++ncpu > SEARCH_WORKERS_MAX)
+        ncpu = SEARCH_WORKERS_MAX;
+    io_tuner_init(&search->tuner, query->root, ncpu, opt_io == SEARCH_IO_URING);
+
+    pthread_mutex_lock(&search->lock);
+    for (i = 0; i < ncpu; i++) {
+        if (pthread_create(&search->workers[search->nworkers], NULL,
+                           i ? search_worker : search_background_worker, search))
+            break;
+        search->nworkers++;
+        search->running++;
+    }
+
+    if (search->nworkers && !pthread_create(&search->walker, NULL, search_walker, search)) {
+        search->running++;
+        pthread_mutex_unlock(&search->lock);
+        return search;
+    }
+
+    /* Without a walker the matchers would wait forever. */
+    search->walking = false;
+    search->cancelled = 1;
+    pthread_cond_broadcast(&search->cond);
+    pthread_mutex_unlock(&search->lock);
+
+    for (i = 0; i < search->nworkers; i++)
+        pthread_join(search->workers[i], NULL);
+    free(search);
+    return NULL;
+}
+
+/* Take every record published so far. Done is set once all threads have
+ * finished, so no record can arrive after it. */
+static struct fileinfo **
+search_collect(struct search *search, size_t *count, bool *done)
+{
+    struct fileinfo **results;
+
+    pthread_mutex_lock(&search->lock);
+    results = search->results;
+    *count = search->nresults;
+    *done = !search->running;
+    search->results = NULL;
+    search->nresults = search->results_alloc = 0;
+    pthread_mutex_unlock(&search->lock);
+
+    return results;
+}
+
+static void search_free(struct search *search)
+{
+    struct search_job *job;
+    bool complete;
+    size_t i;
+
+    pthread_mutex_lock(&search->lock);
+    complete = !search->running && !search->cancelled && search->sock < 0;
+    pthread_mutex_unlock(&search->lock);
+
+    search_cancel(search);
+
+    pthread_join(search->walker, NULL);
+    for (i = 0; i < search->nworkers; i++)
+        pthread_join(search->workers[i], NULL);
+
+    if (search->tuner.max_workers)
+        io_tuner_finish(&search->tuner);
+
+    while ((job = search_heap_pop(search)) || (job = search_bulk_pop(search))) {
+        if (job->split)
+            search_split_release(job->split);
+        free(job);
+    }
+    free(search->heap);
+
+    for (i = 0; i < search->nresults; i++)
+        fileinfo_free(search->results[i]);
+    free(search->results);
+
+    for (i = 0; i < search->dups_size; i++)
+        if (search->dups[i].size >= 0)
+            dup_group_put(search->dups[i].group);
+    free(search->dups);
+
+    if (complete && search_history)
+        search_history_add(search);
+    free(search->hits);
+    free(search->refine);
+
+    if (search->sock >= 0)
+        close(search->sock);
+
+    free(search->visited.slots);
+    pthread_mutex_destroy(&search->visited.lock);
+    pthread_cond_destroy(&search->cond);
+    pthread_mutex_destroy(&search->lock);
+    free(search);
+}
+
+/*
+ * Daemon
+ *
+ * "happygrep --daemon" keeps directory listings warm in memory and runs
+ * searches for clients over a Unix domain socket, so repeated searches of
+ * a big tree skip the walk. A client sends its query as "key=value"
+ * strings, each ending in a NUL, and an empty string to finish. The
+ * daemon answers with "name\0number\0content\0" records and ends with an
+ * empty name followed by "done", "limited" or "cancelled".
+ */
+
+/* Returns NULL when there is no safe place for the socket. */
+static const char *daemon_socket_path(void)
+{
+    static char path[PATH_MAX];
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char tmpdir[PATH_MAX];
+    struct stat st;
+
+    if (*opt_socket)
+        return opt_socket;
+
+    if (dir && *dir) {
+        snprintf(path, sizeof(path), "%s/happygrep.sock", dir);
+        return path;
+    }
+
+    /* Anyone can create names in /tmp, so the socket goes in a
+     * directory that only the user owns and can enter. */
+    snprintf(tmpdir, sizeof(tmpdir), "/tmp/happygrep-%lu", (unsigned long) getuid());
+    if (mkdir(tmpdir, 0700) < 0 && errno != EEXIST)
+        return NULL;
+    if (lstat(tmpdir, &st) < 0 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != getuid() || (st.st_mode & 077))
+        return NULL;
+
+    snprintf(path, sizeof(path), "%s/happygrep.sock", tmpdir);
+    return path;
+}
+
+/* Whether the other end of a connected socket runs as the user. */
+static bool daemon_peer_trusted(int fd)
+{
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return !getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) && cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    return !getpeereid(fd, &uid, &gid) && uid == getuid();
+#endif
+}
+
+static int daemon_socket(struct sockaddr_un *addr)
+{
+    const char *path = daemon_socket_path();
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (!path || strlen(path) >= sizeof(addr->sun_path))
+        return -1;
+    string_copy(addr->sun_path, path);
+
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+static void search_query_write(FILE *fp, const struct search_query *query,
+                               unsigned long first_screen)
+{
+    int i;
+
+    fprintf(fp, "root=%s%c", query->root, 0);
+    fprintf(fp, "pattern=%s%c", query->pattern, 0);
+    fprintf(fp, "ignore=%s%c", query->ignore, 0);
+    fprintf(fp, "max-count=%lu%c", query->max_count, 0);
+    fprintf(fp, "max-results=%lu%c", query->max_results, 0);
+    fprintf(fp, "count=%d%c", query->count, 0);
+    fprintf(fp, "list=%d%c", query->list, 0);
+    fprintf(fp, "xdev=%d%c", query->xdev, 0);
+    fprintf(fp, "follow=%d%c", query->follow, 0);
+    fprintf(fp, "icase=%d%c", query->icase, 0);
+    fprintf(fp, "word=%d%c", query->word, 0);
+    fprintf(fp, "git=%d%c", query->git, 0);
+    fprintf(fp, "untracked=%d%c", query->untracked, 0);
+    fprintf(fp, "file=%s%c", query->file, 0);
+    fprintf(fp, "types=%u%c", query->types, 0);
+    for (i = 0; i < query->nglobs; i++)
+        fprintf(fp, "glob=%s%c", query->globs[i], 0);
+    fprintf(fp, "max-filesize=%lld%c", (long long) query->max_filesize, 0);
+    fprintf(fp, "newer=%lld%c", (long long) query->newer, 0);
+    for (i = 0; i < query->npaths; i++)
+        fprintf(fp, "path=%s%c", query->paths[i], 0);
+    fprintf(fp, "screen=%lu%c", first_screen, 0);
+    fputc(0, fp);
+}
+
+static bool search_query_read(FILE *fp, struct search_query *query,
+                              unsigned long *first_screen)
+{
+    char *line = NULL;
+    size_t linelen = 0;
+    bool ok = false;
+
+    while (getdelim(&line, &linelen, 0, fp) > 0 && *line) {
+        char *value = strchr(line, '=');
+
+        if (!value)
+            break;
+        *value++ = 0;
+
+        if (!strcmp(line, "root"))
+            string_copy(query->root, value);
+        else if (!strcmp(line, "pattern"))
+            string_copy(query->pattern, value);
+        else if (!strcmp(line, "ignore"))
+            string_copy(query->ignore, value);
+        else if (!strcmp(line, "max-count"))
+            query->max_count = strtoul(value, NULL, 10);
+        else if (!strcmp(line, "max-results"))
+            query->max_results = strtoul(value, NULL, 10);
+        else if (!strcmp(line, "count"))
+            query->count = !!atoi(value);
+        else if (!strcmp(line, "xdev"))
+            query->xdev = !!atoi(value);
+        else if (!strcmp(line, "follow"))
+            query->follow = !!atoi(value);
+        else if (!strcmp(line, "icase"))
+            query->icase = !!atoi(value);
+        else if (!strcmp(line, "word"))
+            query->word = !!atoi(value);
+        else if (!strcmp(line, "git"))
+            query->git = !!atoi(value);
+        else if (!strcmp(line, "untracked"))
+            query->untracked = !!atoi(value);
+        else if (!strcmp(line, "list"))
+            query->list = !!atoi(value);
+        else if (!strcmp(line, "file"))
+            string_copy(query->file, value);
+        else if (!strcmp(line, "types"))
+            query->types = strtoul(value, NULL, 10);
+        else if (!strcmp(line, "glob") && query->nglobs < SEARCH_GLOBS)
+            string_copy(query->globs[query->nglobs++], value);
+        else if (!strcmp(line, "max-filesize"))
+            query->max_filesize = strtoll(value, NULL, 10);
+        else if (!strcmp(line, "newer"))
+            query->newer = strtoll(value, NULL, 10);
+        else if (!strcmp(line, "path") && query->npaths < SEARCH_PATHS)
+            string_copy(query->paths[query->npaths++], value);
+        else if (!strcmp(line, "screen"))
+            *first_screen = strtoul(value, NULL, 10);
+
+        /* Unknown keys are skipped so older daemons keep working. */
+        ok = TRUE;
+    }
+
+    free(line);
+    return ok && *query->root == '/';
+}
+
+/* Read records from the daemon and publish them like a matcher would. */
+static void *search_reader(void *data)
+{
+    struct search *search = data;
+    FILE *fp = fdopen(dup(search->sock), "r");
+    char *field[3] = { NULL, NULL, NULL };
+    size_t fieldlen[3] = { 0, 0, 0 };
+    int i;
+
+    while (fp && !search->cancelled) {
+        struct fileinfo *fileinfo;
+
+        for (i = 0; i < 3; i++)
+            if (getdelim(&field[i], &fieldlen[i], 0, fp) <= 0)
+                break;
+
+        if (i == 0)
+            break;
+
+        if (!*field[0]) {
+            /* The status follows the empty name. */
+            if (i > 1 && !strcmp(field[1], "limited"))
+                search->limited = TRUE;
+            else if (i > 1 && !strcmp(field[1], "cancelled"))
+                search->cancelled = 1;
+            else if (i > 2 && !strcmp(field[1], "error"))
+                snprintf(search->error, sizeof(search->error), "daemon: %s", field[2]);
+            break;
+        }
+
+        if (i < 3)
+            break;
+
+        fileinfo = search_record(field[0], strtoul(field[1], NULL, 10),
+                                 field[2], strlen(field[2]));
+        if (fileinfo)
+            search_publish(search, &fileinfo, 1);
+    }
+
+    for (i = 0; i < 3; i++)
+        free(field[i]);
+    if (fp)
+        fclose(fp);
+
+    search_exit(search);
+    return NULL;
+}
+
+/* Run the query on the daemon, or return NULL when none is listening. */
+static struct search *search_connect(const struct search_query *query,
+                                     unsigned long first_screen)
+{
+    struct sockaddr_un addr;
+    struct search *search;
+    FILE *fp;
+    int fd;
+
+    /* Groups of copies cannot be sent over the socket. */
+    if (query->dedup)
+        return NULL;
+
+    fd = daemon_socket(&addr);
+    if (fd < 0)
+        return NULL;
+
+    /* A daemon of another user could send anything back. */
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        !daemon_peer_trusted(fd) || !(fp = fdopen(dup(fd), "w"))) {
+        close(fd);
+        return NULL;
+    }
+
+    search_query_write(fp, query, first_screen);
+    if (fclose(fp) || !(search = calloc(1, sizeof(*search)))) {
+        close(fd);
+        return NULL;
+    }
+
+    pthread_mutex_init(&search->lock, NULL);
+    pthread_cond_init(&search->cond, NULL);
+    pthread_mutex_init(&search->visited.lock, NULL);
+    search->query = query;
+    search->sock = fd;
+    search->running = 1;
+    profile.searcher = "the daemon";
+
+    if (pthread_create(&search->walker, NULL, search_reader, search)) {
+        close(fd);
+        pthread_cond_destroy(&search->cond);
+        pthread_mutex_destroy(&search->lock);
+        free(search);
+        return NULL;
+    }
+
+    return search;
+}
+
+static void *daemon_client(void *data)
+{
+    int fd = (int) (long) data;
+    FILE *in = fdopen(dup(fd), "r");
+    FILE *out = fdopen(fd, "w");
+    struct search_query query = { "", "", 0, 0, "", -1 };
+    unsigned long first_screen = 0;
+    struct search *search = NULL;
+    char msg[SIZEOF_STR] = "";
+    bool done = false, compiled = false;
+
+    if (!in || !out || !search_query_read(in, &query, &first_screen)) {
+        string_copy(msg, "bad request");
+    } else if ((query.rootfd = open(query.root, O_RDONLY | O_DIRECTORY)) < 0) {
+        snprintf(msg, sizeof(msg), "%.512s: %s", query.root, strerror(errno));
+    } else if (!(compiled = search_compile(&query, msg, sizeof(msg)))) {
+        /* The message says why. */
+    } else if (!(search = search_start(&query, first_screen))) {
+        string_copy(msg, "failed to start search");
+    }
+
+    while (search && !done) {
+        size_t i, count;
+        struct fileinfo **results = search_collect(search, &count, &done);
+
+        for (i = 0; i < count; i++) {
+            struct fileinfo *fileinfo = results[i];
+
+            fprintf(out, "%s%c%s%c%s%c", fileinfo->name, 0,
+                    fileinfo->number, 0, fileinfo->content, 0);
+            free(fileinfo);
+        }
+        free(results);
+
+        /* The client has gone away. */
+        if (fflush(out) && !search->cancelled)
+            search_cancel(search);
+
+        if (!count && !done)
+            usleep(1000);
+    }
+
+    if (out) {
+        if (!search)
+            fprintf(out, "%cerror%c%s%c", 0, 0, msg, 0);
+        else
+            fprintf(out, "%c%s%c", 0, search->limited ? "limited" :
+                    search->cancelled ? "cancelled" : "done", 0);
+        fclose(out);
+    } else {
+        close(fd);
+    }
+
+    if (in)
+        fclose(in);
+
+    /* The daemon runs for long, a failed request must not leak. */
+    if (search)
+        search_free(search);
+    if (compiled)
+        search_query_free(&query);
+    if (query.rootfd >= 0)
+        close(query.rootfd);
+
+    return NULL;
+}
+
+static void __NORETURN daemon_main(void)
+{
+    static struct dir_cache cache = { PTHREAD_MUTEX_INITIALIZER };
+    static struct search_history history = { PTHREAD_MUTEX_INITIALIZER };
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd = daemon_socket(&addr);
+
+    if (fd < 0) {
+        const char *path = daemon_socket_path();
+
+        fprintf(stderr, "happygrep: cannot create socket %s\n",
+                path ? path : "in a private directory of /tmp");
+        exit(1);
+    }
+
+    /* Only the owner may connect. */
+    umask(077);
+
+    /* Replace the socket of an earlier daemon, never anything else. */
+    if (!lstat(addr.sun_path, &st)) {
+        if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+            fprintf(stderr, "happygrep: %s: not a socket of yours\n", addr.sun_path);
+            exit(1);
+        }
+        unlink(addr.sun_path);
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        fprintf(stderr, "happygrep: %s: %s\n", addr.sun_path, strerror(errno));
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    dir_cache = &cache;
+    dir_persist = !opt_no_cache;
+    search_history = &history;
+    fprintf(stderr, "happygrep: listening on %s\n", addr.sun_path);
+
+    for (;;) {
+        pthread_t thread;
+        int client = accept(fd, NULL, NULL);
+
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "happygrep: accept: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        if (!daemon_peer_trusted(client)) {
+            close(client);
+            continue;
+        }
+
+        if (pthread_create(&thread, NULL, daemon_client, (void *) (long) client))
+            close(client);
+        else
+            pthread_detach(thread);
+    }
+}
+
+/*
+ * External backends
+ *
+ * With --backend the search is run by grep, ripgrep or git grep instead
+ * of the matchers, each asked for a NUL after the file name. Its output
+ * is read in big blocks, and a single pass that turns 64 bytes at a time
+ * into a bit mask of NULs and newlines splits it into records in place:
+ * a line of any length just grows the buffer, and nothing is copied but
+ * the unfinished record at the end of a block.
+ */
+
+enum search_backend {
+    SEARCH_BACKEND_NONE,
+    SEARCH_BACKEND_GREP,        /* "path\0lineno:line\n" */
+    SEARCH_BACKEND_RG,          /* "path\0lineno:line\n" */
+    SEARCH_BACKEND_GIT,         /* "path\0lineno\0line\n" */
+};
+
+static const char *search_backend_names[] = { "internal", "grep", "rg", "git" };
+
+static enum search_backend opt_backend = SEARCH_BACKEND_NONE;
+
+#define BACKEND_BUFSIZ      (1024 * 1024)
+#define BACKEND_ARGS        (32 + SEARCH_GLOBS + SEARCH_PATHS)
+
+/* Bit i is set when buf[i] is a NUL or a newline. */
+static inline unsigned long long backend_mask(const char *buf, size_t len)
+{
+    unsigned long long mask = 0;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    if (len >= 64) {
+        const __m128i *p = (const __m128i *) buf;
+        const __m128i nl = _mm_set1_epi8('\n'), nul = _mm_setzero_si128();
+        int j;
+
+        for (j = 0; j < 4; j++) {
+            __m128i v = _mm_loadu_si128(p + j);
+
+            mask |= (unsigned long long) (unsigned) _mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, nul))) << (16 * j);
+        }
+        return mask;
+    }
+#endif
+
+    for (; i < len && i < 64; i++)
+        if (buf[i] == '\n' || !buf[i])
+            mask |= 1ULL << i;
+    return mask;
+}
+
+/* Build the command line, the strings live in args. */
+static int backend_argv(const struct search_query *query, const char **argv,
+                        char args[][PATH_MAX + 32])
+{
+    int argc = 0, nargs = 0, i;
+
+#define ARG(s)          (argv[argc++] = (s))
+#define ARGF(...)       (snprintf(args[nargs], sizeof(args[nargs]), __VA_ARGS__), \
+                         ARG(args[nargs++]))
+
+    switch (opt_backend) {
+    case SEARCH_BACKEND_GREP:
+        ARG("grep");
+        ARG(query->follow ? "-R" : "-r");
+        ARG("-nHIZ");
+        if (query->icase)
+            ARG("-i");
+        ARG("--color=never");
+        /* What search_ignored() skips, without "." or "..". */
+        ARG("--exclude=.*");
+        ARG("--exclude-dir=.[!.]*");
+        ARG("--exclude=tags");
+        ARG("--exclude-dir=tags");
+        if (*query->ignore) {
+            ARGF("--exclude-dir=%s", query->ignore);
+            ARGF("--exclude=%s", query->ignore);
+        }
+        if (query->max_count)
+            ARGF("-m%lu", query->max_count);
+        for (i = 0; i < query->nglobs; i++)
+            if (*query->globs[i] == '!')
+                ARGF("--exclude=%s", query->globs[i] + 1);
+            else
+                ARGF("--include=%s", query->globs[i]);
+        break;
+
+    case SEARCH_BACKEND_RG:
+        ARG("rg");
+        ARG("-nH");
+        ARG(query->icase ? "-i" : "-s");
+        ARG("--null");
+        ARG("--no-heading");
+        ARG("--color=never");
+        ARG("--no-ignore");
+        ARG("--glob=!.*");
+        ARG("--glob=!tags");
+        if (*query->ignore)
+            ARGF("--glob=!%s", query->ignore);
+        if (query->max_count)
+            ARGF("-m%lu", query->max_count);
+        if (query->follow)
+            ARG("-L");
+        if (query->xdev)
+            ARG("--one-file-system");
+        for (i = 0; i < query->nglobs; i++)
+            ARGF("--glob=%s", query->globs[i]);
+        break;
+
+    case SEARCH_BACKEND_GIT:
+        ARG("git");
+        ARG("grep");
+        ARG("-nzI");
+        if (query->icase)
+            ARG("-i");
+        ARG("--no-color");
+        if (query->untracked)
+            ARG("--untracked");
+        break;
+
+    case SEARCH_BACKEND_NONE:
+        return 0;
+    }
+
+    if (query->word)
+        ARG("-w");
+    ARG("-e");
+    ARG(query->pattern);
+    ARG("--");
+    if (*query->file)
+        ARG(query->file);
+    for (i = 0; !*query->file && i < query->npaths; i++)
+        ARG(query->paths[i]);
+    if (!*query->file && !query->npaths)
+        ARG(".");
+
+    /* Filters that git grep takes as pathspecs. */
+    if (opt_backend == SEARCH_BACKEND_GIT) {
+        ARG(":(exclude,glob)**/.*");
+        ARG(":(exclude,glob)**/.*/**");
+        ARG(":(exclude,glob)**/tags");
+        ARG(":(exclude,glob)**/tags/**");
+        if (*query->ignore)
+            ARGF(":(exclude,glob)**/%s/**", query->ignore);
+        for (i = 0; i < query->nglobs; i++)
+            if (*query->globs[i] == '!')
+                ARGF(":(exclude,glob)**/%s", query->globs[i] + 1);
+            else
+                ARGF(":(glob)**/%s", query->globs[i]);
+    }
+
+#undef ARGF
+#undef ARG
+
+    argv[argc] = NULL;
+    return argc;
+}
+
+/* What the reader keeps between records. */
+struct backend_state {
+    char path[PATH_MAX];        /* Of the last record. */
+    unsigned long count;        /* Its records so far. */
+    struct fileinfo **found;
+    size_t nfound, alloc;
+};
+
+/* Turn "path\0lineno:line" or "path\0lineno\0line" ending at the newline
+ * into a record. Returns false when the search should stop. */
+static bool
+backend_record(struct search *search, struct backend_state *state,
+               char *record, char *sep, char *end)
+{
+    const struct search_query *query = search->query;
+    struct fileinfo *fileinfo;
+    unsigned long lineno = 0;
+    char *pos = sep + 1;
+
+    while (pos < end && isdigit((unsigned char) *pos))
+        lineno = lineno * 10 + *pos++ - '0';
+    if (pos == sep + 1 || pos == end || (*pos != ':' && *pos))
+        return TRUE;            /* Not a record, skip it. */
+
+    if (record[0] == '.' && record[1] == '/')
+        record += 2;
+
+    if (strcmp(record, state->path)) {
+        if (query->count)
+            search_publish_count(search, state->path, state->count);
+        string_copy(state->path, record);
+        state->count = 0;
+    }
+
+    /* git grep may not know --max-count. */
+    if (query->max_count && state->count >= query->max_count)
+        return TRUE;
+    state->count++;
+
+    if (query->max_results &&
+        __sync_fetch_and_add(&search->matches, 1) >= query->max_results) {
+        search->limited = TRUE;
+        search_cancel(search);
+        return false;
+    }
+
+    if (query->count)
+        return TRUE;
+
+    if (state->nfound == state->alloc) {
+        size_t alloc = state->alloc * 2 + 64;
+        struct fileinfo **tmp = realloc(state->found, alloc * sizeof(*tmp));
+
+        if (!tmp)
+            return false;
+        state->found = tmp;
+        state->alloc = alloc;
+    }
+
+    fileinfo = search_record(record, lineno, pos + 1, end - pos - 1);
+    if (fileinfo)
+        state->found[state->nfound++] = fileinfo;
+    return TRUE;
+}
+
+/* Read the backend's output and publish it like a matcher would. */
+static void *backend_reader(void *data)
+{
+    struct search *search = data;
+    struct backend_state state = { "" };
+    size_t size = BACKEND_BUFSIZ, len = 0, scanned = 0, start = 0;
+    char *buf = malloc(size), *sep = NULL;
+    int status = 0;
+    bool more = TRUE, eof = false;
+    pid_t pid;
+
+    while (buf && more && !search->cancelled) {
+        struct profile_stamp stamp = { 0 };
+        ssize_t n;
+
+        /* Keep the unfinished record, growing for a line of any length. */
+        if (start) {
+            memmove(buf, buf + start, len - start);
+            if (sep)
+                sep -= start;
+            len -= start;
+            scanned -= start;
+            start = 0;
+        }
+        if (len == size) {
+            size_t at = sep ? sep - buf : 0;
+            char *tmp = realloc(buf, size * 2);
+
+            if (!tmp)
+                break;
+            if (sep)
+                sep = tmp + at;
+            buf = tmp;
+            size *= 2;
+            PROFILE_ALLOC(size);
+        }
+
+        profile_start(&stamp);
+        n = read(search->sock, buf + len, size - len);
+        profile_end(PROFILE_READ, &stamp);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            eof = !n;
+            break;
+        }
+        PROFILE_COUNT(bytes_read, n);
+        len += n;
+
+        profile_start(&stamp);
+        while (more && scanned < len) {
+            unsigned long long mask = backend_mask(buf + scanned, len - scanned);
+            size_t base = scanned;
+
+            scanned += len - scanned < 64 ? len - scanned : 64;
+
+            for (; mask && more; mask &= mask - 1) {
+                char *pos = buf + base + __builtin_ctzll(mask);
+
+                /* The first NUL ends the name, any later one is data. */
+                if (!*pos) {
+                    if (!sep)
+                        sep = pos;
+                    continue;
+                }
+
+                *pos = 0;
+                if (sep)
+                    more = backend_record(search, &state, buf + start, sep, pos);
+                start = pos + 1 - buf;
+                sep = NULL;
+            }
+        }
+        profile_end(PROFILE_MATCH, &stamp);
+
+        search_publish(search, state.found, state.nfound);
+        state.nfound = 0;
+    }
+
+    if (search->query->count && !search->cancelled)
+        search_publish_count(search, state.path, state.count);
+    free(state.found);
+    free(buf);
+
+    /* A backend stopped early would wait forever for its pipe. */
+    pthread_mutex_lock(&search->lock);
+    pid = search->pid;
+    if (pid > 0 && !eof)
+        kill(pid, SIGTERM);
+    search->pid = 0;
+    pthread_mutex_unlock(&search->lock);
+
+    if (pid > 0 && waitpid(pid, &status, 0) == pid && !search->cancelled) {
+        /* grep and rg exit with 1 when nothing matched. */
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+            snprintf(search->error, sizeof(search->error), "%s: command not found",
+                     search_backend_names[opt_backend]);
+        else if (!WIFEXITED(status) || WEXITSTATUS(status) > 1)
+            snprintf(search->error, sizeof(search->error), "%s failed with status %d",
+                     search_backend_names[opt_backend],
+                     WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    }
+
+    search_exit(search);
+    return NULL;
+}
+
+/* Run the query with the --backend program, or return NULL when there
+ * is none or it cannot be started. */
+static struct search *search_external(const struct search_query *query)
+{
+    const char *argv[BACKEND_ARGS];
+    char args[SEARCH_GLOBS + 4][PATH_MAX + 32];
+    struct search *search;
+    int fds[2];
+    pid_t pid;
+
+    if (opt_backend == SEARCH_BACKEND_NONE || query->list)
+        return NULL;
+
+    backend_argv(query, argv, args);
+    if (pipe(fds) < 0)
+        return NULL;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+    pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+
+    if (!pid) {
+        int null = open("/dev/null", O_RDWR);
+
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        if (null >= 0) {
+            dup2(null, STDIN_FILENO);
+            /* Messages would scribble over the TUI. */
+            if (!opt_print)
+                dup2(null, STDERR_FILENO);
+        }
+        if (chdir(query->root) < 0)
+            _exit(126);
+        execvp(argv[0], (char **) argv);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    if (!(search = calloc(1, sizeof(*search)))) {
+        close(fds[0]);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return NULL;
+    }
+
+    pthread_mutex_init(&search->lock, NULL);
+    pthread_cond_init(&search->cond, NULL);
+    pthread_mutex_init(&search->visited.lock, NULL);
+    search->query = query;
+    search->sock = fds[0];
+    search->pid = pid;
+    search->running = 1;
+    profile.searcher = search_backend_names[opt_backend];
+
+    if (pthread_create(&search->walker, NULL, backend_reader, search)) {
+        close(fds[0]);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        pthread_cond_destroy(&search->cond);
+        pthread_mutex_destroy(&search->lock);
+        free(search);
+        return NULL;
+    }
+
+    return search;
+}
+
+/*
+ * Headless client
+ *
+ * "--print" runs the search without the TUI and prints the records the
+ * way "grep -n" would, through the daemon when one is listening.
+ */
+
+static int print_main(void)
+{
+    struct search *search = NULL;
+    unsigned long lines = 0;
+    bool done = false;
+
+    search = search_external(&opt_query);
+    if (!search && !opt_no_daemon)
+        search = search_connect(&opt_query, 0);
+    if (!search)
+        search = search_start(&opt_query, 0);
+    if (!search) {
+        fprintf(stderr, "happygrep: failed to start search\n");
+        return 2;
+    }
+
+    while (!done) {
+        struct profile_stamp stamp = { 0 };
+        size_t i, count;
+        struct fileinfo **results;
+
+        profile_start(&stamp);
+        results = search_collect(search, &count, &done);
+        for (i = 0; i < count; i++) {
+            if (opt_query.list)
+                printf("%s\n", results[i]->name);
+            else if (opt_query.count)
+                printf("%s:%s\n", results[i]->name, results[i]->number);
+            else
+                printf("%s:%s:%s\n", results[i]->name, results[i]->number, results[i]->content);
+            fileinfo_free(results[i]);
+        }
+        free(results);
+        lines += count;
+
+        if (count)
+            fflush(stdout);
+        profile_end(PROFILE_COLLECT, &stamp);
+        if (!count && !done)
+            usleep(1000);
+    }
+
+    if (*search->error)
+        fprintf(stderr, "happygrep: %s\n", search->error);
+    search_free(search);
+    profile_report(stderr);
+    return lines ? 0 : 1;
+}
+
+struct view {
+    const char *name;
+
+    /* Rendering */
+    bool (*read)(struct view *view, struct fileinfo *fileinfo);
+    bool (*render)(struct view *view, unsigned int lineno);
+    WINDOW *win;
+    WINDOW *title;
+    int height, width;
+
+    /* Navigation */
+    unsigned long offset;    /* Offset of the window top */
+    unsigned long lineno;    /* Current line number */
+
+    /* Buffering */
+    unsigned long lines;    /* Total number of lines */
+    unsigned long line_alloc;
+    void **line;        /* Line index */
+
+    /* filename */
+    char file[BUFSIZ];
+
+    /* Loading */
+    struct search *search;
+    struct timespec loaded;     /* When the search started. */
+};
+
+static int view_driver(struct view *view, int key);
+static int update_view(struct view *view);
+static bool begin_update(struct view *view);
+static void end_update(struct view *view);
+static void redraw_view_from(struct view *view, int lineno);
+static void redraw_view(struct view *view);
+static bool view_grow(struct view *view, size_t n);
+static void redraw_display(bool clear);
+static bool default_read(struct view *view, struct fileinfo *fileinfo);
+static bool default_render(struct view *view, unsigned int lineno);
+static bool counts_read(struct view *view, struct fileinfo *fileinfo);
+static bool counts_render(struct view *view, unsigned int lineno);
+static bool files_read(struct view *view, struct fileinfo *fileinfo);
+static bool files_render(struct view *view, unsigned int lineno);
+static bool files_key(int key);
+static void navigate_view(struct view *view, int request);
+static void navigate_view_pg(struct view *view, int request);
+static void move_view(struct view *view, int lines);
+static void update_title_win(struct view *view);
+static void open_view(struct view *prev, struct view *view, const char *file);
+static void resize_display(void);
+static void logout(const char* fmt, ...);
+static void replace_forget(void);
+static void sort_forget(void);
+static void runs_forget(void);
+static void runs_add(struct view *view, unsigned long lineno);
+static void runs_invalidate(void);
+/* declaration end */
+
+static bool g_startup = true;
+
+/* XXX: Keep in sync with the REQ_VIEW_* requests. */
+static struct view views[] = {
+    { "main",   default_read,   default_render },
+    { "counts", counts_read,    counts_render },
+    { "files",  files_read,     files_render },
+};
+
+#define VIEW(req)   (&views[(req) - REQ_OFFSET - 1])
+
+/* The display array of active views and the index of the current view. */
+static struct view *display[1];
+static unsigned int current_view;
+
+#define foreach_view(view, i) \
+    for (i = 0; i < ARRAY_SIZE(display) && (view = display[i]); i++)
+
+static bool cursed = false;
+static volatile sig_atomic_t cancel_requested;
+static WINDOW *status_win;
+static char vim_cmd[BUFSIZ];
+
+/*
+ * Line-oriented content detection.
+ */
+
+#define LINE_INFO \
+/*   Line type     String    Foreground     Background    Attributes
+ *   ---------     -------   ----------     ----------    ---------- */ \
+/* UI colors */ \
+LINE(DEFAULT,       "",     COLOR_DEFAULT,  COLOR_DEFAULT,  A_NORMAL), \
+LINE(CURSOR,        "",     COLOR_WHITE,    COLOR_GREEN,    A_BOLD), \
+LINE(STATUS,        "",     COLOR_GREEN,    COLOR_DEFAULT,  0), \
+LINE(DELIMITER,     "",     COLOR_MAGENTA,  COLOR_DEFAULT,  0), \
+LINE(TITLE_FOCUS,   "",     COLOR_WHITE,    COLOR_BLUE,     A_BOLD), \
+LINE(FILE_NAME,     "",     COLOR_BLUE,     COLOR_DEFAULT,  0), \
+LINE(FILE_LINUM,    "",     COLOR_GREEN,    COLOR_DEFAULT,  0), \
+LINE(FILE_LINCON,   "",     COLOR_DEFAULT,  COLOR_DEFAULT,  0), \
+LINE(ERR,           "",     COLOR_RED,      COLOR_DEFAULT,  0), \
+
+enum line_type {
+#define LINE(type, line, fg, bg, attr) \
+    LINE_##type
+    LINE_INFO
+#undef  LINE
+};
+
+struct line_info {
+    const char *line;   /* The start of line to match. */
+    int linelen;        /* Size of string to match. */
+    int fg, bg, attr;   /* Color and text attributes for the lines. */
+};
+
+static struct line_info line_info[] = {
+#define LINE(type, line, fg, bg, attr) \
+    { (line), sizeof(line), (fg), (bg), (attr) }
+    LINE_INFO
+#undef  LINE
+};
+
+static const char usage[] =
+"Usage: happygrep [option1] PATTERN\n"
+"   or: happygrep PATTERN [option2]... [PATH]...\n"
+"   or: happygrep --daemon [--socket PATH] [--io MODE] [--no-cache]\n"
+"\n"
+"Search for PATTERN in the current directory, by default exclude all the hidden\n\
+files and the file named tags. PATTERN can support the basic regex, and case\n\
+is ignored unless -s or -S say otherwise.\n\
+When use option2 switch, you can specify a DIR|FILE to be ignored or limit\n\
+the number of results. Given PATHs (up to 16 directories or files), they are\n\
+searched at the same time instead and the results are grouped by PATH.\n"
+"\n"
+"Option1:\n"
+"  --help                This help\n"
+"  --version             Display version & copyright\n"
+"  --daemon              Keep directory listings warm and serve searches\n"
+"                        over a Unix socket (also run as happygrepd)\n"
+"\n"
+"Option2:\n"
+"  -i, --ignore NAME     Ignore a dir or file\n"
+"  -x, --one-file-system Do not descend into other file systems\n"
+"  -w, --word-regexp     Only match whole words\n"
+"  -s, --smart-case      Match case if PATTERN has upper case letters\n"
+"  -S, --case-sensitive  Match case\n"
+"  -I, --ignore-case     Ignore case, the default\n"
+"  -L, --follow          Descend into symlinked directories\n"
+"  --git                 In a git checkout, search the files in its index\n"
+"  --untracked           Like --git, plus untracked files not ignored\n"
+"  --dedup               Search identical files once, Enter lists the copies\n"
+"  -m, --max-count NUM   Stop reading a file after NUM matching lines\n"
+"  --max-results NUM     Stop searching after NUM matching lines in total\n"
+"  -t, --type TYPE       Only search files of TYPE, like c or py (--type-list)\n"
+"  -g, --glob GLOB       Only search files matching GLOB, or not if !GLOB\n"
+"  --max-filesize SIZE   Skip files larger than SIZE, like 5M\n"
+"  --newer AGE|FILE      Only files modified within AGE, like 1d, or after FILE\n"
+"  -c, --count           Show matching lines per file and directory\n"
+"  -p, --files           Find files by name, typing a fuzzy query\n"
+"  --print               Print matching lines instead of opening the TUI\n"
+"  --no-daemon           Search here even when a daemon is listening\n"
+"  --socket PATH         Daemon socket, by default in $XDG_RUNTIME_DIR\n"
+"  --no-cache            Do not keep directory listings in ~/.cache/happygrep\n"
+"  --io MODE             Read files with pread (default) or uring\n"
+"  --backend NAME        Search with grep, rg or git (git grep) instead\n"
+"  --profile             Print where the time went to stderr on exit\n"
+"\n"
+"Examples: happygrep 'hello world'\n"
+"      or: happygrep 'hello$' -i 'main.c'\n"
+"      or: happygrep 'TODO' -m 1 --max-results 500\n"
+"      or: happygrep 'struct' -t c -g '!test_*' --newer 1d\n"
+"      or: happygrep 'TODO' src include ../lib/util.c\n";
+
+static void __NORETURN usage_error(const char *msg, const char *arg)
+{
+    printf("happygrep: ");
+    printf(msg, arg);
+    printf("\n\n%s\n", usage);
+    exit(1);
+}
+
+static const char *option_value(int argc, const char *argv[], int *i)
+{
+    if (*i + 1 >= argc)
+        usage_error("option '%s' requires an argument.", argv[*i]);
+    return argv[++*i];
+}
+
+/* A size like 512, 64K, 5M or 1G. */
+static off_t option_size(int argc, const char *argv[], int *i)
+{
+    const char *value = option_value(argc, argv, i);
+    char *end;
+    long long size = strtoll(value, &end, 10);
+
+    switch (*end) {
+    case 'G': case 'g': size <<= 10;
+    case 'M': case 'm': size <<= 10;
+    case 'K': case 'k': size <<= 10;
+        end++;
+    }
+
+    if (!*value || *end || size <= 0)
+        usage_error("invalid size '%s'.", value);
+    return size;
+}
+
+/* An age like 30m, 2h or 1d back from now, or the mtime of a file. */
+static time_t option_time(int argc, const char *argv[], int *i)
+{
+    static const struct { char unit; long seconds; } units[] = {
+        { 's', 1 }, { 'm', 60 }, { 'h', 3600 }, { 'd', 86400 }, { 'w', 7 * 86400 },
+    };
+    const char *value = option_value(argc, argv, i);
+    char *end;
+    long age = strtol(value, &end, 10);
+    struct stat st;
+    int j;
+
+    for (j = 0; end != value && age > 0 && j < ARRAY_SIZE(units); j++)
+        if (*end == units[j].unit && !end[1])
+            return time(NULL) - age * units[j].seconds;
+
+    if (!stat(value, &st))
+        return ST_MTIM(&st).tv_sec + 1;
+
+    usage_error("'%s' is neither an age like 1d nor a file.", value);
+    return 0;
+}
+
+static void __NORETURN print_types(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(file_types); i++)
+        printf("%-6s %s\n", file_types[i].name, file_types[i].exts);
+    exit(0);
+}
+
+static void option_types(const char *value)
+{
+    char name[SIZEOF_STR];
+    char *type, *next;
+
+    string_copy(name, value);
+    for (type = name; type; type = next) {
+        int index;
+
+        if ((next = strchr(type, ',')))
+            *next++ = 0;
+        index = file_type_find(type);
+        if (index < 0)
+            usage_error("unknown type '%s', see --type-list.", type);
+        opt_query.types |= 1u << index;
+    }
+}
+
+static unsigned long option_number(int argc, const char *argv[], int *i)
+{
+    const char *value = option_value(argc, argv, i);
+    char *end;
+    unsigned long number = strtoul(value, &end, 10);
+
+    if (!*value || *end || !number)
+        usage_error("invalid number '%s'.", value);
+    return number;
+}
+
+int parse_options(int argc, const char *argv[])
+{
+    size_t len;
+    int i, first = 2;
+
+    /* Started as happygrepd, the same as "happygrep --daemon". */
+    len = strlen(argv[0]);
+    if (len >= 10 && !strcmp(argv[0] + len - 10, "happygrepd")) {
+        opt_daemon = TRUE;
+        first = 1;
+    }
+
+    if (argc <= 1 && !opt_daemon) {
+        printf("happygrep: invalid number of arguments.\n\n");
+        printf("%s\n", usage);
+        exit(1);
+    }
+
+    if (opt_daemon) {
+        /* Only daemon options follow. */
+    } else if (!strcmp(argv[1], "--help")) {
+        printf("%s\n", usage);
+        exit(1);
+    } else if (!strcmp(argv[1], "--version")) {
+        printf("%s\n", VERSION);
+        exit(1);
+    } else if (!strcmp(argv[1], "--type-list")) {
+        print_types();
+    } else if (!strcmp(argv[1], "--daemon")) {
+        opt_daemon = TRUE;
+    } else {
+        string_copy(opt_query.pattern, argv[1]);
+    }
+
+    for (i = first; i < argc; i++) {
+        const char *opt = argv[i];
+
+        if (!strcmp(opt, "--socket")) {
+            string_copy(opt_socket, option_value(argc, argv, &i));
+
+        } else if (!strcmp(opt, "--no-cache")) {
+            opt_no_cache = TRUE;
+
+        } else if (!strcmp(opt, "--io")) {
+            const char *mode = option_value(argc, argv, &i);
+
+            if (!strcmp(mode, "pread"))
+                opt_io = SEARCH_IO_PREAD;
+            else if (!strcmp(mode, "uring"))
+                opt_io = SEARCH_IO_URING;
+            else
+                usage_error("unknown I/O mode '%s'.", mode);
+
+        } else if (opt_daemon) {
+            usage_error("unknown daemon option '%s'.", opt);
+
+        } else if (!strcmp(opt, "-i") || !strcmp(opt, "--ignore")) {
+            string_copy(opt_query.ignore, option_value(argc, argv, &i));
+            /* Allow "-i image/" for the image directory. */
+            len = strlen(opt_query.ignore);
+            while (len > 1 && opt_query.ignore[len - 1] == '/')
+                opt_query.ignore[--len] = '\0';
+
+        } else if (!strcmp(opt, "-x") || !strcmp(opt, "--one-file-system")) {
+            opt_query.xdev = TRUE;
+
+        } else if (!strcmp(opt, "-w") || !strcmp(opt, "--word-regexp")) {
+            opt_query.word = TRUE;
+
+        } else if (!strcmp(opt, "-s") || !strcmp(opt, "--smart-case")) {
+            opt_case = SEARCH_CASE_SMART;
+
+        } else if (!strcmp(opt, "-S") || !strcmp(opt, "--case-sensitive")) {
+            opt_case = SEARCH_CASE_SENSITIVE;
+
+        } else if (!strcmp(opt, "-I") || !strcmp(opt, "--ignore-case")) {
+            opt_case = SEARCH_CASE_IGNORE;
+
+        } else if (!strcmp(opt, "-L") || !strcmp(opt, "--follow")) {
+            opt_query.follow = TRUE;
+
+        } else if (!strcmp(opt, "--git")) {
+            opt_query.git = TRUE;
+
+        } else if (!strcmp(opt, "--untracked")) {
+            opt_query.git = opt_query.untracked = TRUE;
+
+        } else if (!strcmp(opt, "--dedup")) {
+            opt_query.dedup = TRUE;
+
+        } else if (!strcmp(opt, "-m") || !strcmp(opt, "--max-count")) {
+            opt_query.max_count = option_number(argc, argv, &i);
+
+        } else if (!strcmp(opt, "-c") || !strcmp(opt, "--count")) {
+            opt_query.count = TRUE;
+
+        } else if (!strcmp(opt, "-p") || !strcmp(opt, "--files")) {
+            opt_query.list = TRUE;
+
+        } else if (!strcmp(opt, "-t") || !strcmp(opt, "--type")) {
+            option_types(option_value(argc, argv, &i));
+
+        } else if (!strcmp(opt, "--type-list")) {
+            print_types();
+
+        } else if (!strcmp(opt, "-g") || !strcmp(opt, "--glob")) {
+            if (opt_query.nglobs == SEARCH_GLOBS)
+                usage_error("at most %s --glob options.", "8");
+            string_copy(opt_query.globs[opt_query.nglobs++], option_value(argc, argv, &i));
+
+        } else if (!strcmp(opt, "--max-filesize")) {
+            opt_query.max_filesize = option_size(argc, argv, &i);
+
+        } else if (!strcmp(opt, "--newer")) {
+            opt_query.newer = option_time(argc, argv, &i);
+
+        } else if (!strcmp(opt, "--max-results")) {
+            opt_query.max_results = option_number(argc, argv, &i);
+
+        } else if (!strcmp(opt, "--print")) {
+            opt_print = TRUE;
+
+        } else if (!strcmp(opt, "--no-daemon")) {
+            opt_no_daemon = TRUE;
+
+        } else if (!strcmp(opt, "--profile")) {
+            opt_profile = TRUE;
+
+        } else if (!strcmp(opt, "--backend")) {
+            const char *name = option_value(argc, argv, &i);
+
+            for (opt_backend = 0; opt_backend < ARRAY_SIZE(search_backend_names); opt_backend++)
+                if (!strcmp(name, search_backend_names[opt_backend]))
+                    break;
+            if (opt_backend == ARRAY_SIZE(search_backend_names))
+                usage_error("unknown backend '%s'.", name);
+
+        } else if (*opt != '-') {
+            char *path = opt_query.paths[opt_query.npaths];
+            struct stat st;
+
+            if (opt_query.npaths == SEARCH_PATHS)
+                usage_error("at most %s paths to search.", "16");
+            if (stat(opt, &st) < 0) {
+                printf("happygrep: %s: %s\n", opt, strerror(errno));
+                exit(1);
+            }
+            string_copy(opt_query.paths[opt_query.npaths++], opt);
+            len = strlen(path);
+            while (len > 1 && path[len - 1] == '/')
+                path[--len] = '\0';
+
+        } else {
+            usage_error("unknown option '%s'.", opt);
+        }
+    }
+
+    if (opt_query.git && opt_query.npaths)
+        usage_error("%s searches the current directory only.", "--git");
+
+    /* Smart case looks for upper case outside of escapes like "\W". */
+    opt_query.icase = opt_case != SEARCH_CASE_SENSITIVE;
+    for (i = 0; opt_case == SEARCH_CASE_SMART && opt_query.pattern[i]; i++) {
+        if (opt_query.pattern[i] == '\\' && opt_query.pattern[i + 1])
+            i++;
+        else if (isupper((unsigned char) opt_query.pattern[i]))
+            opt_query.icase = false;
+    }
+
+    /* The backends only know names, not sizes or mtimes. */
+    if (opt_backend && (opt_query.types || opt_query.max_filesize || opt_query.newer ||
+                        opt_query.dedup ||
+                        (opt_query.git && opt_backend != SEARCH_BACKEND_GIT)))
+        usage_error("--backend %s cannot filter by type, size, age or git index, or dedup.",
+                    search_backend_names[opt_backend]);
+
+    return 0;
+}
+
+int main(int argc, const char *argv[])
+{
+    static struct dir_cache cache = { PTHREAD_MUTEX_INITIALIZER };
+    const char *codeset = "UTF-8";
+    /* c must be int not char, because the maximum value of KEY_RESIZE is 632. */
+    int c;
+    enum request request;
+    struct view *view;
+    char msg[SIZEOF_STR];
+
+    parse_options(argc, argv);
+    if (opt_profile)
+        profile_init();
+    file_types_init();
+
+    if (opt_daemon)
+        daemon_main();
+
+    /* The daemon needs to know where to search. */
+    if (!getcwd(opt_query.root, sizeof(opt_query.root)))
+        string_copy(opt_query.root, ".");
+
+    if (!search_compile(&opt_query, msg, sizeof(msg))) {
+        printf("happygrep: invalid pattern '%s': %s\n", opt_query.pattern, msg);
+        exit(1);
+    }
+
+    /* Searching here keeps listings in memory and on disk for next time. */
+    if (!opt_no_cache && *opt_query.root == '/') {
+        dir_cache = &cache;
+        dir_persist = TRUE;
+    }
+
+    if (opt_print)
+        return print_main();
+
+    request = opt_query.list ? REQ_VIEW_FILES :
+              opt_query.count ? REQ_VIEW_COUNTS : REQ_VIEW_MAIN;
+
+    signal(SIGINT, interrupt);
+
+    if (setlocale(LC_ALL, "")) {
+        codeset = nl_langinfo(CODESET);
+    }
+
+    if (*opt_encoding && strcmp(codeset, "UTF-8")) {
+        opt_iconv_in = iconv_open("UTF-8", opt_encoding);
+        if (opt_iconv_in == ICONV_NONE)
+            die("Failed to initialize character set conversion");
+    }
+
+    if (codeset && strcmp(codeset, "UTF-8")) {
+        opt_iconv_out = iconv_open(codeset, "UTF-8");
+        if (opt_iconv_out == ICONV_NONE)
+            die("Failed to initialize character set conversion");
+    }
+
+    init();
+
+    for (;;) {
+        struct profile_stamp stamp = { 0 };
+        bool more;
+        int i;
+
+        /* Keys move and repaint the view. */
+        profile_start(&stamp);
+        more = view_driver(display[current_view], request);
+        profile_end(PROFILE_PAINT, &stamp);
+        if (!more)
+            break;
+
+        foreach_view (view, i){
+            update_view(view);
+
+						logout("<update view> lineno=%lu lines=%lu offset=%lu height=%d\n", view->lineno, view->lines, view->offset, view->height);
+				}
+
+        /* Keep polling for results while a search is running, and more
+         * often until the first screen is painted. */
+        view = display[current_view];
+        if (view && view->search)
+            wtimeout(status_win, view->lines < view->height ? 5 : 20);
+        else
+            wtimeout(status_win, -1);
+
+        c = wgetch(status_win);
+
+        /* The files view takes typed keys as its query. */
+        if (view == VIEW(REQ_VIEW_FILES) && files_key(c))
+            request = c;
+        else if (view == VIEW(REQ_VIEW_FILES) && (c == KEY_LEFT || c == 27))
+            request = REQ_VIEW_MAIN;
+        else
+            request = get_request(c);
+
+        if (cancel_requested) {
+            cancel_requested = 0;
+            request = REQ_STOP_LOADING;
+        }
+
+        if ( request == REQ_SCREEN_RESIZE) {
+
+            int height, width;
+
+            getmaxyx(stdscr, height, width);
+
+            wresize(status_win, 1, width);
+            mvwin(status_win, height - 1, 0);
+            wrefresh(status_win);
+        }
+    }
+
+    quit(0);
+
+    return 0;
+}
+
+static void __NORETURN quit(int sig)
+{
+    /* XXX: Restore tty modes and let the OS cleanup the rest! */
+    if (cursed)
+        endwin();
+    profile_report(stderr);
+    exit(0);
+}
+
+/* Ctrl-C stops a running search and keeps what is loaded, otherwise quits. */
+static void interrupt(int sig)
+{
+    struct view *view = display[current_view];
+
+    if (view && view->search) {
+        cancel_requested = 1;
+        return;
+    }
+
+    quit(sig);
+}
+
+static void __NORETURN die(const char *err, ...)
+{
+    va_list args;
+
+    endwin();
+
+    va_start(args, err);
+    fputs("xxx: ", stderr);
+    vfprintf(stderr, err, args);
+    fputs("\n", stderr);
+    va_end(args);
+
+    exit(1);
+}
+
+static bool begin_update(struct view *view)
+{
+    unsigned long i;
+
+    if (view->search)
+        end_update(view);
+
+    clock_gettime(CLOCK_REALTIME, &view->loaded);
+    replace_forget();
+    if (view == VIEW(REQ_VIEW_MAIN)) {
+        sort_forget();
+        runs_forget();
+    }
+    view->search = search_external(&opt_query);
+    if (!view->search && !opt_no_daemon)
+        view->search = search_connect(&opt_query, LINES);
+    if (!view->search)
+        view->search = search_start(&opt_query, LINES);
+    if (!view->search)
+        return false;
+
+    for (i = 0; i < view->lines; i++)
+        if (view == VIEW(REQ_VIEW_MAIN))
+            fileinfo_free(view->line[i]);
+        else
+            free(view->line[i]);
+    free(view->line);
+
+    view->offset = 0;
+    view->lineno = 0;
+    view->line = NULL;
+    view->lines = view->line_alloc = 0;
+
+    return TRUE;
+}
+
+static void end_update(struct view *view)
+{
+    search_free(view->search);
+    view->search = NULL;
+}
+
+static inline int get_line_attr(enum line_type type)
+{
+    assert(type < ARRAY_SIZE(line_info));
+    return COLOR_PAIR(type) | line_info[type].attr;
+}
+
+static void init_colors(void)
+{
+    int default_bg = COLOR_BLACK;
+    int default_fg = COLOR_WHITE;
+    enum line_type type;
+
+    start_color();
+
+    if (use_default_colors() != ERR) {
+        default_bg = -1;
+        default_fg = -1;
+    }
+
+    for (type = 0; type < ARRAY_SIZE(line_info); type++) {
+        struct line_info *info = &line_info[type];
+        int bg = info->bg == COLOR_DEFAULT ? default_bg : info->bg;
+        int fg = info->fg == COLOR_DEFAULT ? default_fg : info->fg;
+
+        init_pair(type, fg, bg);
+    }
+}
+
+static void init(void)
+{
+    int x, y;
+
+    /* Initialize the curses library */
+    if (isatty(STDIN_FILENO)) {
+        cursed = !!initscr();
+    } else {
+    /* Leave stdin and stdout alone when acting as a pager. */
+        FILE *io = fopen("/dev/tty", "r+");
+
+        cursed = !!newterm(NULL, io, io);
+    }
+
+    if (!cursed)
+        die("Failed to initialize curses");
+
+    nonl();         /* tell curses not to do NL->CR/NL on output */
+    cbreak();       /* take input chars one at a time, no wait for \n */
+    noecho();       /* don't echo input */
+    leaveok(stdscr, TRUE);
+
+    if (has_colors())
+    {
+        init_colors();
+    }
+
+    getmaxyx(stdscr, y, x);
+
+    status_win = newwin(1, 0, y - 1, 0);
+    if (!status_win)
+        die("failed to create status window");
+
+    keypad(status_win, TRUE);
+    wbkgdset(status_win, get_line_attr(LINE_STATUS));
+
+}
+
+static void update_title_win(struct view *view)
+{
+    size_t len;
+    if (view == display[current_view])
+        wbkgdset(view->title, get_line_attr(LINE_TITLE_FOCUS));
+
+    werase(view->title);
+    wmove(view->title, 0, 0);
+    wprintw(view->title, "[RPathN]");
+    wmove(view->title, 0, 9);
+    waddstr(view->title, view->file);
+    len = strlen(view->file);
+    wmove(view->title, 0, len + 13);
+
+    if (view->lines) {
+        wprintw(view->title, "line %d of %d (%d%%)",
+            view->lineno + 1,
+            view->lines,
+            (view->lineno + 1) * 100 / view->lines);
+    }
+
+    wclrtoeol(view->title);
+    wrefresh(view->title);
+}
+
+static void resize_display(void)
+{
+    struct view *base = display[0];
+
+    /* Setup window dimensions */
+
+    getmaxyx(stdscr, base->height, base->width);
+
+    base->height -= 1; // space for status window
+
+    base->height -= 1; // space for title bar
+
+    if (!base->win) {
+        base->win = newwin(base->height + 1, 0, 0, 0);
+        if (!base->win)
+            die("Failed to create %s view", base->name);
+
+        scrollok(base->win, TRUE);
+
+        base->title = newwin(1, 0, base->height, 0);
+        if (!base->title)
+            die("Failed to create title window");
+
+    } else {
+        wresize(base->win, base->height + 1, base->width);
+        mvwin(base->win, 0, 0);
+        wrefresh(base->win);
+        wresize(base->title, 1, base->width);
+        mvwin(base->title, base->height, 0);
+        wrefresh(base->title);
+    }
+}
+
+static void redraw_display(bool clear)
+{
+    struct view *view;
+    view = display[0];
+
+    if (clear)
+        wclear(view->win);
+    redraw_view(view);
+    update_title_win(view);
+}
+
+static int update_view(struct view *view)
+{
+    struct fileinfo **results;
+    struct profile_stamp stamp = { 0 };
+    size_t i = 0, count;
+    int redraw_from = -1;
+    bool done;
+
+    if (!view->search)
+        return TRUE;
+
+    profile_start(&stamp);
+    results = search_collect(view->search, &count, &done);
+
+    if (count) {
+        /* Only redraw if lines are visible. */
+        if (view->offset + view->height >= view->lines)
+            redraw_from = view->lines - view->offset;
+
+        if (!view_grow(view, count))
+            goto alloc_error;
+
+        for (; i < count; i++)
+            if (!view->read(view, results[i]))
+                goto alloc_error;
+
+        free(results);
+    }
+
+    profile_end(PROFILE_COLLECT, &stamp);
+    profile_start(&stamp);
+
+    if (redraw_from >= 0) {
+        /* If this is an incremental update, redraw the previous line
+         * since for commits some members could have changed when
+         * loading the main view. */
+        if (redraw_from > 0)
+            redraw_from--;
+
+        /* Incrementally draw avoids flickering. */
+        redraw_view_from(view, redraw_from);
+    }
+
+    update_title_win(view);
+    profile_end(PROFILE_PAINT, &stamp);
+
+    if (done) {
+        if (*view->search->error)
+            report("%s", view->search->error);
+        else if (view->search->limited)
+            report("load %lu lines, stopped at --max-results", view->lines);
+        else if (view->search->cancelled)
+            report("search cancelled, kept %lu lines", view->lines);
+        else
+            report("load %lu lines", view->lines);
+
+        /* Let the view finish what it has loaded, then show it whole. */
+        profile_start(&stamp);
+        view->read(view, NULL);
+        profile_end(PROFILE_COLLECT, &stamp);
+        profile_start(&stamp);
+        redraw_view(view);
+        profile_end(PROFILE_PAINT, &stamp);
+        goto end;
+    }
+
+    return TRUE;
+
+alloc_error:
+    for (; i < count; i++)
+        fileinfo_free(results[i]);
+    free(results);
+    printw("Allocation failure");
+
+end:
+    end_update(view);
+    return FALSE;
+}
+
+/* Make room for n more lines. */
+static bool view_grow(struct view *view, size_t n)
+{
+    unsigned long alloc;
+    void **tmp;
+
+    if (view->lines + n <= view->line_alloc)
+        return TRUE;
+
+    alloc = view->line_alloc * 2 + n;
+    tmp = realloc(view->line, alloc * sizeof(*view->line));
+    if (!tmp)
+        return false;
+
+    view->line = tmp;
+    view->line_alloc = alloc;
+    return TRUE;
+}
+
+static void redraw_view_from(struct view *view, int lineno)
+{
+    assert(0 <= lineno && lineno < view->height);
+
+    for (; lineno < view->height; lineno++) {
+        view->render(view, lineno);
+    }
+
+    redrawwin(view->win);
+    wrefresh(view->win);
+}
+
+static void redraw_view(struct view *view)
+{
+    wclear(view->win);
+    redraw_view_from(view, 0);
+}
+
+static int length;
+
+static int strlength(const char *term)
+{
+    int i = 0;
+    const char *c = term;
+    while (*c != '\0') {
+        if (*c == '\t')
+            i += opt_tab_size;
+        else
+            i++;
+        c++;
+    }
+    length = i;
+    return length;
+}
+
+/* when a file name containing blankspace, vim will consider
+ * it as more than one file, in order to fix this problem,
+ * so the function below renames the filename using '\ '
+ * to instead of ' ', then vim can read the file.
+ */
+static char *blankspace(const char *fname)
+{
+    const char *tmp = fname;
+    int i, j;
+    static char localname[512];
+    int len = strlen(tmp);
+
+    memset(localname, 0, sizeof(localname));
+    for (i = 0, j = 0; j < len; tmp++, j++)
+    {
+        if (isspace(*tmp))
+        {
+            localname[i++] = '\\';
+            localname[i++] = *tmp;
+            continue;
+        }
+        localname[i++] = *tmp;
+    }
+    localname[i] = '\0';
+    return localname;
+}
+
+static inline size_t
+string_expand(char *dst, size_t dstlen, const char *src, int tabsize)
+{
+    size_t size, pos;
+
+    for (size = pos = 0; size < dstlen - 1 && src[pos]; pos++) {
+        if (src[pos] == '\t') {
+            size_t expanded = tabsize - (size % tabsize);
+
+            if (expanded + size >= dstlen - 1)
+                expanded = dstlen - size - 1;
+            memcpy(dst + size, "        ", expanded);
+            size += expanded;
+        } else {
+            dst[size++] = src[pos];
+        }
+    }
+
+    dst[size] = 0;
+    return pos;
+}
+
+/* The path on the command line a result was found under. */
+static int path_index(const struct search_query *query, const char *name)
+{
+    size_t len, best = 0;
+    int i, index = 0;
+
+    for (i = 0; i < query->npaths; i++) {
+        len = strlen(query->paths[i]);
+        if (!strcmp(query->paths[i], ".") && !best)
+            index = i;
+        else if (len > best && !strncmp(name, query->paths[i], len) &&
+                 (name[len] == '/' || !name[len] || query->paths[i][len - 1] == '/'))
+            index = i, best = len;
+    }
+
+    return index;
+}
+
+/* The walkers take turns, so lines from different paths arrive
+ * interleaved; once loaded, group them by path in command line order.
+ * Copies listed under a record move with it. */
+static bool group_by_path(struct view *view)
+{
+    size_t count[SEARCH_PATHS + 1] = { 0 };
+    struct fileinfo **line, *fileinfo;
+    unsigned char *index;
+    size_t i;
+    int from = 0;
+
+    if (opt_query.npaths < 2 || view->lines < 2)
+        return TRUE;
+
+    line = malloc(view->lines * sizeof(*line));
+    index = malloc(view->lines);
+    if (!line || !index) {
+        free(line);
+        free(index);
+        return false;
+    }
+
+    for (i = 0; i < view->lines; i++) {
+        fileinfo = view->line[i];
+        if (!fileinfo->copy)
+            from = path_index(&opt_query, fileinfo->name);
+        index[i] = from;
+        count[from + 1]++;
+    }
+    for (i = 1; i <= SEARCH_PATHS; i++)
+        count[i] += count[i - 1];
+    for (i = 0; i < view->lines; i++)
+        line[count[index[i]]++] = view->line[i];
+
+    memcpy(view->line, line, view->lines * sizeof(*line));
+    free(line);
+    free(index);
+    runs_invalidate();
+    return TRUE;
+}
+
+static bool default_read(struct view *view, struct fileinfo *fileinfo)
+{
+    if (!fileinfo)
+        return group_by_path(view);
+    view->line[view->lines] = fileinfo;
+    runs_add(view, view->lines++);
+    return TRUE;
+}
+
+static bool default_render(struct view *view, unsigned int lineno)
+{
+    struct fileinfo *fileinfo;
+    enum line_type type;
+    int col = 0;
+    size_t namelen, ncopies;
+    char *fname, *fnumber;
+    int opt_file_name = 25;
+    char text[SIZEOF_STR];
+
+    if (view->offset + lineno >= view->lines)
+        return false;
+
+    fileinfo = view->line[view->offset + lineno];
+    if (!*fileinfo->name)
+        return false;
+
+    fnumber = fileinfo->number;
+    fname = blankspace(fileinfo->name);
+    wmove(view->win, lineno, col);
+
+    if (view->offset + lineno == view->lineno) {
+        snprintf(vim_cmd, sizeof(vim_cmd), VIM_CMD, fnumber, fname);
+        type = LINE_CURSOR;
+        wattrset(view->win, get_line_attr(type));
+        wchgat(view->win, -1, 0, type, NULL);
+        string_copy(view->file, fileinfo->name);
+
+    } else {
+        type = LINE_FILE_LINCON;
+        wchgat(view->win, -1, 0, type, NULL);
+        wattrset(view->win, get_line_attr(LINE_FILE_NAME));
+    }
+
+    namelen = strlen(fileinfo->name);
+    if (namelen > opt_file_name){
+        int n = namelen-opt_file_name;
+        if (type != LINE_CURSOR)
+            wattrset(view->win, get_line_attr(LINE_DELIMITER));
+        waddch(view->win, '~');
+        if (type != LINE_CURSOR)
+            wattrset(view->win, get_line_attr(LINE_FILE_NAME));
+        waddnstr(view->win, fileinfo->name + n, opt_file_name);
+    }
+    else
+        waddstr(view->win, fileinfo->name);
+
+    col += opt_file_name + 2;
+    wmove(view->win, lineno, col);
+    if (type != LINE_CURSOR)
+        wattrset(view->win, get_line_attr(LINE_FILE_LINUM));
+
+    waddstr(view->win, fileinfo->number);
+
+    col += 9;
+    if (type != LINE_CURSOR)
+        wattrset(view->win, A_NORMAL);
+
+    wmove(view->win, lineno, col);
+
+    /* With --dedup, the identical files a record stands for. */
+    if (fileinfo->copy || (ncopies = dup_group_copies(fileinfo->dup))) {
+        char mark[32];
+
+        if (fileinfo->copy)
+            string_copy(mark, "= ");
+        else
+            snprintf(mark, sizeof(mark), "+%zu ", ncopies);
+        if (type != LINE_CURSOR)
+            wattrset(view->win, get_line_attr(LINE_DELIMITER));
+        waddstr(view->win, mark);
+        col += strlen(mark);
+    }
+
+    if (type != LINE_CURSOR)
+        wattrset(view->win, get_line_attr(type));
+
+    int contentlen = strlength(fileinfo->content);
+    string_expand(text, sizeof(text), fileinfo->content, opt_tab_size);
+
+    if (col + contentlen > view->width){
+        contentlen = view->width - col;
+        if (contentlen < 0)
+            return TRUE;
+        else {
+            waddnstr(view->win, text, contentlen-1);
+            if (type != LINE_CURSOR)
+                wattrset(view->win, get_line_attr(LINE_DELIMITER));
+            waddch(view->win, '~');
+        }
+    }
+    else {
+        waddstr(view->win, fileinfo->content);
+    }
+    report("");
+
+    return TRUE;
+}
+
+/*
+ * Counts view
+ *
+ * Shows how many lines match in each file and directory. The search
+ * runs in count mode, so it sends one record per matching file and the
+ * view keeps one entry per file and per directory, never the lines.
+ * Directories end with a slash, which makes sorting by name put each
+ * directory just above its contents.
+ */
+
+#define COUNTS_BAR      20      /* Width of the histogram bars. */
+#define COUNTS_HASH     16384
+
+struct count_entry {
+    struct count_entry *next;   /* Directories hashed by name. */
+    unsigned long count;
+    unsigned long files;
+    char path[1];
+};
+
+static struct {
+    struct count_entry *dirs[COUNTS_HASH];
+    unsigned long max_file, max_dir;
+} counts;
+
+static struct count_entry *count_entry_new(struct view *view, const char *path)
+{
+    size_t len = strlen(path);
+    struct count_entry *entry;
+
+    if (!view_grow(view, 1) || !(entry = calloc(1, sizeof(*entry) + len)))
+        return NULL;
+
+    memcpy(entry->path, path, len + 1);
+    view->line[view->lines++] = entry;
+    return entry;
+}
+
+/* Find or add the entry of the directory path[0..len), slash included. */
+static struct count_entry *counts_dir(struct view *view, const char *path, size_t len)
+{
+    struct count_entry *entry;
+    char name[PATH_MAX];
+    size_t bucket;
+
+    string_ncopy(name, path, len + 1 < sizeof(name) ? len + 1 : sizeof(name));
+    bucket = dir_cache_hash(name) % COUNTS_HASH;
+
+    for (entry = counts.dirs[bucket]; entry; entry = entry->next)
+        if (!strcmp(entry->path, name))
+            return entry;
+
+    entry = count_entry_new(view, name);
+    if (entry) {
+        entry->next = counts.dirs[bucket];
+        counts.dirs[bucket] = entry;
+    }
+    return entry;
+}
+
+static int counts_compare(const void *a, const void *b)
+{
+    const struct count_entry *entry1 = *(const struct count_entry **) a;
+    const struct count_entry *entry2 = *(const struct count_entry **) b;
+
+    return strcmp(entry1->path, entry2->path);
+}
+
+static bool counts_read(struct view *view, struct fileinfo *fileinfo)
+{
+    struct count_entry *entry;
+    const char *slash;
+
+    if (!fileinfo) {
+        qsort(view->line, view->lines, sizeof(*view->line), counts_compare);
+        return TRUE;
+    }
+
+    /* A new search, the old entries have been freed. */
+    if (!view->lines)
+        memset(&counts, 0, sizeof(counts));
+
+    for (slash = fileinfo->name; (slash = strchr(slash, '/')); slash++) {
+        entry = counts_dir(view, fileinfo->name, slash + 1 - fileinfo->name);
+        if (!entry)
+            return false;
+        entry->count += fileinfo->lineno;
+        entry->files++;
+        if (entry->count > counts.max_dir)
+            counts.max_dir = entry->count;
+    }
+
+    entry = count_entry_new(view, fileinfo->name);
+    if (!entry)
+        return false;
+    entry->count = fileinfo->lineno;
+    entry->files = 1;
+    if (entry->count > counts.max_file)
+        counts.max_file = entry->count;
+
+    free(fileinfo);
+    return TRUE;
+}
+
+static bool counts_render(struct view *view, unsigned int lineno)
+{
+    struct count_entry *entry;
+    enum line_type type;
+    unsigned long max;
+    char text[SIZEOF_STR];
+    size_t len;
+    bool dir;
+    int bar;
+
+    if (view->offset + lineno >= view->lines)
+        return false;
+
+    entry = view->line[view->offset + lineno];
+    len = strlen(entry->path);
+    dir = entry->path[len - 1] == '/';
+    max = dir ? counts.max_dir : counts.max_file;
+    bar = max ? (entry->count * COUNTS_BAR + max - 1) / max : 0;
+    if (bar > COUNTS_BAR)
+        bar = COUNTS_BAR;
+
+    wmove(view->win, lineno, 0);
+
+    if (view->offset + lineno == view->lineno) {
+        type = LINE_CURSOR;
+        wattrset(view->win, get_line_attr(type));
+        wchgat(view->win, -1, 0, type, NULL);
+        string_copy(view->file, entry->path);
+        if (dir)
+            *vim_cmd = 0;
+        else
+            snprintf(vim_cmd, sizeof(vim_cmd), VIM_CMD, "1", blankspace(entry->path));
+    } else {
+        type = LINE_FILE_LINCON;
+        wchgat(view->win, -1, 0, type, NULL);
+        wattrset(view->win, get_line_attr(LINE_FILE_LINUM));
+    }
+
+    wprintw(view->win, "%8lu ", entry->count);
+
+    if (type != LINE_CURSOR)
+        wattrset(view->win, get_line_attr(LINE_DELIMITER));
+    memset(text, '#', bar);
+    memset(text + bar, ' ', COUNTS_BAR - bar);
+    text[COUNTS_BAR] = 0;
+    waddstr(view->win, text);
+
+    if (type != LINE_CURSOR)
+        wattrset(view->win, get_line_attr(dir ? LINE_FILE_NAME : type));
+    if (dir)
+        snprintf(text, sizeof(text), "  %s (%lu file%s)", entry->path, entry->files,
+                 entry->files == 1 ? "" : "s");
+    else
+        snprintf(text, sizeof(text), "  %s", entry->path);
+    if (view->width > COUNTS_BAR + 10)
+        waddnstr(view->win, text, view->width - COUNTS_BAR - 10);
+    wclrtoeol(view->win);
+
+    return TRUE;
+}
+
+/*
+ * Files view
+ *
+ * Finds files by name. The walk runs once in list mode and its paths are
+ * kept for the session; every key typed then scores the whole list with
+ * a fuzzy subsequence match. Each path also keeps a bitmask of the
+ * characters in it, so most paths are rejected by a single AND before
+ * any scoring. Matchers score slices of the list in parallel and keep
+ * only their best FILES_TOP, which are merged for the view.
+ */
+
+#define FILES_TOP       1000    /* Matches shown. */
+#define FILES_SLICE     16384   /* Paths per scoring thread at least. */
+#define FILES_QUERY     64
+
+struct file_match {
+    int score;
+    size_t index;
+};
+
+static struct {
+    char **paths;
+    unsigned long long *masks;
+    size_t npaths, alloc;
+    bool loaded;
+    char query[FILES_QUERY];
+    unsigned long matched;
+} files;
+
+static unsigned long long files_mask(const char *str)
+{
+    unsigned long long mask = 0;
+
+    for (; *str; str++) {
+        int c = tolower((unsigned char) *str);
+
+        if (c >= 'a' && c <= 'z')
+            mask |= 1ULL << (c - 'a');
+        else if (c >= '0' && c <= '9')
+            mask |= 1ULL << (c - '0' + 26);
+        else
+            mask |= 1ULL << (36 + c % 28);
+    }
+
+    return mask;
+}
+
+/* Match the query as a subsequence of path[from..], case-insensitively.
+ * Matches at the start of a word and right after the previous match
+ * score more, gaps score less. Returns -1 when it does not match. */
+static int files_match(const char *path, size_t from, const char *query, int *pos)
+{
+    size_t i = from, last = 0;
+    int score = 0, n;
+
+    for (n = 0; query[n]; n++, i++) {
+        while (path[i] && tolower((unsigned char) path[i]) != query[n])
+            i++;
+        if (!path[i])
+            return -1;
+
+        score += 16;
+        if (!i || strchr("/_-. ", path[i - 1]) ||
+            (islower((unsigned char) path[i - 1]) && isupper((unsigned char) path[i])))
+            score += 8;
+        if (n && last + 1 == i)
+            score += 8;
+        else if (n)
+            score -= i - last - 1 < 4 ? i - last - 1 : 4;
+
+        if (pos)
+            pos[n] = i;
+        last = i;
+    }
+
+    return score;
+}
+
+/* Prefer a match in the base name, then shorter paths. */
+static int files_score(const char *path, const char *query, int *pos)
+{
+    const char *base = strrchr(path, '/');
+    int score = -1;
+
+    if (base)
+        score = files_match(path, base + 1 - path, query, pos);
+    if (score >= 0)
+        score += 32;
+    else
+        score = files_match(path, 0, query, pos);
+
+    return score < 0 ? -1 : score * 256 - (int) strlen(path);
+}
+
+static inline bool files_before(const struct file_match *a, const struct file_match *b)
+{
+    return a->score > b->score || (a->score == b->score && a->index < b->index);
+}
+
+struct files_slice {
+    pthread_t thread;
+    bool threaded;
+    size_t start, end;
+    unsigned long long mask;
+    struct file_match top[FILES_TOP];   /* A heap with the worst on top. */
+    size_t ntop;
+    unsigned long matched;
+};
+
+static void files_slice_add(struct files_slice *slice, int score, size_t index)
+{
+    struct file_match match = { score, index };
+    size_t pos, child;
+
+    if (slice->ntop == FILES_TOP) {
+        if (!files_before(&match, &slice->top[0]))
+            return;
+        /* Replace the worst and sift it down. */
+        for (pos = 0; (child = pos * 2 + 1) < FILES_TOP; pos = child) {
+            if (child + 1 < FILES_TOP && files_before(&slice->top[child], &slice->top[child + 1]))
+                child++;
+            if (!files_before(&match, &slice->top[child]))
+                break;
+            slice->top[pos] = slice->top[child];
+        }
+        slice->top[pos] = match;
+        return;
+    }
+
+    for (pos = slice->ntop++; pos; pos = (pos - 1) / 2) {
+        if (!files_before(&slice->top[(pos - 1) / 2], &match))
+            break;
+        slice->top[pos] = slice->top[(pos - 1) / 2];
+    }
+    slice->top[pos] = match;
+}
+
+static void files_slice_score(struct files_slice *slice, size_t i)
+{
+    int score;
+
+    if ((files.masks[i] & slice->mask) != slice->mask)
+        return;
+    score = files_score(files.paths[i], files.query, NULL);
+    if (score < 0)
+        return;
+    slice->matched++;
+    files_slice_add(slice, score, i);
+}
+
+static void *files_slice_worker(void *data)
+{
+    struct files_slice *slice = data;
+    size_t i = slice->start;
+
+#ifdef __SSE2__
+    /* Test two masks at a time and only score paths having every
+     * character of the query. */
+    __m128i want = _mm_set1_epi64x(slice->mask);
+
+    for (; i + 2 <= slice->end; i += 2) {
+        __m128i masks = _mm_loadu_si128((const __m128i *) (files.masks + i));
+        int hit = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(masks, want), want));
+
+        if ((hit & 0x00ff) == 0x00ff)
+            files_slice_score(slice, i);
+        if ((hit & 0xff00) == 0xff00)
+            files_slice_score(slice, i + 1);
+    }
+#endif
+    for (; i < slice->end; i++)
+        files_slice_score(slice, i);
+
+    return NULL;
+}
+
+static int files_compare(const void *a, const void *b)
+{
+    return files_before(a, b) ? -1 : files_before(b, a);
+}
+
+/* Score every path against the query and show the best ones. */
+static void files_filter(struct view *view)
+{
+    struct files_slice *slices;
+    struct file_match *all;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nslices, i, j, n = 0;
+
+    for (i = 0; i < view->lines; i++)
+        free(view->line[i]);
+    view->lines = view->offset = view->lineno = 0;
+
+    nslices = files.npaths / FILES_SLICE + 1;
+    if (ncpu < 1)
+        ncpu = 1;
+    if (nslices > ncpu)
+        nslices = ncpu;
+
+    slices = calloc(nslices, sizeof(*slices));
+    all = malloc(nslices * FILES_TOP * sizeof(*all));
+    if (!slices || !all) {
+        free(slices);
+        free(all);
+        report("Allocation failure");
+        return;
+    }
+
+    for (i = 0; i < nslices; i++) {
+        slices[i].start = files.npaths * i / nslices;
+        slices[i].end = files.npaths * (i + 1) / nslices;
+        slices[i].mask = files_mask(files.query);
+    }
+
+    /* The first slice is scored here, and any thread that cannot be
+     * created leaves its slice to be scored here too. */
+    for (i = 1; i < nslices; i++)
+        slices[i].threaded = !pthread_create(&slices[i].thread, NULL,
+                                             files_slice_worker, &slices[i]);
+    files_slice_worker(&slices[0]);
+
+    files.matched = 0;
+    for (i = 0; i < nslices; i++) {
+        if (slices[i].threaded)
+            pthread_join(slices[i].thread, NULL);
+        else if (i)
+            files_slice_worker(&slices[i]);
+        files.matched += slices[i].matched;
+        for (j = 0; j < slices[i].ntop; j++)
+            all[n++] = slices[i].top[j];
+    }
+
+    qsort(all, n, sizeof(*all), files_compare);
+    if (n > FILES_TOP)
+        n = FILES_TOP;
+
+    for (i = 0; i < n && view_grow(view, 1); i++) {
+        struct file_match *match = malloc(sizeof(*match));
+
+        if (!match)
+            break;
+        *match = all[i];
+        view->line[view->lines++] = match;
+    }
+
+    free(all);
+    free(slices);
+
+    redraw_view(view);
+    report("file: %s  (%lu of %lu)", files.query, files.matched, (unsigned long) files.npaths);
+}
+
+/* Keys typed in the files view edit the query instead of moving. */
+static bool files_key(int key)
+{
+    return (key < 128 && isprint(key)) || key == KEY_BACKSPACE || key == 127 ||
+           key == 8 || key == 21;
+}
+
+static void files_input(struct view *view, int key)
+{
+    size_t len = strlen(files.query);
+
+    if (key == KEY_BACKSPACE || key == 127 || key == 8) {
+        if (!len)
+            return;
+        files.query[len - 1] = 0;
+    } else if (key == 21) {
+        /* Ctrl-U clears the query. */
+        *files.query = 0;
+    } else if (len + 1 < sizeof(files.query)) {
+        files.query[len] = tolower(key);
+        files.query[len + 1] = 0;
+    }
+
+    files_filter(view);
+}
+
+static bool files_read(struct view *view, struct fileinfo *fileinfo)
+{
+    char *path;
+
+    if (!fileinfo) {
+        files.loaded = TRUE;
+        files_filter(view);
+        return TRUE;
+    }
+
+    if (files.npaths == files.alloc) {
+        size_t alloc = files.alloc * 2 + 1024;
+        char **paths = realloc(files.paths, alloc * sizeof(*paths));
+        unsigned long long *masks;
+
+        if (!paths)
+            return false;
+        files.paths = paths;
+        masks = realloc(files.masks, alloc * sizeof(*masks));
+        if (!masks)
+            return false;
+        files.masks = masks;
+        files.alloc = alloc;
+    }
+
+    path = strdup(fileinfo->name);
+    if (!path)
+        return false;
+
+    files.masks[files.npaths] = files_mask(path);
+    files.paths[files.npaths++] = path;
+    free(fileinfo);
+    return TRUE;
+}
+
+static bool files_render(struct view *view, unsigned int lineno)
+{
+    struct file_match *match;
+    const char *path;
+    int pos[FILES_QUERY];
+    size_t i, len, start = 0, n = 0, qlen = strlen(files.query);
+    bool cursor;
+
+    if (view->offset + lineno >= view->lines)
+        return false;
+
+    match = view->line[view->offset + lineno];
+    path = files.paths[match->index];
+    len = strlen(path);
+    cursor = view->offset + lineno == view->lineno;
+
+    if (files_score(path, files.query, pos) < 0)
+        *pos = -1;
+
+    wmove(view->win, lineno, 0);
+    if (cursor) {
+        wattrset(view->win, get_line_attr(LINE_CURSOR));
+        wchgat(view->win, -1, 0, LINE_CURSOR, NULL);
+        string_copy(view->file, path);
+        snprintf(vim_cmd, sizeof(vim_cmd), VIM_CMD, "1", blankspace(path));
+    } else {
+        wchgat(view->win, -1, 0, LINE_FILE_LINCON, NULL);
+        wattrset(view->win, get_line_attr(LINE_FILE_NAME));
+    }
+
+    if (view->width > 2 && len > view->width - 1) {
+        start = len - (view->width - 2);
+        waddch(view->win, '~');
+    }
+
+    for (i = 0; i < len; i++) {
+        bool hit = *pos >= 0 && n < qlen && pos[n] == (int) i;
+
+        if (hit)
+            n++;
+        if (i < start)
+            continue;
+        if (!cursor)
+            wattrset(view->win, get_line_attr(hit ? LINE_DELIMITER : LINE_FILE_NAME));
+        waddch(view->win, (unsigned char) path[i]);
+    }
+    wclrtoeol(view->win);
+
+    return TRUE;
+}
+
+/* Open a view, searching only the given file unless it is empty. */
+static void open_view(struct view *prev, struct view *view, const char *file)
+{
+    if (view == prev && !strcmp(opt_query.file, file)) {
+        report("Already in %s view", view->name);
+        return;
+    }
+
+    /* The query is shared with the running search. */
+    if (prev && prev->search)
+        end_update(prev);
+    opt_query.count = view == VIEW(REQ_VIEW_COUNTS);
+    opt_query.list = view == VIEW(REQ_VIEW_FILES);
+    string_copy(opt_query.file, file);
+
+    /* The file list is walked once and kept. */
+    if (opt_query.list && files.loaded) {
+        memset(display, 0, sizeof(display));
+        current_view = 0;
+        display[current_view] = view;
+        resize_display();
+        files_filter(view);
+        return;
+    }
+
+    if (!begin_update(view)) {
+        report("Failed to load %s view", view->name);
+        return;
+    }
+
+    /* Maximize the current view. */
+    memset(display, 0, sizeof(display));
+    current_view = 0;
+    display[current_view] = view;
+
+    resize_display();
+
+    if (view->search) {
+        /* Clear the old view and let the incremental updating refill
+         * the screen. */
+        wclear(view->win);
+        report("Loading...");
+    }
+}
+
+/* List the copies of the selected record below it, or take them away. */
+static void main_expand(struct view *view)
+{
+    struct fileinfo *fileinfo = view->line[view->lineno];
+    struct fileinfo **copies;
+    size_t at = view->lineno + 1, i, n;
+
+    if (fileinfo->expanded) {
+        n = fileinfo->expanded;
+        for (i = 0; i < n; i++)
+            fileinfo_free(view->line[at + i]);
+        memmove(view->line + at, view->line + at + n,
+                (view->lines - at - n) * sizeof(*view->line));
+        view->lines -= n;
+        fileinfo->expanded = 0;
+        runs_invalidate();
+        redraw_view(view);
+        return;
+    }
+
+    n = dup_group_copies(fileinfo->dup);
+    if (!n) {
+        report("No identical copies of %s", fileinfo->name);
+        return;
+    }
+
+    copies = calloc(n, sizeof(*copies));
+    if (!copies || !view_grow(view, n)) {
+        free(copies);
+        report("Allocation failure");
+        return;
+    }
+
+    /* More copies may be added meanwhile, only n are listed. */
+    pthread_mutex_lock(&dup_lock);
+    for (i = 0; i < n; i++) {
+        if (!(copies[i] = malloc(sizeof(*copies[i]))))
+            break;
+        *copies[i] = *fileinfo;
+        copies[i]->dup = NULL;
+        copies[i]->expanded = 0;
+        copies[i]->copy = TRUE;
+        string_copy(copies[i]->name, fileinfo->dup->copies[i]);
+    }
+    pthread_mutex_unlock(&dup_lock);
+
+    if (i < n) {
+        while (i--)
+            free(copies[i]);
+        free(copies);
+        report("Allocation failure");
+        return;
+    }
+
+    memmove(view->line + at + n, view->line + at, (view->lines - at) * sizeof(*view->line));
+    memcpy(view->line + at, copies, n * sizeof(*copies));
+    view->lines += n;
+    fileinfo->expanded = n;
+    free(copies);
+    runs_invalidate();
+    redraw_view(view);
+    report("%zu identical copies of %s", n, fileinfo->name);
+}
+
+/*
+ * Replace
+ *
+ * Rewrites the lines of the main view with a substitution, like sed's
+ * "s/PATTERN/TEXT/g" run on each result line only. The lines are grouped
+ * by file and worker threads rewrite the files in parallel, each through
+ * a temporary file renamed over the original. A file modified since the
+ * search started, or whose line no longer matches, is left alone.
+ */
+
+#define REPLACE_WORKERS     16
+
+struct replace_edit {
+    const char *name;
+    unsigned long lineno;
+    struct fileinfo *fileinfo; /* The record to update, none for copies. */
+    size_t offset;              /* Of the new line in the rewritten file. */
+};
+
+struct replace_file {
+    struct replace_edit *edits; /* Sorted by line. */
+    size_t nedits;
+    enum {
+        REPLACE_DONE,
+        REPLACE_STALE,
+        REPLACE_FAILED,
+    } result;
+    struct stat written;        /* The file put in place. */
+};
+
+/* The files rewritten since the search, so they are not taken for
+ * modified by someone else. Sorted, see replace_ours(). */
+struct replace_stamp {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+};
+
+static struct replace_stamp *replace_stamps;
+static size_t replace_nstamps;
+
+struct replace {
+    const regex_t *regex;
+    bool word;
+    const char *text;
+    struct timespec since;      /* Files modified later are stale. */
+    struct replace_file *files;
+    size_t nfiles;
+    size_t next;                /* The next file a worker takes. */
+    unsigned long lines;        /* Lines changed, updated atomically. */
+};
+
+struct replace_buf {
+    char *data;
+    size_t len, alloc;
+};
+
+static bool replace_append(struct replace_buf *buf, const char *data, size_t len)
+{
+    if (buf->len + len > buf->alloc) {
+        size_t alloc = buf->alloc * 2 + len;
+        char *tmp = realloc(buf->data, alloc);
+
+        if (!tmp)
+            return false;
+        buf->data = tmp;
+        buf->alloc = alloc;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return TRUE;
+}
+
+/* Append the replacement text for one match: "&" is the match and "\1"
+ * to "\9" its groups, a backslash takes the next character as is. */
+static bool
+replace_expand(struct replace_buf *buf, const char *text, const char *line, const regmatch_t *match)
+{
+    for (; *text; text++) {
+        int group = -1;
+
+        if (*text == '&')
+            group = 0;
+        else if (*text == '\\' && text[1] >= '1' && text[1] <= '9')
+            group = *++text - '0';
+        else if (*text == '\\' && text[1])
+            text++;
+
+        if (group < 0) {
+            if (!replace_append(buf, text, 1))
+                return false;
+        } else if (match[group].rm_so >= 0 &&
+                   !replace_append(buf, line + match[group].rm_so,
+                                   match[group].rm_eo - match[group].rm_so)) {
+            return false;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Substitute every match in [line, line + len), which has no newline.
+ * Returns the matches replaced, 0 if the line no longer matches. */
+static int
+replace_line(struct replace *replace, struct replace_buf *buf, const char *line, size_t len)
+{
+    regmatch_t match[10];
+    size_t pos = 0;
+    int n = 0;
+
+    while (pos <= len) {
+        match[0].rm_so = pos;
+        match[0].rm_eo = len;
+        if (regexec(replace->regex, line, ARRAY_SIZE(match), match,
+                    REG_STARTEND | (pos ? REG_NOTBOL : 0)))
+            break;
+
+        /* With -w, only what the search would have matched. */
+        if (replace->word &&
+            !search_word_at(line, line + len, line + match[0].rm_so, line + match[0].rm_eo)) {
+            if (match[0].rm_so == len)
+                break;
+            if (!replace_append(buf, line + pos, match[0].rm_so + 1 - pos))
+                return -1;
+            pos = match[0].rm_so + 1;
+            continue;
+        }
+
+        if (!replace_append(buf, line + pos, match[0].rm_so - pos) ||
+            !replace_expand(buf, replace->text, line, match))
+            return -1;
+        n++;
+
+        /* After an empty match, keep the next character as it was. */
+        pos = match[0].rm_eo;
+        if (match[0].rm_so == match[0].rm_eo) {
+            if (pos < len && !replace_append(buf, line + pos, 1))
+                return -1;
+            pos++;
+        }
+    }
+
+    if (pos < len && !replace_append(buf, line + pos, len - pos))
+        return -1;
+    return n;
+}
+
+/* Read the whole file, one byte more than its size to see it end. */
+static bool replace_read(int fd, struct replace_buf *buf, off_t size)
+{
+    ssize_t n = 0;
+
+    buf->alloc = size + 1;
+    buf->data = malloc(buf->alloc);
+    if (!buf->data)
+        return false;
+
+    while (buf->len < buf->alloc &&
+           (n = read(fd, buf->data + buf->len, buf->alloc - buf->len)) > 0)
+        buf->len += n;
+
+    return n == 0 && buf->len == size;
+}
+
+/* The line still starts like the record shows it. */
+static bool replace_check(const struct fileinfo *fileinfo, const char *line, size_t len)
+{
+    size_t shown;
+
+    if (!fileinfo)
+        return TRUE;
+    while (len && isspace((unsigned char) *line)) {
+        line++;
+        len--;
+    }
+    shown = strlen(fileinfo->content);
+    return shown <= len && !memcmp(line, fileinfo->content, shown);
+}
+
+static int replace_stamp_compare(const void *a, const void *b)
+{
+    const struct replace_stamp *x = a, *y = b;
+
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+static bool replace_ours(const struct stat *st)
+{
+    struct replace_stamp key = { st->st_dev, st->st_ino }, *stamp;
+
+    stamp = bsearch(&key, replace_stamps, replace_nstamps, sizeof(key), replace_stamp_compare);
+    return stamp && stamp->mtime.tv_sec == ST_MTIM(st).tv_sec &&
+           stamp->mtime.tv_nsec == ST_MTIM(st).tv_nsec;
+}
+
+static void replace_forget(void)
+{
+    free(replace_stamps);
+    replace_stamps = NULL;
+    replace_nstamps = 0;
+}
+
+/* Remember the files just rewritten. */
+static void replace_remember(struct replace *replace)
+{
+    struct replace_stamp *stamps;
+    size_t i, n = replace_nstamps;
+
+    stamps = realloc(replace_stamps, (n + replace->nfiles) * sizeof(*stamps));
+    if (!stamps)
+        return;
+
+    for (i = 0; i < replace->nfiles; i++) {
+        struct stat *st = &replace->files[i].written;
+
+        if (replace->files[i].result == REPLACE_DONE)
+            stamps[n++] = (struct replace_stamp) { st->st_dev, st->st_ino, ST_MTIM(st) };
+    }
+    qsort(stamps, n, sizeof(*stamps), replace_stamp_compare);
+    replace_stamps = stamps;
+    replace_nstamps = n;
+}
+
+static bool replace_same(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+           a->st_size == b->st_size &&
+           ST_MTIM(a).tv_sec == ST_MTIM(b).tv_sec &&
+           ST_MTIM(a).tv_nsec == ST_MTIM(b).tv_nsec;
+}
+
+/* Rewrite one file, all of its lines or none. */
+static int replace_file(struct replace *replace, struct replace_file *file)
+{
+    struct replace_buf in = { 0 }, out = { 0 };
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+    const char *pos, *end;
+    unsigned long lineno = 1, lines = 0;
+    struct stat st, now;
+    size_t i, at;
+    int fd, result = REPLACE_FAILED;
+
+    /* Write next to the file a symlink points to, not over the link. */
+    if (!realpath(file->edits[0].name, path) ||
+        (fd = open(path, O_RDONLY)) < 0)
+        return REPLACE_FAILED;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return REPLACE_FAILED;
+    }
+
+    if ((ST_MTIM(&st).tv_sec > replace->since.tv_sec ||
+         (ST_MTIM(&st).tv_sec == replace->since.tv_sec &&
+          ST_MTIM(&st).tv_nsec >= replace->since.tv_nsec)) &&
+        !replace_ours(&st)) {
+        close(fd);
+        return REPLACE_STALE;
+    }
+
+    if (!replace_read(fd, &in, st.st_size)) {
+        close(fd);
+        free(in.data);
+        return REPLACE_STALE;
+    }
+    close(fd);
+
+    pos = in.data;
+    end = in.data + in.len;
+    result = REPLACE_STALE;
+
+    for (i = 0; i < file->nedits; i++) {
+        struct replace_edit *edit = &file->edits[i];
+        const char *eol;
+        int n;
+
+        /* The same line listed twice, say for a copy. */
+        if (i && edit->lineno == file->edits[i - 1].lineno) {
+            edit->offset = file->edits[i - 1].offset;
+            continue;
+        }
+
+        for (; lineno < edit->lineno && pos < end; lineno++) {
+            eol = memchr(pos, '\n', end - pos);
+            eol = eol ? eol + 1 : end;
+            if (!replace_append(&out, pos, eol - pos))
+                goto out;
+            pos = eol;
+        }
+        if (pos == end)
+            goto out;
+
+        eol = memchr(pos, '\n', end - pos);
+        if (!eol)
+            eol = end;
+
+        if (!replace_check(edit->fileinfo, pos, eol - pos))
+            goto out;
+
+        edit->offset = out.len;
+        n = replace_line(replace, &out, pos, eol - pos);
+        if (n < 0) {
+            result = REPLACE_FAILED;
+            goto out;
+        }
+        if (n == 0)
+            goto out;
+        lines++;
+        pos = eol;
+    }
+    if (!replace_append(&out, pos, end - pos)) {
+        result = REPLACE_FAILED;
+        goto out;
+    }
+
+    result = REPLACE_FAILED;
+    snprintf(tmp, sizeof(tmp), "%s.hg-XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0)
+        goto out;
+
+    fchmod(fd, st.st_mode & 07777);
+    if (fchown(fd, st.st_uid, st.st_gid) < 0)
+        fchmod(fd, st.st_mode & 0777);
+
+    for (at = 0; at < out.len; ) {
+        ssize_t n = write(fd, out.data + at, out.len - at);
+
+        if (n <= 0)
+            break;
+        at += n;
+    }
+
+    if (fstat(fd, &file->written) < 0)
+        at = 0;
+
+    /* Last look, in case the file was saved while we were writing. */
+    if (close(fd) < 0 || at < out.len) {
+        unlink(tmp);
+    } else if (stat(path, &now) < 0 || !replace_same(&st, &now)) {
+        unlink(tmp);
+        result = REPLACE_STALE;
+    } else if (rename(tmp, path) < 0) {
+        unlink(tmp);
+    } else {
+        result = REPLACE_DONE;
+    }
+
+    /* Show the new lines, trimmed like search_record() does. */
+    for (i = 0; result == REPLACE_DONE && i < file->nedits; i++) {
+        struct replace_edit *edit = &file->edits[i];
+        const char *line = out.data + edit->offset;
+        const char *eol = memchr(line, '\n', out.data + out.len - line);
+        size_t len = eol ? eol - line : out.data + out.len - line;
+
+        if (!edit->fileinfo)
+            continue;
+
+        while (len && isspace((unsigned char) *line)) {
+            line++;
+            len--;
+        }
+        if (len >= sizeof(edit->fileinfo->content))
+            len = sizeof(edit->fileinfo->content) - 1;
+        memcpy(edit->fileinfo->content, line, len);
+        edit->fileinfo->content[len] = '\0';
+    }
+
+    if (result == REPLACE_DONE)
+        __sync_fetch_and_add(&replace->lines, lines);
+
+out:
+    free(in.data);
+    free(out.data);
+    return result;
+}
+
+static void *replace_worker(void *data)
+{
+    struct replace *replace = data;
+    size_t i;
+
+    while ((i = __sync_fetch_and_add(&replace->next, 1)) < replace->nfiles)
+        replace->files[i].result = replace_file(replace, &replace->files[i]);
+
+    return NULL;
+}
+
+static int replace_compare(const void *a, const void *b)
+{
+    const struct replace_edit *x = a, *y = b;
+    int cmp = strcmp(x->name, y->name);
+
+    if (cmp)
+        return cmp;
+    return x->lineno < y->lineno ? -1 : x->lineno > y->lineno;
+}
+
+/* Collect the lines to rewrite, the selected one or all of them, and
+ * the same lines of the identical files a record stands for. Without
+ * edits, only count them. Called with dup_lock held. */
+static size_t
+replace_edits(struct view *view, bool all, struct replace_edit *edits)
+{
+    size_t from = all ? 0 : view->lineno, to = all ? view->lines : view->lineno + 1;
+    size_t n = 0, i, j;
+
+    for (i = from; i < to; i++) {
+        struct fileinfo *fileinfo = view->line[i];
+        size_t ncopies = fileinfo->dup && !fileinfo->expanded ? fileinfo->dup->ncopies : 0;
+
+        if (edits)
+            edits[n] = (struct replace_edit) { fileinfo->name, fileinfo->lineno, fileinfo };
+        n++;
+        for (j = 0; j < ncopies; j++, n++)
+            if (edits)
+                edits[n] = (struct replace_edit) { fileinfo->dup->copies[j], fileinfo->lineno };
+    }
+
+    return n;
+}
+
+/* Ask for a line of text in the status window, Esc cancels. */
+static bool read_prompt(const char *prompt, char *buf, size_t buflen)
+{
+    size_t len = 0;
+    int c;
+
+    *buf = '\0';
+    wtimeout(status_win, -1);
+
+    for (;;) {
+        werase(status_win);
+        mvwaddstr(status_win, 0, 0, prompt);
+        waddstr(status_win, buf);
+        wrefresh(status_win);
+
+        c = wgetch(status_win);
+        if (c == '\r' || c == '\n' || c == KEY_ENTER || c == 27) {
+            werase(status_win);
+            wrefresh(status_win);
+            return c != 27;
+        }
+
+        if (c == KEY_BACKSPACE || c == 127 || c == '\b') {
+            /* Take away a whole UTF-8 character. */
+            while (len && (buf[len - 1] & 0xc0) == 0x80)
+                len--;
+            if (len)
+                len--;
+            buf[len] = '\0';
+        } else if (c >= ' ' && c < 256 && len + 1 < buflen) {
+            buf[len++] = c;
+            buf[len] = '\0';
+        }
+    }
+}
+
+static void main_replace(struct view *view, bool all)
+{
+    struct replace replace = { &opt_query.regex, opt_query.word };
+    struct replace_edit *edits = NULL;
+    pthread_t threads[REPLACE_WORKERS];
+    bool threaded[REPLACE_WORKERS] = { 0 };
+    char text[SIZEOF_STR], prompt[SIZEOF_STR + 32];   /* Room for the pattern. */
+    unsigned long stale = 0, failed = 0;
+    size_t nedits, i, j;
+    int nthreads;
+
+    if (view != VIEW(REQ_VIEW_MAIN) || !view->lines) {
+        report("Nothing to replace");
+        return;
+    }
+    if (view->search) {
+        report("Wait for the search to finish, or stop it with z");
+        return;
+    }
+
+    snprintf(prompt, sizeof(prompt), "Replace %s in %s with: ",
+             opt_query.pattern, all ? "all lines" : "this line");
+    if (!read_prompt(prompt, text, sizeof(text)))
+        return;
+
+    pthread_mutex_lock(&dup_lock);
+    nedits = replace_edits(view, all, NULL);
+    edits = calloc(nedits, sizeof(*edits));
+    if (edits)
+        replace_edits(view, all, edits);
+    pthread_mutex_unlock(&dup_lock);
+
+    if (!edits) {
+        report("Allocation failure");
+        return;
+    }
+    qsort(edits, nedits, sizeof(*edits), replace_compare);
+
+    /* One file for each run of edits with the same name. */
+    replace.files = calloc(nedits, sizeof(*replace.files));
+    if (!replace.files) {
+        free(edits);
+        report("Allocation failure");
+        return;
+    }
+    for (i = 0; i < nedits; i = j) {
+        for (j = i + 1; j < nedits && !strcmp(edits[i].name, edits[j].name); j++)
+            ;
+        replace.files[replace.nfiles].edits = edits + i;
+        replace.files[replace.nfiles++].nedits = j - i;
+    }
+
+    if (all) {
+        snprintf(prompt, sizeof(prompt), "Rewrite %zu lines in %zu files? [y/N] ",
+                 nedits, replace.nfiles);
+        report("%s", prompt);
+        wtimeout(status_win, -1);
+        if (wgetch(status_win) != 'y') {
+            report("Nothing replaced");
+            goto out;
+        }
+    }
+
+    report("Replacing...");
+    replace.text = text;
+    replace.since = view->loaded;
+
+    nthreads = replace.nfiles < REPLACE_WORKERS ? replace.nfiles : REPLACE_WORKERS;
+    for (i = 1; i < nthreads; i++)
+        threaded[i] = !pthread_create(&threads[i], NULL, replace_worker, &replace);
+    replace_worker(&replace);
+    for (i = 1; i < nthreads; i++)
+        if (threaded[i])
+            pthread_join(threads[i], NULL);
+
+    replace_remember(&replace);
+    for (i = 0; i < replace.nfiles; i++) {
+        if (replace.files[i].result == REPLACE_STALE)
+            stale++;
+        else if (replace.files[i].result == REPLACE_FAILED)
+            failed++;
+    }
+
+    redraw_view(view);
+    report("Replaced %lu lines in %lu files, %lu changed since the search, %lu failed",
+           replace.lines, (unsigned long) replace.nfiles - stale - failed, stale, failed);
+
+out:
+    free(replace.files);
+    free(edits);
+}
+
+/*
+ * Sorting
+ *
+ * The main view can be ordered by path, by matches per file or by file
+ * mtime. Each row gets a 64-bit key, its file's place in the order above
+ * its line number, and the keys are radix sorted by several threads.
+ * The files are ranked once per search: their names are merge sorted in
+ * parallel, and their mtimes are only looked up when asked for. Only the
+ * view index is permuted, the records stay where they are.
+ */
+
+#define SORT_THREADS_MAX    16
+#define SORT_SLICE          (64 * 1024)     /* Rows worth another thread. */
+
+enum sort_order {
+    SORT_ARRIVAL,
+    SORT_PATH,
+    SORT_MATCHES,
+    SORT_MTIME,
+};
+
+static const char *sort_order_names[] = {
+    "arrival", "path", "matches per file", "newest file",
+};
+
+struct sort_item {
+    unsigned long long key;
+    size_t index;
+};
+
+struct sort_file {
+    const char *name;
+    unsigned int rank;          /* In path order. */
+    unsigned int count;         /* Rows of the file. */
+    time_t mtime;
+};
+
+/* What is known about the rows of the main view since it was loaded. */
+static struct {
+    enum sort_order order;
+    struct fileinfo **arrival;  /* The rows as loaded, without copies. */
+    size_t rows;
+    unsigned int *file;         /* Of each row in arrival. */
+    unsigned int *lineno;       /* Of each row, not to visit the records. */
+    struct sort_file *files;
+    size_t nfiles;
+    bool ranked, stated;
+} main_sort;
+
+static void sort_forget(void)
+{
+    free(main_sort.arrival);
+    free(main_sort.file);
+    free(main_sort.lineno);
+    free(main_sort.files);
+    memset(&main_sort, 0, sizeof(main_sort));
+}
+
+static int sort_threads(size_t n)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = n / SORT_SLICE + 1;
+
+    if (ncpu < 1)
+        ncpu = 1;
+    if (threads > ncpu)
+        threads = ncpu;
+    return threads > SORT_THREADS_MAX ? SORT_THREADS_MAX : threads;
+}
+
+/* Run fn on every slice, the first one here. A thread that cannot be
+ * created leaves its slice to be run here too. */
+static void sort_run(void *(*fn)(void *), void *slices, size_t size, int n)
+{
+    pthread_t threads[SORT_THREADS_MAX];
+    bool threaded[SORT_THREADS_MAX] = { 0 };
+    int i;
+
+    for (i = 1; i < n; i++)
+        threaded[i] = !pthread_create(&threads[i], NULL, fn, (char *) slices + i * size);
+    fn(slices);
+    for (i = 1; i < n; i++)
+        if (threaded[i])
+            pthread_join(threads[i], NULL);
+        else
+            fn((char *) slices + i * size);
+}
+
+struct radix_slice {
+    struct sort_item *src, *dst;
+    size_t start, end;
+    int shift;
+    size_t count[256];          /* Then where each bucket goes. */
+};
+
+static void *radix_count(void *data)
+{
+    struct radix_slice *slice = data;
+    size_t i;
+
+    memset(slice->count, 0, sizeof(slice->count));
+    for (i = slice->start; i < slice->end; i++)
+        slice->count[(slice->src[i].key >> slice->shift) & 0xff]++;
+    return NULL;
+}
+
+static void *radix_scatter(void *data)
+{
+    struct radix_slice *slice = data;
+    size_t i;
+
+    for (i = slice->start; i < slice->end; i++)
+        slice->dst[slice->count[(slice->src[i].key >> slice->shift) & 0xff]++] = slice->src[i];
+    return NULL;
+}
+
+/* Sort items by key, keeping equal keys in order. A byte that is the
+ * same in every key costs one counting pass and no moves. */
+static bool radix_sort(struct sort_item *items, size_t n)
+{
+    struct radix_slice slices[SORT_THREADS_MAX];
+    struct sort_item *tmp = malloc(n * sizeof(*tmp)), *src = items, *dst = tmp;
+    int nslices = sort_threads(n), shift, i, b;
+
+    if (!tmp)
+        return false;
+
+    for (shift = 0; shift < 64; shift += 8) {
+        size_t offset = 0;
+
+        for (i = 0; i < nslices; i++) {
+            slices[i].src = src;
+            slices[i].dst = dst;
+            slices[i].start = n * i / nslices;
+            slices[i].end = n * (i + 1) / nslices;
+            slices[i].shift = shift;
+        }
+        sort_run(radix_count, slices, sizeof(*slices), nslices);
+
+        for (b = 0; b < 256; b++) {
+            size_t total = 0;
+
+            for (i = 0; i < nslices; i++)
+                total += slices[i].count[b];
+            if (total == n)
+                break;
+        }
+        if (b < 256)
+            continue;
+
+        for (b = 0; b < 256; b++) {
+            for (i = 0; i < nslices; i++) {
+                size_t count = slices[i].count[b];
+
+                slices[i].count[b] = offset;
+                offset += count;
+            }
+        }
+        sort_run(radix_scatter, slices, sizeof(*slices), nslices);
+
+        src = dst;
+        dst = src == items ? tmp : items;
+    }
+
+    if (src != items)
+        memcpy(items, src, n * sizeof(*items));
+    free(tmp);
+    return TRUE;
+}
+
+struct name_slice {
+    struct sort_file *files;
+    unsigned int *ids, *tmp;
+    size_t start, mid, end;
+};
+
+static struct sort_file *name_files;
+
+static int name_compare(const void *a, const void *b)
+{
+    return strcmp(name_files[*(const unsigned int *) a].name,
+                  name_files[*(const unsigned int *) b].name);
+}
+
+static void *name_sort(void *data)
+{
+    struct name_slice *slice = data;
+
+    qsort(slice->ids + slice->start, slice->end - slice->start, sizeof(*slice->ids), name_compare);
+    return NULL;
+}
+
+/* Merge the sorted runs [start, mid) and [mid, end) into tmp. */
+static void *name_merge(void *data)
+{
+    struct name_slice *slice = data;
+    size_t i = slice->start, j = slice->mid, k = slice->start;
+
+    while (i < slice->mid && j < slice->end)
+        slice->tmp[k++] = strcmp(slice->files[slice->ids[j]].name,
+                                 slice->files[slice->ids[i]].name) < 0 ?
+                          slice->ids[j++] : slice->ids[i++];
+    while (i < slice->mid)
+        slice->tmp[k++] = slice->ids[i++];
+    while (j < slice->end)
+        slice->tmp[k++] = slice->ids[j++];
+    return NULL;
+}
+
+/* Rank the files by name: runs sorted by threads, then merged pairwise
+ * with a thread per pair. */
+static bool sort_rank(void)
+{
+    struct name_slice slices[SORT_THREADS_MAX];
+    size_t bounds[SORT_THREADS_MAX + 1], n = main_sort.nfiles;
+    unsigned int *ids = malloc(n * sizeof(*ids)), *tmp = malloc(n * sizeof(*tmp));
+    int nruns = sort_threads(n), i, width;
+    size_t j;
+
+    if (!ids || !tmp) {
+        free(ids);
+        free(tmp);
+        return false;
+    }
+
+    for (j = 0; j < n; j++)
+        ids[j] = j;
+    name_files = main_sort.files;
+
+    for (i = 0; i <= nruns; i++)
+        bounds[i] = n * i / nruns;
+    for (i = 0; i < nruns; i++)
+        slices[i] = (struct name_slice) { main_sort.files, ids, tmp, bounds[i], 0, bounds[i + 1] };
+    sort_run(name_sort, slices, sizeof(*slices), nruns);
+
+    for (width = 1; width < nruns; width *= 2) {
+        unsigned int *swap;
+        int npairs = 0;
+
+        for (i = 0; i < nruns; i += 2 * width) {
+            int mid = i + width < nruns ? i + width : nruns;
+            int end = i + 2 * width < nruns ? i + 2 * width : nruns;
+
+            slices[npairs++] = (struct name_slice) {
+                main_sort.files, ids, tmp, bounds[i], bounds[mid], bounds[end]
+            };
+        }
+        sort_run(name_merge, slices, sizeof(*slices), npairs);
+        swap = ids;
+        ids = tmp;
+        tmp = swap;
+    }
+
+    for (j = 0; j < n; j++)
+        main_sort.files[ids[j]].rank = j;
+    free(ids);
+    free(tmp);
+    main_sort.ranked = TRUE;
+    return TRUE;
+}
+
+struct stat_slice {
+    struct sort_file *files;
+    size_t start, end;
+};
+
+static void *sort_stat(void *data)
+{
+    struct stat_slice *slice = data;
+    struct stat st;
+    size_t i;
+
+    for (i = slice->start; i < slice->end; i++)
+        slice->files[i].mtime = fstatat(opt_query.rootfd, slice->files[i].name, &st, 0) < 0
+                                ? 0 : st.st_mtime;
+    return NULL;
+}
+
+/* Look up the mtimes, many at once since they may be on a slow disk. */
+static void sort_stat_files(void)
+{
+    struct stat_slice slices[SORT_THREADS_MAX];
+    size_t n = main_sort.nfiles;
+    int nslices = n < SORT_THREADS_MAX ? 1 : SORT_THREADS_MAX, i;
+
+    for (i = 0; i < nslices; i++)
+        slices[i] = (struct stat_slice) { main_sort.files, n * i / nslices, n * (i + 1) / nslices };
+    sort_run(sort_stat, slices, sizeof(*slices), nslices);
+    main_sort.stated = TRUE;
+}
+
+static unsigned int sort_hash(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*name)
+        hash = (hash ^ (unsigned char) *name++) * 16777619;
+    return hash;
+}
+
+/* Take the rows as loaded and give each the id of its file. Rows of a
+ * file mostly come one after another, so most need no lookup. */
+static bool sort_load(struct view *view)
+{
+    unsigned int *table = NULL, mask = 0, id = 0;
+    size_t i, alloc = 0;
+
+    main_sort.rows = view->lines;
+    main_sort.arrival = malloc(view->lines * sizeof(*main_sort.arrival));
+    main_sort.file = malloc(view->lines * sizeof(*main_sort.file));
+    main_sort.lineno = malloc(view->lines * sizeof(*main_sort.lineno));
+    if (!main_sort.arrival || !main_sort.file || !main_sort.lineno)
+        goto error;
+    memcpy(main_sort.arrival, view->line, view->lines * sizeof(*main_sort.arrival));
+
+    for (i = 0; i < view->lines; i++) {
+        const char *name = main_sort.arrival[i]->name;
+        unsigned int slot;
+
+        main_sort.lineno[i] = main_sort.arrival[i]->lineno > UINT_MAX
+                              ? UINT_MAX : main_sort.arrival[i]->lineno;
+
+        if (i && !strcmp(name, main_sort.files[id].name)) {
+            main_sort.file[i] = id;
+            main_sort.files[id].count++;
+            continue;
+        }
+
+        /* Keep the table at most half full. */
+        if (main_sort.nfiles * 2 >= mask) {
+            unsigned int *grown, size = mask ? (mask + 1) * 2 : 1024;
+            size_t j;
+
+            grown = malloc(size * sizeof(*grown));
+            if (!grown)
+                goto error;
+            memset(grown, 0xff, size * sizeof(*grown));
+            for (j = 0; j < main_sort.nfiles; j++) {
+                slot = sort_hash(main_sort.files[j].name) & (size - 1);
+                while (grown[slot] != UINT_MAX)
+                    slot = (slot + 1) & (size - 1);
+                grown[slot] = j;
+            }
+            free(table);
+            table = grown;
+            mask = size - 1;
+        }
+
+        slot = sort_hash(name) & mask;
+        while (table[slot] != UINT_MAX && strcmp(main_sort.files[table[slot]].name, name))
+            slot = (slot + 1) & mask;
+
+        if (table[slot] == UINT_MAX) {
+            if (main_sort.nfiles == alloc) {
+                struct sort_file *files;
+
+                alloc = alloc * 2 + 1024;
+                files = realloc(main_sort.files, alloc * sizeof(*files));
+                if (!files)
+                    goto error;
+                main_sort.files = files;
+            }
+            table[slot] = main_sort.nfiles;
+            main_sort.files[main_sort.nfiles++] = (struct sort_file) { name };
+        }
+
+        id = table[slot];
+        main_sort.file[i] = id;
+        main_sort.files[id].count++;
     }
 
+    free(table);
     return TRUE;
 
-alloc_error:
-    printw("Allocation failure");
-
-end:
-    end_update(view);
-    return FALSE;
+error:
+    free(table);
+    sort_forget();
+    return false;
 }
 
-static void redraw_view_from(struct view *view, int lineno)
+/* Take the listed copies away, they are not rows of their own. */
+static void sort_collapse(struct view *view)
 {
-    assert(0 <= lineno && lineno < view->height);
+    size_t i, n = 0;
 
-    for (; lineno < view->height; lineno++) {
-        view->render(view, lineno);
-    }
+    for (i = 0; i < view->lines; i++) {
+        struct fileinfo *fileinfo = view->line[i];
 
-    redrawwin(view->win);
-    wrefresh(view->win);
+        if (fileinfo->copy) {
+            fileinfo_free(fileinfo);
+            continue;
+        }
+        fileinfo->expanded = 0;
+        view->line[n++] = fileinfo;
+    }
+    view->lines = n;
 }
 
-static void redraw_view(struct view *view)
+/* The place of each file in the order. */
+static bool sort_files(enum sort_order order, unsigned int *place)
 {
-    wclear(view->win);
-    redraw_view_from(view, 0);
-}
+    struct sort_item *items;
+    size_t i, n = main_sort.nfiles;
 
-static int length;
+    if (order == SORT_PATH) {
+        for (i = 0; i < n; i++)
+            place[i] = main_sort.files[i].rank;
+        return TRUE;
+    }
 
-static char *strsplit(const char *line, const char c)
-{
-    int i = 0;
-    static char word[BUFSIZ];
-    memset(word, 0, sizeof(word));
-    while (*line != c) {
-        word[i++] = *line;
-        line++;
+    items = malloc(n * sizeof(*items));
+    if (!items)
+        return false;
+
+    for (i = 0; i < n; i++) {
+        struct sort_file *file = &main_sort.files[i];
+        unsigned long long first = order == SORT_MATCHES ? UINT_MAX - file->count
+                                   : UINT_MAX - (unsigned int) file->mtime;
+
+        items[i] = (struct sort_item) { first << 32 | file->rank, i };
     }
-    word[i] = '\0';
-    return word;
-}
 
-static int strlength(const char *term)
-{
-    int i = 0;
-    const char *c = term;
-    while (*c != '\0') {
-        if (*c == '\t')
-            i += opt_tab_size;
-        else
-            i++;
-        c++;
+    if (!radix_sort(items, n)) {
+        free(items);
+        return false;
     }
-    length = i;
-    return length;
+    for (i = 0; i < n; i++)
+        place[items[i].index] = i;
+    free(items);
+    return TRUE;
 }
 
-/* when a file name containing blankspace, vim will consider
- * it as more than one file, in order to fix this problem,
- * so the function below renames the filename using '\ '
- * to instead of ' ', then vim can read the file.
- */
-static char *blankspace(const char *fname)
+static bool sort_rows(struct view *view, enum sort_order order)
 {
-    const char *tmp = fname;
-    int i, j;
-    static char localname[512];
-    int len = strlen(tmp);
+    struct sort_item *items;
+    unsigned int *place;
+    size_t i, n = main_sort.rows;
 
-    memset(localname, 0, sizeof(localname));
-    for (i = 0, j = 0; j < len; tmp++, j++)
-    {
-        if (isspace(*tmp))
-        {
-            localname[i++] = '\\';
-            localname[i++] = *tmp;
-            continue;
-        }
-        localname[i++] = *tmp;
+    if (order == SORT_ARRIVAL) {
+        memcpy(view->line, main_sort.arrival, n * sizeof(*view->line));
+        return TRUE;
     }
-    localname[i] = '\0';
-    return localname;
+
+    if (!main_sort.ranked && !sort_rank())
+        return false;
+    if (order == SORT_MTIME && !main_sort.stated)
+        sort_stat_files();
+
+    place = malloc(main_sort.nfiles * sizeof(*place));
+    items = malloc(n * sizeof(*items));
+    if (!place || !items || !sort_files(order, place)) {
+        free(place);
+        free(items);
+        return false;
+    }
+
+    for (i = 0; i < n; i++)
+        items[i] = (struct sort_item) {
+            (unsigned long long) place[main_sort.file[i]] << 32 | main_sort.lineno[i], i
+        };
+    free(place);
+
+    if (!radix_sort(items, n)) {
+        free(items);
+        return false;
+    }
+    for (i = 0; i < n; i++)
+        view->line[i] = main_sort.arrival[items[i].index];
+    free(items);
+    return TRUE;
 }
 
-static inline size_t
-string_expand(char *dst, size_t dstlen, const char *src, int tabsize)
+/* Show the rows in the next order, from the top. */
+static void main_sort_next(struct view *view)
 {
-    size_t size, pos;
+    enum sort_order order = (main_sort.order + 1) % ARRAY_SIZE(sort_order_names);
+    struct timespec start, end;
 
-    for (size = pos = 0; size < dstlen - 1 && src[pos]; pos++) {
-        if (src[pos] == '\t') {
-            size_t expanded = tabsize - (size % tabsize);
+    if (view != VIEW(REQ_VIEW_MAIN) || !view->lines) {
+        report("Nothing to sort");
+        return;
+    }
+    if (view->search) {
+        report("Wait for the search to finish, or stop it with z");
+        return;
+    }
 
-            if (expanded + size >= dstlen - 1)
-                expanded = dstlen - size - 1;
-            memcpy(dst + size, "        ", expanded);
-            size += expanded;
-        } else {
-            dst[size++] = src[pos];
-        }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!main_sort.arrival || view->lines != main_sort.rows)
+        sort_collapse(view);
+
+    if ((!main_sort.arrival && !sort_load(view)) || !sort_rows(view, order)) {
+        report("Allocation failure");
+        return;
     }
+    main_sort.order = order;
+    runs_invalidate();
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    dst[size] = 0;
-    return pos;
+    view->lineno = view->offset = 0;
+    redraw_view(view);
+    report("Sorted %lu lines by %s in %ldms", view->lines, sort_order_names[order],
+           (long) ((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000));
 }
 
-static bool default_read(struct view *view, char *line)
+/*
+ * Navigation
+ *
+ * The main view keeps the line where each run of lines from one file
+ * starts, appended as lines are loaded and rebuilt after the lines are
+ * reordered. Going to the next or previous file is a binary search in
+ * it, and every jump repaints the screen once.
+ */
+
+static struct {
+    unsigned long *start;       /* Of each run, ascending. */
+    size_t nruns, alloc;
+    bool stale;                 /* The lines moved since it was built. */
+    char find[SIZEOF_STR];      /* What / looks for. */
+} main_runs;
+
+static void runs_forget(void)
 {
-    struct fileinfo *fileinfo;
-    char *end;
+    free(main_runs.start);
+    main_runs.start = NULL;
+    main_runs.nruns = main_runs.alloc = 0;
+    main_runs.stale = false;
+}
 
-    fileinfo= calloc(1, sizeof(struct fileinfo));
-    if (!fileinfo)
-        return false;
+/* Note a line when it starts a run, for lines appended in order. */
+static void runs_add(struct view *view, unsigned long lineno)
+{
+    struct fileinfo *fileinfo = view->line[lineno];
 
-    line += 2;
-    view->line[view->lines++] = fileinfo;
-    string_copy(fileinfo->name, strsplit(line, ':'));
+    if (main_runs.stale ||
+        (lineno && !strcmp(((struct fileinfo *) view->line[lineno - 1])->name, fileinfo->name)))
+        return;
 
-    end = strchr(line, ':');
-    end += 1;
-    string_copy(fileinfo->number, strsplit(end, ':'));
+    if (main_runs.nruns == main_runs.alloc) {
+        size_t alloc = main_runs.alloc * 2 + 1024;
+        unsigned long *tmp = realloc(main_runs.start, alloc * sizeof(*tmp));
 
-    end = strchr(end, ':');
-    end += 1;
-    while (isspace(*end))
-        end++;
-    string_copy(fileinfo->content, end);
+        /* Without room, rebuild when it is needed. */
+        if (!tmp) {
+            main_runs.stale = TRUE;
+            return;
+        }
+        main_runs.start = tmp;
+        main_runs.alloc = alloc;
+    }
+    main_runs.start[main_runs.nruns++] = lineno;
+}
 
-    return TRUE;
+/* The lines were reordered. */
+static void runs_invalidate(void)
+{
+    main_runs.stale = TRUE;
 }
 
-static bool default_render(struct view *view, unsigned int lineno)
+static bool runs_update(struct view *view)
 {
-    struct fileinfo *fileinfo;
-    enum line_type type;
-    int col = 0;
-    size_t namelen;
-    char *fname, *fnumber;
-    int opt_file_name = 25;
-    char text[SIZEOF_STR];
+    unsigned long i;
 
-    if (view->offset + lineno >= view->lines)
-        return false;
+    if (!main_runs.stale)
+        return TRUE;
 
-    fileinfo = view->line[view->offset + lineno];
-    if (!*fileinfo->name)
-        return false;
+    main_runs.nruns = 0;
+    main_runs.stale = false;
+    for (i = 0; i < view->lines && !main_runs.stale; i++)
+        runs_add(view, i);
+    return !main_runs.stale;
+}
 
-    fnumber = fileinfo->number;
-    fname = blankspace(fileinfo->name);
-    wmove(view->win, lineno, col);
+/* The run holding the line. */
+static size_t runs_find(unsigned long lineno)
+{
+    size_t low = 0, high = main_runs.nruns;
 
-    if (view->offset + lineno == view->lineno) {
-        snprintf(vim_cmd, sizeof(vim_cmd), VIM_CMD, fnumber, fname);
-        type = LINE_CURSOR;
-        wattrset(view->win, get_line_attr(type));
-        wchgat(view->win, -1, 0, type, NULL);
-        string_copy(view->file, fileinfo->name);
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
 
-    } else {
-        type = LINE_FILE_LINCON;
-        wchgat(view->win, -1, 0, type, NULL);
-        wattrset(view->win, get_line_attr(LINE_FILE_NAME));
+        if (main_runs.start[mid] <= lineno)
+            low = mid;
+        else
+            high = mid;
     }
 
-    namelen = strlen(fileinfo->name);
-    if (namelen > opt_file_name){
-        int n = namelen-opt_file_name;
-        if (type != LINE_CURSOR)
-            wattrset(view->win, get_line_attr(LINE_DELIMITER));
-        waddch(view->win, '~');
-        if (type != LINE_CURSOR)
-            wattrset(view->win, get_line_attr(LINE_FILE_NAME));
-        waddnstr(view->win, fileinfo->name + n, opt_file_name);
-    }
-    else
-        waddstr(view->win, fileinfo->name);
+    return low;
+}
 
-    col += opt_file_name + 2;
-    wmove(view->win, lineno, col);
-    if (type != LINE_CURSOR)
-        wattrset(view->win, get_line_attr(LINE_FILE_LINUM));
+/* Select the line, scrolling only when it is out of sight. */
+static void jump_view(struct view *view, unsigned long lineno)
+{
+    unsigned long prev = view->lineno, offset;
 
-    waddstr(view->win, fileinfo->number);
+    if (lineno >= view->lines)
+        lineno = view->lines - 1;
+    view->lineno = lineno;
 
-    col += 9;
-    if (type != LINE_CURSOR)
-        wattrset(view->win, A_NORMAL);
+    if (lineno >= view->offset && lineno < view->offset + view->height) {
+        if (prev >= view->offset && prev < view->offset + view->height)
+            view->render(view, prev - view->offset);
+        view->render(view, lineno - view->offset);
+        redrawwin(view->win);
+        wrefresh(view->win);
+        update_title_win(view);
+        return;
+    }
 
-    wmove(view->win, lineno, col);
+    /* Put the line in the middle, unless that leaves the end empty. */
+    offset = lineno > view->height / 2 ? lineno - view->height / 2 : 0;
+    if (view->lines > view->height && offset > view->lines - view->height)
+        offset = view->lines - view->height;
 
-    if (type != LINE_CURSOR)
-        wattrset(view->win, get_line_attr(type));
+    /* The old line may stay in sight after scrolling. */
+    if (prev >= view->offset && prev < view->offset + view->height)
+        view->render(view, prev - view->offset);
+    move_view(view, (long) offset - (long) view->offset);
+}
 
-    int contentlen = strlength(fileinfo->content);
-    string_expand(text, sizeof(text), fileinfo->content, opt_tab_size);
+static void main_jump_file(struct view *view, bool next)
+{
+    size_t run;
 
-    if (col + contentlen > view->width){
-        contentlen = view->width - col;
-        if (contentlen < 0)
-            return TRUE;
-        else {
-            waddnstr(view->win, text, contentlen-1);
-            if (type != LINE_CURSOR)
-                wattrset(view->win, get_line_attr(LINE_DELIMITER));
-            waddch(view->win, '~');
-        }
+    if (view != VIEW(REQ_VIEW_MAIN) || !view->lines) {
+        report("Nothing to move to");
+        return;
     }
-    else {
-        waddstr(view->win, fileinfo->content);
+    if (!runs_update(view)) {
+        report("Allocation failure");
+        return;
     }
-    report("");
 
-    return TRUE;
+    run = runs_find(view->lineno);
+    if (next && run + 1 < main_runs.nruns) {
+        jump_view(view, main_runs.start[run + 1]);
+    } else if (!next && run > 0) {
+        jump_view(view, main_runs.start[run - 1]);
+    } else {
+        report("already at %s file", next ? "last" : "first");
+        return;
+    }
+
+    report("file %zu of %zu", runs_find(view->lineno) + 1, main_runs.nruns);
 }
 
-static void open_view(struct view *prev)
+/* Go to a line number, or to a percentage of the lines with "%". */
+static void main_goto(struct view *view)
 {
-    struct view *view = &main_view;
+    char text[SIZEOF_STR], *end;
+    unsigned long lineno;
 
-    if (view == prev) {
-        report("Already in %s view", view->name);
+    if (!view->lines) {
+        report("Nothing to move to");
         return;
     }
+    if (!read_prompt("Go to line (or N%): ", text, sizeof(text)))
+        return;
 
-    if (!begin_update(view)) {
-        report("Failed to load %s view", view->name);
+    lineno = strtoul(text, &end, 10);
+    if (end == text || (*end && strcmp(end, "%"))) {
+        report("Not a line number: %s", text);
         return;
     }
+    if (*end == '%')
+        lineno = lineno >= 100 ? view->lines : view->lines * lineno / 100;
+    jump_view(view, lineno ? lineno - 1 : 0);
+}
 
-    /* Maximize the current view. */
-    memset(display, 0, sizeof(display));
-    current_view = 0;
-    display[current_view] = view;
+/* Look for the next line with the text in its content, or the next
+ * file with it in its name, going round at the end. The name is only
+ * checked once for each run of a file. */
+static void main_find(struct view *view, bool next)
+{
+    unsigned long at = view->lineno, i;
+    size_t run, was;
+    bool named = false;
 
-    resize_display();
+    if (view != VIEW(REQ_VIEW_MAIN) || !view->lines) {
+        report("Nothing to find in");
+        return;
+    }
+    if (!*main_runs.find) {
+        report("Type / to find first");
+        return;
+    }
+    if (!runs_update(view)) {
+        report("Allocation failure");
+        return;
+    }
 
-    if (view->pipe) {
-        /* Clear the old view and let the incremental updating refill
-         * the screen. */
-        wclear(view->win);
-        report("Loading...");
+    run = runs_find(at);
+    for (i = 1; i <= view->lines; i++) {
+        struct fileinfo *fileinfo;
+
+        was = run;
+        if (next) {
+            at = at + 1 < view->lines ? at + 1 : 0;
+            if (!at)
+                run = 0;
+            else if (run + 1 < main_runs.nruns && at == main_runs.start[run + 1])
+                run++;
+        } else {
+            at = at ? at - 1 : view->lines - 1;
+            if (at == view->lines - 1)
+                run = main_runs.nruns - 1;
+            else if (at < main_runs.start[run])
+                run--;
+        }
+
+        if (i == 1 || run != was) {
+            fileinfo = view->line[main_runs.start[run]];
+            named = strcasestr(fileinfo->name, main_runs.find) != NULL;
+        }
+
+        fileinfo = view->line[at];
+        if ((named && at == main_runs.start[run]) ||
+            strcasestr(fileinfo->content, main_runs.find)) {
+            jump_view(view, at);
+            report("%s: line %lu of %lu%s", main_runs.find, at + 1, view->lines,
+                   i == view->lines ? ", the only one" : "");
+            return;
+        }
     }
+
+    report("%s not found", main_runs.find);
+}
+
+static void main_find_prompt(struct view *view)
+{
+    char text[SIZEOF_STR];
+
+    if (!read_prompt("Find: ", text, sizeof(text)))
+        return;
+    if (*text)
+        string_copy(main_runs.find, text);
+    main_find(view, TRUE);
 }
 
 static int view_driver(struct view *view, int key)
@@ -937,7 +8393,62 @@ static int view_driver(struct view *view, int key)
         quit(0);
         break;
 
+    case REQ_STOP_LOADING:
+        if (view && view->search) {
+            search_cancel(view->search);
+            report("Stopping search...");
+        } else {
+            report("Nothing to stop");
+        }
+        break;
+
+    case REQ_ENTER:
+        if (view == VIEW(REQ_VIEW_COUNTS) && view->lines) {
+            struct count_entry *entry = view->line[view->lineno];
+
+            if (entry->path[strlen(entry->path) - 1] == '/')
+                report("Select a file to search it");
+            else
+                open_view(view, VIEW(REQ_VIEW_MAIN), entry->path);
+        } else if (view == VIEW(REQ_VIEW_FILES)) {
+            return view_driver(view, REQ_OPEN_VIM);
+        } else if (view == VIEW(REQ_VIEW_MAIN) && view->lines) {
+            main_expand(view);
+        }
+        break;
+
+    case REQ_REPLACE:
+    case REQ_REPLACE_LINE:
+        main_replace(view, key == REQ_REPLACE);
+        break;
+
+    case REQ_SORT:
+        main_sort_next(view);
+        break;
+
+    case REQ_NEXT_FILE:
+    case REQ_PREV_FILE:
+        main_jump_file(view, key == REQ_NEXT_FILE);
+        break;
+
+    case REQ_GOTO:
+        main_goto(view);
+        break;
+
+    case REQ_FIND:
+        main_find_prompt(view);
+        break;
+
+    case REQ_FIND_NEXT:
+    case REQ_FIND_PREV:
+        main_find(view, key == REQ_FIND_NEXT);
+        break;
+
     case REQ_OPEN_VIM:
+        if (!*vim_cmd) {
+            report("Nothing to open");
+            break;
+        }
         report("Shelling out...");
         def_prog_mode();           /* save current tty modes */
         endwin();                  /* end curses mode temporarily */
@@ -947,7 +8458,9 @@ static int view_driver(struct view *view, int key)
         break;
 
     case REQ_VIEW_MAIN:
-        open_view(view);
+    case REQ_VIEW_COUNTS:
+    case REQ_VIEW_FILES:
+        open_view(view, VIEW(key), "");
         break;
 
     case REQ_SCREEN_RESIZE:
@@ -956,6 +8469,8 @@ static int view_driver(struct view *view, int key)
         break;
 
     default:
+        if (view == VIEW(REQ_VIEW_FILES) && files_key(key))
+            files_input(view, key);
         return TRUE;
     }
 
@@ -1051,6 +8566,12 @@ static void move_view(struct view *view, int lines)
     int line = lines > 0 ? view->height - lines : 0;
     int end = line + (lines > 0 ? lines : -lines);
 
+    /* A jump further than a screen shows only new lines. */
+    if (line < 0)
+        line = 0;
+    if (end > view->height)
+        end = view->height;
+
 		logout("[: move_view] line=%d, end=%d\n", line, end);
 
     wscrl(view->win, lines);
@@ -1073,6 +8594,11 @@ static void move_view(struct view *view, int lines)
         view->lineno = view->offset + view->height - 1;
         view->render(view, view->lineno - view->offset);
     }
+    else
+    {
+        /* A jump lands anywhere, not only on the new lines. */
+        view->render(view, view->lineno - view->offset);
+    }
 
 		logout("[: move_view] lineno=%lu\n", view->lineno);
 